@@ -0,0 +1,109 @@
+// benchLayout - Compare raster and tiled image layouts.
+//
+// Times some operations of the image8bit module on the same synthetic
+// images stored in each layout (see ImageCreateLayout), and checks that
+// both layouts give the same results.
+// Tiling wins where pixels are accessed by columns (rotate, vertical
+// blur) on wide images, whose rows do not fit in the cache together.
+//
+// This program is part of a programming project
+// for the course AED, DETI / UA.PT
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+// Fill img with a deterministic pseudo-random pattern.
+static void fill(Image img, unsigned seed) {
+  for (int y = 0; y < ImageHeight(img); y++) {
+    for (int x = 0; x < ImageWidth(img); x++) {
+      seed = seed * 1103515245u + 12345u;
+      ImageSetPixel(img, x, y, (uint8)(seed >> 16));
+    }
+  }
+}
+
+// Do a and b have the same pixels?
+static int same(Image a, Image b) {
+  if (ImageWidth(a) != ImageWidth(b) || ImageHeight(a) != ImageHeight(b)) return 0;
+  return ImageMatchSubImage(a, 0, 0, b);
+}
+
+// Make a copy of src with the given layout.
+static Image copyAs(Image src, ImageLayout layout) {
+  Image img = ImageCrop(src, 0, 0, ImageWidth(src), ImageHeight(src));
+  if (img == NULL || !ImageSetLayout(img, layout)) {
+    fprintf(stderr, "Out of memory\n");
+    exit(2);
+  }
+  return img;
+}
+
+static const char* layoutName[] = { "raster", "tiled" };
+
+// Time operations on a width x height image, in both layouts.
+// Requires: width, height >= 64.
+static int bench(int width, int height) {
+  assert (width >= 64 && height >= 64);
+  int ok = 1;
+  Image src = ImageCreate(width, height, PixMax);
+  if (src == NULL) { fprintf(stderr, "Out of memory\n"); exit(2); }
+  fill(src, (unsigned)width);
+  Image tmpl = ImageCrop(src, width - 64, height - 64, 48, 48);  // near the end
+  assert (tmpl != NULL);
+
+  Image res[2][3];   // results of rotate, blur and negative, per layout
+  double t[2][4];
+  for (int l = 0; l < 2; l++) {
+    Image img = copyAs(src, (ImageLayout)l);
+    double t0 = cpu_time();
+    res[l][0] = ImageRotate(img);
+    double t1 = cpu_time();
+    res[l][1] = copyAs(img, (ImageLayout)l);
+    double t2 = cpu_time();
+    ImageBlur(res[l][1], 0, 4);   // vertical only
+    double t3 = cpu_time();
+    int x = -1, y = -1;
+    ok = ok && ImageLocateSubImage(img, &x, &y, tmpl) && x == width - 64 && y == height - 64;
+    double t4 = cpu_time();
+    ImageNegative(img);
+    double t5 = cpu_time();
+    res[l][2] = img;
+    t[l][0] = t1 - t0;
+    t[l][1] = t3 - t2;
+    t[l][2] = t4 - t3;
+    t[l][3] = t5 - t4;
+  }
+  for (int i = 0; i < 3; i++) {
+    ok = ok && same(res[0][i], res[1][i]);
+    ImageDestroy(&res[0][i]);
+    ImageDestroy(&res[1][i]);
+  }
+
+  printf("%5dx%-5d %-7s %9s %9s %9s %9s\n", width, height, "layout", "rotate", "blur 0,4", "locate", "neg");
+  for (int l = 0; l < 2; l++) {
+    printf("%11s %-7s %9.4f %9.4f %9.4f %9.4f\n", "", layoutName[l], t[l][0], t[l][1], t[l][2], t[l][3]);
+  }
+  printf("%11s %-7s %8.2fx %8.2fx %8.2fx %8.2fx  %s\n", "", "speedup",
+         t[0][0] / t[1][0], t[0][1] / t[1][1], t[0][2] / t[1][2], t[0][3] / t[1][3],
+         ok ? "(same results)" : "RESULTS DIFFER!");
+  ImageDestroy(&tmpl);
+  ImageDestroy(&src);
+  return ok;
+}
+
+int main(int argc, char* argv[]) {
+  ImageInit();
+  printf("# Times in seconds of CPU time\n");
+  int ok = 1;
+  if (argc == 3) {
+    ok = bench(atoi(argv[1]), atoi(argv[2]));
+  } else {
+    ok = bench(1024, 1024) && ok;
+    ok = bench(8192, 512) && ok;
+    ok = bench(32768, 256) && ok;
+  }
+  return ok ? 0 : 1;
+}
@@ -17,6 +17,7 @@
 // Date:
 //24/11/2023
 
+#define _GNU_SOURCE   // for memfd_create and file sealing
 #include "image8bit.h"
 #include <string.h>
 #include <assert.h>
@@ -26,6 +27,16 @@
 #include <stdlib.h>
 #include "instrumentation.h"
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <math.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 // The data structure
 //
@@ -39,21 +50,242 @@
 //   pixel position (x,y) = (33,0) is stored in img->pixel[33];
 //   pixel position (x,y) = (22,1) is stored in img->pixel[122].
 // 
+// Alternatively (img->layout == IMAGE_TILED), the image is split into
+// 64x64 tiles, stored one after the other in raster order of tiles, each
+// tile being a raster scan of its 64x64 pixels.  Tiles on the right and
+// bottom edges are padded to full size; padding pixels are never read.
+// Pixel (x,y) of a tiled image is stored in img->pixel[G(img, x, y)].
+// 
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
 // structure fields directly.
 
 // Maximum value you can store in a pixel (maximum maxval accepted)
 const uint8 PixMax = 255;
+const uint16_t PixMax16 = 65535;
+
+// Maximum number of levels of an image pyramid (see ImagePyramidLevel)
+#define PYRAMID_MAX 32
+
+// Maximum number of dirty rectangles kept (see ImageBlurCached)
+#define DIRTY_MAX 16
+
+// A rectangle of pixels: columns [x0, x1), rows [y0, y1)
+struct dirtyRect {
+  int x0, y0, x1, y1;
+};
 
-// Internal structure for storing 8-bit graymap images
+// Internal structure for storing 8-bit (or 16-bit) graymap images
 struct image {
   int width;
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
-  uint8* pixel; // pixel data (a raster scan)
+  uint8* pixel; // pixel data (a raster scan, or tiles)
+  int depth;              // bits per pixel: 8, or 16 (host byte order)
+  ImageLayout layout;     // IMAGE_RASTER or IMAGE_TILED
+  int tilesX, tilesY;     // number of tile columns and rows (tiled layout)
+  size_t size;            // size of pixel array, in bytes (with padding)
+  size_t mapped;          // length of the mapping with the pixels (see
+                          // ImageImport), or 0 if they were malloc'ed
+  pthread_mutex_t lock;   // protects the caches (for concurrent queries)
+  int statsValid;         // is the stats cache up to date?
+  ImageStatistics stats;  // cached result of ImageStatsEx
+  int pyramidLevels;      // number of pyramid levels cached (level 0 = img)
+  struct image* pyramid[PYRAMID_MAX];  // cached pyramid levels 1, 2, ...
+  struct image* blurred;  // cached blur (see ImageBlurCached), or NULL
+  int blurDx, blurDy;     // its filter size
+  int dirtyAll;           // modified all over since blurred was updated?
+  int dirtyCount;         // otherwise, the rectangles modified since then
+  struct dirtyRect dirty[DIRTY_MAX];
 };
 
+static void pyramidDrop(Image img);
+
+// Exported images (see ImageExport) hold a header, and the pixel array
+// at offset EXPORT_HDR.
+#define EXPORT_HDR 64
+
+// Free the pixel array of img (allocated, or mapped by ImageImport).
+static void freePixels(Image img) {
+  if (img->mapped > 0) {
+    munmap(img->pixel - EXPORT_HDR, img->mapped);
+    img->mapped = 0;
+  } else {
+    free(img->pixel);
+  }
+}
+
+// Every function that modifies pixels must call this to invalidate the
+// information cached on the image.
+static inline void imageModified(Image img) {
+  img->statsValid = 0;
+  if (img->pyramidLevels > 1) pyramidDrop(img);
+  img->dirtyAll = 1;
+}
+
+// Extend rectangle d to cover r too.
+static inline void rectUnion(struct dirtyRect* d, const struct dirtyRect* r) {
+  if (r->x0 < d->x0) d->x0 = r->x0;
+  if (r->y0 < d->y0) d->y0 = r->y0;
+  if (r->x1 > d->x1) d->x1 = r->x1;
+  if (r->y1 > d->y1) d->y1 = r->y1;
+}
+
+static inline int64_t rectArea(const struct dirtyRect* r) {
+  return (int64_t)(r->x1 - r->x0) * (r->y1 - r->y0);
+}
+
+// Like imageModified, for functions that only modify the pixels of the
+// rectangle at (x,y) with size (w,h): the rectangle is recorded as
+// dirty, so that a cached blur is only updated around it.
+static void imageModifiedRect(Image img, int x, int y, int w, int h) {
+  img->statsValid = 0;
+  if (img->pyramidLevels > 1) pyramidDrop(img);
+  if (img->blurred == NULL || img->dirtyAll || w == 0 || h == 0) return;
+  struct dirtyRect r = { x, y, x + w, y + h };
+  struct dirtyRect* d = img->dirty;
+  int n = img->dirtyCount;
+  // Merge with a rectangle that it overlaps or touches (the last one
+  // first: runs of ImageSetPixel grow the same rectangle)
+  for (int i = n - 1; i >= 0; i--) {
+    if (r.x0 <= d[i].x1 && d[i].x0 <= r.x1 && r.y0 <= d[i].y1 && d[i].y0 <= r.y1) {
+      rectUnion(&d[i], &r);
+      return;
+    }
+  }
+  if (n < DIRTY_MAX) {
+    d[n] = r;
+    img->dirtyCount = n + 1;
+    return;
+  }
+  // All taken: merge with the rectangle whose area grows the least
+  int best = 0;
+  int64_t bestGrowth = INT64_MAX;
+  for (int i = 0; i < n; i++) {
+    struct dirtyRect u = d[i];
+    rectUnion(&u, &r);
+    int64_t growth = rectArea(&u) - rectArea(&d[i]);
+    if (growth < bestGrowth) {
+      best = i;
+      bestGrowth = growth;
+    }
+  }
+  rectUnion(&d[best], &r);
+}
+
+// Tiles are TILE x TILE pixels, with TILE = 2^TILE_SHIFT.
+#define TILE_SHIFT 6
+#define TILE (1 << TILE_SHIFT)
+#define TILE_MASK (TILE - 1)
+#define TILE_PIXELS ((size_t)1 << (2*TILE_SHIFT))
+
+// Set the layout fields of img (width, height and depth must be set).
+// 16-bit images are always raster scans.
+// Returns 0 if the size of the pixel array does not fit in a size_t
+// (then img->size is not valid).
+static int layoutInit(Image img, ImageLayout layout) {
+  assert (img->depth == 8 || layout == IMAGE_RASTER);
+  img->layout = layout;
+  size_t n;
+  if (layout == IMAGE_TILED) {
+    img->tilesX = (int)(((unsigned)img->width + TILE_MASK) >> TILE_SHIFT);
+    img->tilesY = (int)(((unsigned)img->height + TILE_MASK) >> TILE_SHIFT);
+    return !__builtin_mul_overflow((size_t)img->tilesX, (size_t)img->tilesY, &n) &&
+           !__builtin_mul_overflow(n, TILE_PIXELS, &img->size);
+  }
+  img->tilesX = img->tilesY = 0;
+  return !__builtin_mul_overflow((size_t)img->width, (size_t)img->height, &n) &&
+         !__builtin_mul_overflow(n, (size_t)(img->depth / 8), &img->size);
+}
+
+// Number of pixels from (x,y) to the right that are contiguous in memory:
+// the rest of the row (raster) or of the tile row (tiled).
+static inline int spanLength(Image img, int x) {
+  int n = img->width - x;
+  if (img->layout == IMAGE_TILED && n > TILE - (x & TILE_MASK)) {
+    n = TILE - (x & TILE_MASK);
+  }
+  return n;
+}
+
+// Storage rows: the pixel array is a sequence of storageRows(img) blocks of
+// storageRowBytes(img) bytes, each holding whole pixel rows: one pixel
+// row (raster), or one row of tiles (tiled).  Bands split these blocks.
+static inline int storageRows(Image img) {
+  return img->layout == IMAGE_TILED ? img->tilesY : img->height;
+}
+
+static inline size_t storageRowBytes(Image img) {
+  return img->layout == IMAGE_TILED ? (size_t)img->tilesX * TILE_PIXELS
+                                    : (size_t)img->width;
+}
+
+// Offset of pixel (x,y) in the pixel array, for either layout.
+static inline size_t pixelOffset(Image img, int x, int y) {
+  if (img->layout == IMAGE_TILED) {
+    size_t tile = (size_t)(y >> TILE_SHIFT) * img->tilesX + (x >> TILE_SHIFT);
+    return (tile << (2*TILE_SHIFT)) + ((size_t)(y & TILE_MASK) << TILE_SHIFT) + (x & TILE_MASK);
+  }
+  return (size_t)y * img->width + x;
+}
+
+// Span operations
+//
+// These work on n consecutive pixels of a row, starting at column x,
+// in images of any layout, splitting them into contiguous pieces.
+
+// Number of pixels (at most n) from column xa of a and column xb of b
+// that are contiguous in both images.
+static inline int commonSpan(Image a, int xa, Image b, int xb, int n) {
+  int c = spanLength(a, xa);
+  int cb = spanLength(b, xb);
+  if (c > cb) c = cb;
+  return (c > n) ? n : c;
+}
+
+// Copy n pixels from row sy of src (from column sx) to row dy of dst
+// (from column dx).  Regions must not overlap.
+static void copySpan(Image dst, int dx, int dy, Image src, int sx, int sy, int n) {
+  while (n > 0) {
+    int c = commonSpan(dst, dx, src, sx, n);
+    memcpy(dst->pixel + pixelOffset(dst, dx, dy), src->pixel + pixelOffset(src, sx, sy), (size_t)c);
+    dx += c; sx += c; n -= c;
+  }
+}
+
+// Are n pixels from row ay of a (from column ax) equal to those of
+// row by of b (from column bx)?
+static int equalSpan(Image a, int ax, int ay, Image b, int bx, int by, int n) {
+  while (n > 0) {
+    int c = commonSpan(a, ax, b, bx, n);
+    if (memcmp(a->pixel + pixelOffset(a, ax, ay), b->pixel + pixelOffset(b, bx, by), (size_t)c) != 0) {
+      return 0;
+    }
+    ax += c; bx += c; n -= c;
+  }
+  return 1;
+}
+
+// Copy n pixels from row y of img (from column x) to buf.
+static void getSpan(Image img, int x, int y, int n, uint8* buf) {
+  while (n > 0) {
+    int c = spanLength(img, x);
+    if (c > n) c = n;
+    memcpy(buf, img->pixel + pixelOffset(img, x, y), (size_t)c);
+    buf += c; x += c; n -= c;
+  }
+}
+
+// Copy n pixels from buf to row y of img (from column x).
+static void putSpan(Image img, int x, int y, int n, const uint8* buf) {
+  while (n > 0) {
+    int c = spanLength(img, x);
+    if (c > n) c = n;
+    memcpy(img->pixel + pixelOffset(img, x, y), buf, (size_t)c);
+    buf += c; x += c; n -= c;
+  }
+}
+
 
 // This module follows "design-by-contract" principles.
 // Read `Design-by-Contract.md` for more details.
@@ -71,14 +303,15 @@ struct image {
 // the ImageErrMsg() function to produce informative error messages.
 // The use of the GNU standard library error() function is recommended for
 // this purpose.
+// Like errno, errCause is thread-local: each thread sees its own failures.
 //
 // Additional information:  man 3 errno;  man 3 error;
 
 // Variable to preserve errno temporarily
-static int errsave = 0;
+static _Thread_local int errsave = 0;
 
-// Error cause
-static char* errCause;
+// Error cause (of the last failure in this thread)
+static _Thread_local char* errCause;
 
 /// Error cause.
 /// After some other module function fails (and returns an error code),
@@ -88,6 +321,7 @@ static char* errCause;
 ///
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
+/// The error cause is kept per thread, like errno.
 char* ImageErrMsg() { ///
   return errCause;
 }
@@ -142,7 +376,7 @@ static int check(int condition, const char* failmsg) {
 }
 
 
-/// Init Image library.  (Call once!)
+/// Init Image library.  (Call once, before starting other threads!)
 /// Currently, simply calibrate instrumentation and set names of counters.
 void ImageInit(void) { ///
   InstrCalibrate();
@@ -167,21 +401,108 @@ void ImageInit(void) { ///
 #define MEM_ALLOC_FAILURES   InstrCount[6]
 
 
+// Parallel execution
+//
+// Some operations process the image in independent horizontal bands of
+// rows, which may be handed to different threads.  The number of threads
+// is the number of online processors, unless overridden by the
+// IMAGE8BIT_THREADS environment variable.  Small jobs run in the caller.
+
+// Maximum number of threads used by a single operation
+#define MAX_THREADS 64
+
+// Minimum number of pixels per band worth starting a thread for
+#define MIN_BAND_PIXELS (64*1024)
+
+// Function applied to rows [y0, y1) of a band; band is the band number.
+typedef void (*BandFunc)(void* arg, int band, int y0, int y1);
+
+struct bandJob {
+  BandFunc func;
+  void* arg;
+  int band, y0, y1;
+};
+
+static void* bandWorker(void* p) {
+  struct bandJob* job = (struct bandJob*)p;
+  job->func(job->arg, job->band, job->y0, job->y1);
+  return NULL;
+}
+
+static int nthreads = 1;
+static pthread_once_t nthreadsOnce = PTHREAD_ONCE_INIT;
+
+static void detectThreads(void) {
+  long n = 0;
+  const char* env = getenv("IMAGE8BIT_THREADS");
+  if (env != NULL) n = strtol(env, NULL, 10);
+  if (n <= 0) n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n <= 0) n = 1;
+  nthreads = (n > MAX_THREADS) ? MAX_THREADS : (int)n;
+}
+
+// Limit set by ImageSetThreads for the calling thread (0: none)
+static _Thread_local int threadLimit = 0;
+
+// Number of threads to use (determined once, and limited per thread).
+static int numThreads(void) {
+  pthread_once(&nthreadsOnce, detectThreads);
+  return (threadLimit > 0 && threadLimit < nthreads) ? threadLimit : nthreads;
+}
+
+/// Limit the number of threads used by each operation called from the
+/// calling thread to n (n <= 0 removes the limit).
+/// For callers that already run operations in several threads.
+void ImageSetThreads(int n) { ///
+  threadLimit = n > 0 ? n : 0;
+}
+
+// Number of bands in which to split a job on the given number of pixels,
+// in the given number of rows.  Always in [1, MAX_THREADS].
+static int bandsFor(size_t pixels, int rows) {
+  size_t nb = pixels / MIN_BAND_PIXELS;
+  if (nb > (size_t)numThreads()) nb = numThreads();
+  if (nb > (size_t)rows) nb = rows;
+  return nb < 1 ? 1 : (int)nb;
+}
+
+// Number of bands in which to split the storage rows of img
+// (see storageRows).  Always in [1, MAX_THREADS].
+static int numBands(Image img) {
+  return bandsFor((size_t)img->width * img->height, storageRows(img));
+}
+
+// Split rows [0, height) in nbands bands and apply func to each one,
+// in parallel.  Returns after all bands are done.
+// If a thread cannot be created, that band runs in the caller.
+static void parallelBands(int height, int nbands, BandFunc func, void* arg) {
+  assert (1 <= nbands && nbands <= MAX_THREADS);
+  struct bandJob job[MAX_THREADS];
+  pthread_t tid[MAX_THREADS];
+  int started[MAX_THREADS];
+  for (int b = 0; b < nbands; b++) {
+    job[b].func = func;
+    job[b].arg = arg;
+    job[b].band = b;
+    job[b].y0 = (int)((long long)height * b / nbands);
+    job[b].y1 = (int)((long long)height * (b+1) / nbands);
+  }
+  // Band 0 runs in the calling thread
+  for (int b = 1; b < nbands; b++) {
+    started[b] = pthread_create(&tid[b], NULL, bandWorker, &job[b]) == 0;
+    if (!started[b]) bandWorker(&job[b]);
+  }
+  bandWorker(&job[0]);
+  for (int b = 1; b < nbands; b++) {
+    if (started[b]) pthread_join(tid[b], NULL);
+  }
+}
+
+
 /// Image management functions
 
-/// Create a new black image.
-///   width, height : the dimensions of the new image.
-///   maxval: the maximum gray level (corresponding to white).
-/// Requires: width and height must be non-negative, maxval > 0.
-/// 
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageCreate(int width, int height, uint8 maxval) { ///
-  assert (width >= 0);
-  assert (height >= 0);
-  assert (0 < maxval && maxval <= PixMax);
-  // Insert your code here!
+// Create a new black image with the given depth (8 or 16 bits per pixel).
+static Image imageNew(int width, int height, int maxval, ImageLayout layout, int depth) {
   Image img = (Image)malloc(sizeof(struct image)); //Reserva memória para a estrutura da imagem
   if (!img) {
     //Define a causa da falha e retorna NULL se a reserva de memória falhar
@@ -192,22 +513,83 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
   img->width = width;
   img->height = height;
   img->maxval = maxval;
+  img->depth = depth;
+  if (!layoutInit(img, layout)) {
+    free(img);
+    errno = EOVERFLOW;
+    errCause = "Image too large";
+    return NULL;
+  }
+  img->mapped = 0;
+  img->statsValid = 0;
+  img->pyramidLevels = 1;
+  img->blurred = NULL;
+  img->dirtyAll = 1;
+  img->dirtyCount = 0;
+  pthread_mutex_init(&img->lock, NULL);
 
-  img->pixel = (uint8*)malloc(width * height * sizeof(uint8)); //Reserva memória para os dados dos pixels
+  // Initialize the image to black (all pixels to zero).
+  // Large blocks come zeroed from the kernel, page by page on first use,
+  // so the pages of a huge image that are never written cost no memory.
+  img->pixel = (uint8*)calloc(img->size, 1); //Reserva memória para os dados dos pixels
   if (!img->pixel) {
     //Define a causa da falha e retorna NULL se a reserva de memória falhar
     MEM_ALLOC_FAILURES++; //Incrementa o contador de falhas
+    pthread_mutex_destroy(&img->lock);
     free(img); // Liberta o espaço reservado na memória para os dados dos pixels
     errCause = "Memory allocation failed for pixel data";
     return NULL;
   }
 
-  // Initialize the image to black (all pixels to zero)
-  memset(img->pixel, 0, width * height * sizeof(uint8));
   IMG_CREATE_DESTROY++; //Incrementa o contador de gerenciamento de recursos
   return img; //Retorna a imagem 
 }
 
+// Create a new black image like img (maxval, layout and depth),
+// of size width x height.
+static Image imageLike(Image img, int width, int height) {
+  return imageNew(width, height, img->maxval, img->layout, img->depth);
+}
+
+/// Create a new black image.
+///   width, height : the dimensions of the new image.
+///   maxval: the maximum gray level (corresponding to white).
+/// Requires: width and height must be non-negative, maxval > 0.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreate(int width, int height, uint8 maxval) { ///
+  return ImageCreateLayout(width, height, maxval, IMAGE_RASTER);
+}
+
+/// Create a new black image with the given memory layout.
+/// Like ImageCreate, which creates IMAGE_RASTER images.
+/// All functions of this module work on images of either layout,
+/// and images created from an image keep its layout.
+/// IMAGE_TILED stores each 64x64 block of pixels contiguously, which
+/// favors column-wise access (ImageRotate, vertical filter passes,
+/// 2D searches) on wide images.  Rows are converted to raster order
+/// only when saving.
+Image ImageCreateLayout(int width, int height, uint8 maxval, ImageLayout layout) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  assert (0 < maxval && maxval <= PixMax);
+  return imageNew(width, height, maxval, layout, 8);
+}
+
+/// Create a new black 16-bit image.
+/// Like ImageCreate, but pixels have 16 bits and maxval may be up to
+/// PixMax16.  16-bit images are always IMAGE_RASTER.
+/// Only some functions accept 16-bit images: those documented as such,
+/// and the information queries, ImageDestroy and ImageSave.
+Image ImageCreate16(int width, int height, uint16_t maxval) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  assert (0 < maxval);
+  return imageNew(width, height, maxval, IMAGE_RASTER, 16);
+}
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -217,69 +599,571 @@ void ImageDestroy(Image* imgp) { ///
   assert (imgp != NULL);
   // Insert your code here!
   if (*imgp) {
-    free((*imgp)->pixel); // Free the pixel data
+    pyramidDrop(*imgp);   // Free the cached pyramid levels
+    ImageDestroy(&(*imgp)->blurred);  // and the cached blur
+    freePixels(*imgp);    // Free the pixel data
+    pthread_mutex_destroy(&(*imgp)->lock);
     free(*imgp);          // Free the image structure
     *imgp = NULL;         // Set the pointer to NULL
   }
   IMG_CREATE_DESTROY++; //Incrementa o contador de gerenciamento de recursos
 }
 
+/// Convert image to the given memory layout.
+/// The pixels (and cached stats) are not changed.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// accordingly, and the image is left unchanged.
+int ImageSetLayout(Image img, ImageLayout layout) { ///
+  assert (img != NULL);
+  assert (layout == IMAGE_RASTER || layout == IMAGE_TILED);
+  assert (img->depth == 8 || layout == IMAGE_RASTER);
+  if (img->layout == layout) return 1;
+
+  // conv describes the converted pixel array (its lock is never used)
+  struct image conv = *img;
+  if (!check( layoutInit(&conv, layout), "Image too large" )) {
+    errno = EOVERFLOW;
+    return 0;
+  }
+  if (!check( (conv.pixel = (uint8*)malloc(conv.size)) != NULL,
+              "Memory allocation failed for pixel data" )) {
+    MEM_ALLOC_FAILURES++;
+    return 0;
+  }
+  if (conv.size > img->size) memset(conv.pixel, 0, conv.size);  // padding
+  for (int y = 0; y < img->height; y++) {
+    copySpan(&conv, 0, y, img, 0, y, img->width);
+  }
+  PIXMEM += 2*(unsigned long)img->width * img->height;  // count pixel memory accesses
+
+  freePixels(img);
+  img->pixel = conv.pixel;
+  layoutInit(img, layout);
+  return 1;
+}
+
 
 /// PGM file operations
 
 // See also:
 // PGM format specification: http://netpbm.sourceforge.net/doc/pgm.html
-// Match and skip 0 or more comment lines in file f.
-// Comments start with a # and continue until the end-of-line, inclusive.
-// Returns the number of comments skipped.
-static int skipComments(FILE* f) {
-  char c;
+// 16-bit samples are big-endian in PGM files.
+// Copy n 16-bit samples from src to dst, converting between big-endian and
+// host byte order (src and dst may be the same).
+static void swapBigEndian16(uint16_t* dst, const uint16_t* src, size_t n) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  if (dst != src) memmove(dst, src, n * sizeof(uint16_t));
+#else
+  size_t i = 0;
+#if defined(__SSE2__)
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+  }
+#endif
+  for (; i < n; i++) dst[i] = (uint16_t)((src[i] << 8) | (src[i] >> 8));
+#endif
+}
+
+// Buffered PGM reader
+//
+// Headers are parsed from a buffer, filled by large fread calls on an
+// unbuffered stream: a small file is read with a single read(2), instead
+// of the many small reads of fscanf.  Raw pixels that follow the header
+// in the buffer are copied, and the rest are read directly into place.
+
+#define READER_BUF 16384
+
+struct pgmReader {
+  FILE* f;
+  size_t pos, len;        // unread bytes are buf[pos, len)
+  int eof;                // no more bytes in f?
+  uint8 buf[READER_BUF];
+};
+
+// If unbuffered, f must be newly opened: stdio buffering is turned off.
+static void readerInit(struct pgmReader* r, FILE* f, int unbuffered) {
+  if (unbuffered) setvbuf(f, NULL, _IONBF, 0);   // (our buffer is enough)
+  r->f = f;
+  r->pos = r->len = 0;
+  r->eof = 0;
+}
+
+// Read more bytes into the buffer, keeping the unread ones.
+// Returns the number of unread bytes.
+static size_t readerFill(struct pgmReader* r) {
+  if (r->pos > 0) {
+    memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+    r->len -= r->pos;
+    r->pos = 0;
+  }
+  if (!r->eof && r->len < READER_BUF) {
+    size_t want = READER_BUF - r->len;
+    size_t n = fread(r->buf + r->len, 1, want, r->f);
+    r->len += n;
+    if (n < want) r->eof = 1;   // (fread only stops early at EOF or error)
+  }
+  return r->len - r->pos;
+}
+
+// Next byte, or EOF (the byte is not consumed).
+static inline int readerPeek(struct pgmReader* r) {
+  if (r->pos == r->len && readerFill(r) == 0) return EOF;
+  return r->buf[r->pos];
+}
+
+// Consume and return the next byte, or EOF.
+static inline int readerByte(struct pgmReader* r) {
+  int c = readerPeek(r);
+  if (c != EOF) r->pos++;
+  return c;
+}
+
+// Skip whitespace and comments (from # to the end of the line).
+static void readerSkip(struct pgmReader* r) {
+  for (;;) {
+    int c = readerPeek(r);
+    if (c == '#') {
+      while (c != '\n' && c != EOF) c = readerByte(r);
+    } else if (c != EOF && isspace(c)) {
+      r->pos++;
+    } else {
+      return;
+    }
+  }
+}
+
+// Skip whitespace and comments, then read a non-negative decimal integer
+// into *v.  Returns 0 if there is none, or it does not fit in an int.
+static int readerInt(struct pgmReader* r, int* v) {
+  readerSkip(r);
+  int c = readerPeek(r);
+  if (c == EOF || !isdigit(c)) return 0;
+  int n = 0;
+  while (c != EOF && isdigit(c)) {
+    if (n > (INT_MAX - (c - '0')) / 10) return 0;
+    n = 10*n + (c - '0');
+    r->pos++;
+    c = readerPeek(r);
+  }
+  *v = n;
+  return 1;
+}
+
+// Read n bytes from r into dst: first those in the buffer, then the rest
+// directly from the file.  Returns 0 if there are not enough bytes.
+static int readerRead(struct pgmReader* r, void* dst, size_t n) {
+  size_t k = r->len - r->pos;
+  if (k > n) k = n;
+  memcpy(dst, r->buf + r->pos, k);
+  r->pos += k;
+  return k == n || fread((uint8*)dst + k, 1, n - k, r->f) == n - k;
+}
+
+// Read the raw pixels of img (P5).
+static int readRaw(struct pgmReader* r, Image img) {
+  if (!check( readerRead(r, img->pixel, img->size), "Reading pixels" )) {
+    return 0;
+  }
+  if (img->depth == 16) {
+    swapBigEndian16((uint16_t*)img->pixel, (const uint16_t*)img->pixel, img->size / 2);
+  }
+  return 1;
+}
+
+// Store level v as pixel i of (raster) img.
+static inline void storeLevel(Image img, size_t i, int v) {
+  if (img->depth == 16) ((uint16_t*)img->pixel)[i] = (uint16_t)v;
+  else img->pixel[i] = (uint8)v;
+}
+
+// Read one decimal level (after whitespace) into *v, byte by byte.
+static int asciiLevel(struct pgmReader* r, int maxval, int* v) {
+  int c = readerPeek(r);
+  while (c != EOF && isspace(c)) {
+    r->pos++;
+    c = readerPeek(r);
+  }
+  if (!check( c != EOF && isdigit(c), "Reading pixels" )) return 0;
+  int n = 0;
+  while (c != EOF && isdigit(c)) {
+    n = 10*n + (c - '0');
+    if (!check( n <= maxval, "Invalid pixel value" )) return 0;
+    r->pos++;
+    c = readerPeek(r);
+  }
+  *v = n;
+  return 1;
+}
+
+// Read the ASCII pixels of img (P2): decimal levels separated by whitespace.
+// With SSE2, 16 bytes at a time are classified into digits and whitespace
+// (as bit masks), and each number entirely inside those 16 bytes is
+// located with bit scans and converted without further tests.
+// Numbers that cross the end of the block, blocks with other characters,
+// and the end of the file, are handled byte by byte (asciiLevel).
+static int readAscii(struct pgmReader* r, Image img) {
+  size_t n = (size_t)img->width * img->height;
+  int maxval = img->maxval;
+  size_t i = 0;
+  while (i < n) {
+    if (r->len - r->pos < 16) readerFill(r);
+#if defined(__SSE2__)
+    if (r->len - r->pos >= 16) {
+      const uint8* p = r->buf + r->pos;
+      __m128i v = _mm_loadu_si128((const __m128i*)p);
+      __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                    _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+      __m128i space = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                   _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('\t' - 1)),
+                                                 _mm_cmplt_epi8(v, _mm_set1_epi8('\r' + 1))));
+      unsigned dm = (unsigned)_mm_movemask_epi8(digit);
+      unsigned sm = (unsigned)_mm_movemask_epi8(space);
+      if ((dm | sm) == 0xFFFF) {
+        unsigned m = dm;
+        int off = 0;   // bytes consumed
+        while (i < n) {
+          if (m == 0) {
+            off = 16;
+            break;
+          }
+          int s = __builtin_ctz(m);
+          int len = __builtin_ctz(~(m >> s));
+          if (s + len == 16) {   // may continue in the next block
+            off = s;
+            break;
+          }
+          if (len > 5) break;   // (too large: let asciiLevel report it)
+          int val = 0;
+          for (int k = s; k < s + len; k++) val = 10*val + (p[k] - '0');
+          if (val > maxval) break;
+          storeLevel(img, i++, val);
+          m &= ~0u << (s + len);
+          off = s + len;
+        }
+        r->pos += off;
+        if (off > 0 || i == n) continue;
+      }
+    }
+#endif
+    int val;
+    if (!asciiLevel(r, maxval, &val)) return 0;
+    storeLevel(img, i++, val);
+  }
+  return 1;
+}
+
+// Run-length files
+//
+// A native format for images with long runs of equal pixels, such as
+// thresholded or sparse images (8-bit only):
+//   "PR" WIDTH HEIGHT MAXVAL   header, as for PGM files
+//   HEIGHT row sizes           4 bytes each, little-endian
+//   HEIGHT rows                each one compressed separately (PackBits):
+//     control byte c <= 127:   c+1 literal pixels follow
+//     control byte c >= 129:   the next pixel is repeated 257-c times
+// The row index gives random access to the rows, so they are encoded and
+// decoded in parallel bands.
+
+// Compressed size of a row of n pixels, in the worst case.
+static inline size_t packedMax(int n) {
+  return (size_t)n + (n + 127) / 128 + 1;
+}
+
+// Index of the first run of 3 or more equal pixels in p[i, n), or n.
+static int nextRun(const uint8* p, int i, int n) {
+#if defined(__SSE2__)
+  for (; i + 18 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(p + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(p + i + 1));
+    __m128i c = _mm_loadu_si128((const __m128i*)(p + i + 2));
+    unsigned m = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, b), _mm_cmpeq_epi8(b, c)));
+    if (m != 0) return i + __builtin_ctz(m);
+  }
+#endif
+  for (; i + 2 < n; i++) {
+    if (p[i] == p[i+1] && p[i] == p[i+2]) return i;
+  }
+  return n;
+}
+
+// Length of the run of pixels equal to p[i], from i (at most max).
+static int runLength(const uint8* p, int i, int n, int max) {
+  if (n - i > max) n = i + max;
+  int j = i + 1;
+#if defined(__SSE2__)
+  __m128i v = _mm_set1_epi8((char)p[i]);
+  for (; j + 16 <= n; j += 16) {
+    unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + j)), v));
+    if (m != 0xFFFF) return j + __builtin_ctz(~m) - i;
+  }
+#endif
+  while (j < n && p[j] == p[i]) j++;
+  return j - i;
+}
+
+// Compress the n pixels at p into out (with room for packedMax(n) bytes).
+// Returns the compressed size.
+static size_t packRow(const uint8* p, int n, uint8* out) {
+  size_t o = 0;
   int i = 0;
-  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n') {
-    i++;
+  while (i < n) {
+    int j = nextRun(p, i, n);
+    while (i < j) {   // literals
+      int c = (j - i < 128) ? j - i : 128;
+      out[o++] = (uint8)(c - 1);
+      memcpy(out + o, p + i, c);
+      o += c;
+      i += c;
+    }
+    if (j < n) {
+      int c = runLength(p, j, n, 128);
+      out[o++] = (uint8)(257 - c);
+      out[o++] = p[j];
+      i = j + c;
+    }
+  }
+  assert (o <= packedMax(n));
+  return o;
+}
+
+// Decompress the row of len bytes at src into the width pixels at dst.
+// If lut is not NULL, each level v is replaced by lut[v] (once per run).
+// src and dst must have 16 bytes to spare (they may be overwritten).
+// Returns 0 if the data is invalid.
+static int unpackRow(const uint8* src, size_t len, uint8* dst, int width, const uint8* lut) {
+  const uint8* end = src + len;
+  int x = 0;
+  while (src < end) {
+    int c = *src++;
+    if (c < 128) {
+      int k = c + 1;
+      if (x + k > width || end - src < k) return 0;
+      if (lut != NULL) {
+        for (int i = 0; i < k; i++) dst[x + i] = lut[src[i]];
+      } else {
+#if defined(__SSE2__)
+        for (int i = 0; i < k; i += 16) {
+          _mm_storeu_si128((__m128i*)(dst + x + i), _mm_loadu_si128((const __m128i*)(src + i)));
+        }
+#else
+        memcpy(dst + x, src, k);
+#endif
+      }
+      src += k;
+      x += k;
+    } else if (c > 128) {
+      int k = 257 - c;
+      if (x + k > width || src == end) return 0;
+      uint8 level = (lut != NULL) ? lut[*src] : *src;
+#if defined(__SSE2__)
+      __m128i v = _mm_set1_epi8((char)level);
+      for (int i = 0; i < k; i += 16) _mm_storeu_si128((__m128i*)(dst + x + i), v);
+#else
+      memset(dst + x, level, k);
+#endif
+      src++;
+      x += k;
+    }
+  }
+  return x == width;
+}
+
+struct rleJob {
+  Image img;
+  uint8* data;          // compressed rows
+  size_t* off;          // offset of each row in data (and the end)
+  size_t rowMax;        // bytes per row (rows buffer, when encoding)
+  uint8* rows;          // a row buffer per band (width + 16 bytes)
+  int failed[MAX_THREADS];   // was any row of each band invalid?
+};
+
+// Decode rows [y0, y1) of job->img.
+static void unpackBand(void* arg, int band, int y0, int y1) {
+  struct rleJob* job = (struct rleJob*)arg;
+  Image img = job->img;
+  uint8* row = job->rows + (size_t)band * (img->width + 16);
+  for (int y = y0; y < y1; y++) {
+    if (!unpackRow(job->data + job->off[y], job->off[y+1] - job->off[y], row, img->width, NULL)) {
+      job->failed[band] = 1;
+      return;
+    }
+    putSpan(img, 0, y, img->width, row);
+  }
+}
+
+// Encode rows [y0, y1) of job->img, row y at job->data + y * job->rowMax;
+// its size is stored in job->off[y].
+static void packBand(void* arg, int band, int y0, int y1) {
+  struct rleJob* job = (struct rleJob*)arg;
+  Image img = job->img;
+  uint8* row = job->rows + (size_t)band * (img->width + 16);
+  for (int y = y0; y < y1; y++) {
+    getSpan(img, 0, y, img->width, row);
+    job->off[y] = packRow(row, img->width, job->data + (size_t)y * job->rowMax);
+  }
+}
+
+// Number of bands for (de)compressing the rows of img.
+static int rleBands(Image img) {
+  int nb = numBands(img);
+  return (nb > img->height) ? (img->height > 0 ? img->height : 1) : nb;
+}
+
+// Read the run-length pixels of img (PR).
+static int readRLE(struct pgmReader* r, Image img) {
+  int h = img->height;
+  int nb = rleBands(img);
+  struct rleJob job = { .img = img };
+  uint8* index = NULL;
+  int success = 1;
+  if (!check( (job.off = (size_t*)malloc((h + 1) * sizeof(size_t))) != NULL &&
+              (index = (uint8*)malloc(4 * (size_t)h + 1)) != NULL &&
+              (job.rows = (uint8*)malloc((size_t)nb * (img->width + 16))) != NULL,
+              "Memory allocation failed" )) {
+    MEM_ALLOC_FAILURES++;
+    success = 0;
+  }
+  success = success && check( readerRead(r, index, 4 * (size_t)h), "Reading pixels" );
+  if (success) {
+    job.off[0] = 0;
+    for (int y = 0; y < h; y++) {
+      const uint8* b = index + 4 * (size_t)y;
+      job.off[y+1] = job.off[y] + (b[0] | (size_t)b[1] << 8 | (size_t)b[2] << 16 | (size_t)b[3] << 24);
+    }
+    success = check( job.off[h] <= (size_t)h * packedMax(img->width), "Corrupt run-length data" );
+  }
+  if (success && !check( (job.data = (uint8*)malloc(job.off[h] + 16)) != NULL, "Memory allocation failed" )) {
+    MEM_ALLOC_FAILURES++;
+    success = 0;
+  }
+  success = success && check( readerRead(r, job.data, job.off[h]), "Reading pixels" );
+  if (success) {
+    parallelBands(h, nb, unpackBand, &job);
+    for (int b = 0; b < nb; b++) success = success && check( !job.failed[b], "Corrupt run-length data" );
+  }
+  free(job.data);
+  free(job.rows);
+  free(index);
+  free(job.off);
+  return success;
+}
+
+// Read the pixels of img from a raw PBM file (P4): rows of packed bits,
+// most significant first, where 1 is black (0) and 0 is white (maxval).
+static int readPBM(struct pgmReader* r, Image img) {
+  size_t bytes = ((size_t)img->width + 7) / 8;
+  uint8* buf = NULL;
+  if (!check( (buf = (uint8*)malloc(bytes + 1)) != NULL, "Memory allocation failed" )) {
+    MEM_ALLOC_FAILURES++;
+    return 0;
+  }
+  int success = 1;
+  for (int y = 0; success && y < img->height; y++) {
+    success = check( readerRead(r, buf, bytes), "Reading pixels" );
+    uint8* p = img->pixel + (size_t)y * img->width;
+    for (int x = 0; success && x < img->width; x++) {
+      p[x] = ((buf[x / 8] >> (7 - x % 8)) & 1) ? 0 : (uint8)img->maxval;
+    }
+  }
+  free(buf);
+  return success;
+}
+
+// Read one image (header and pixels) from r.
+// On failure, returns NULL and errno/errCause are set accordingly.
+static Image readImage(struct pgmReader* r) {
+  FILE_IO++;
+  int w = 0, h = 0;
+  int maxval = PixMax;   // (PBM files have none)
+  int c = 0;
+  Image img = NULL;
+
+  int success =
+  // Parse PGM header
+  check( readerByte(r) == 'P' && ((c = readerByte(r)) == '5' || c == '2' || c == 'R' || c == '4') , "Invalid file format" ) &&
+  check( readerInt(r, &w) , "Invalid width" ) &&
+  check( readerInt(r, &h) , "Invalid height" ) &&
+  check( c == '4' || (readerInt(r, &maxval) && 0 < maxval && maxval <= (c == 'R' ? (int)PixMax : (int)PixMax16)) , "Invalid maxval" ) &&
+  check( isspace(readerByte(r)) , "Whitespace expected" ) &&
+  // Allocate image
+  (img = (maxval > PixMax) ? ImageCreate16(w, h, (uint16_t)maxval) : ImageCreate(w, h, (uint8)maxval)) != NULL &&
+  // Read pixels
+  (c == '5' ? readRaw(r, img) : c == '2' ? readAscii(r, img) :
+   c == '4' ? readPBM(r, img) : readRLE(r, img));
+  PIXMEM += (unsigned long)w * h;  // count pixel memory accesses
+
+  if (!success) {
+    errsave = errno;
+    ImageDestroy(&img);
+    errno = errsave;
   }
-  return i;
+  return img;
 }
 
-/// Load a raw PGM file.
-/// Only 8 bit PGM files are accepted.
+/// Load a PGM file, raw (P5) or ASCII (P2), a run-length file (see
+/// ImageSaveRLE) or a raw PBM file (see BitImageSave); the format is
+/// detected from the file contents.
+/// 8-bit and 16-bit (maxval > PixMax) PGM files are accepted; the latter
+/// give 16-bit images (see ImageCreate16).
+/// PBM files give images with levels 0 (black) and PixMax (white).
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) { ///
-  FILE_IO++; //Incrementa as operações I/O 
-  int w, h;  //Largura e altura da imagem
-  int maxval;
-  char c;
   FILE* f = NULL; //Ponteiro do arquivo
   Image img = NULL; //Ponteiro da imagem
+  struct pgmReader r;
 
-  int success = check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
-  // Parse PGM header
-  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &h) == 1 && h >= 0 , "Invalid height" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax , "Invalid maxval" ) &&
-  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" ) &&
-  // Allocate image
-  (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
-  // Read pixels
-  check( fread(img->pixel, sizeof(uint8), w*h, f) == w*h , "Reading pixels" );
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  if (check( (f = fopen(filename, "rb")) != NULL, "Open failed" )) {
+    readerInit(&r, f, 1);
+    img = readImage(&r);
+  } else {
+    FILE_IO++;
+  }
 
   // Cleanup
-  if (!success) {
+  if (f != NULL) { //Fecha o arquivo se não for NULL
     errsave = errno;
-    ImageDestroy(&img); //Destrói a imagem em caso de falha
+    fclose(f);
     errno = errsave;
   }
-  if (f != NULL) fclose(f); //Fecha o arquivo se não for NULL
   return img; //Retorna a imagem
 }
 
+// Write the pixels of img to f, as a raster scan.
+// Tiled images are converted one row of tiles at a time.
+// 16-bit images are converted to big-endian in chunks.
+static int writePixels(Image img, FILE* f) {
+  size_t w = (size_t)img->width;
+  if (img->depth == 16) {
+    enum { CHUNK = 4096 };
+    uint16_t buf[CHUNK];
+    const uint16_t* p = (const uint16_t*)img->pixel;
+    size_t n = (size_t)img->width * img->height;
+    int success = 1;
+    for (size_t i = 0; success && i < n; i += CHUNK) {
+      size_t c = (n - i < CHUNK) ? n - i : CHUNK;
+      swapBigEndian16(buf, p + i, c);
+      success = check( fwrite(buf, sizeof(uint16_t), c, f) == c, "Writing pixels failed" );
+    }
+    return success;
+  }
+  if (img->layout == IMAGE_RASTER) {
+    return check( fwrite(img->pixel, sizeof(uint8), img->size, f) == img->size, "Writing pixels failed" );
+  }
+  uint8* rows = NULL;
+  int success = check( (rows = (uint8*)malloc(w * TILE + 1)) != NULL, "Memory allocation failed" );
+  for (int y0 = 0; success && y0 < img->height; y0 += TILE) {
+    int n = (img->height - y0 < TILE) ? img->height - y0 : TILE;
+    for (int i = 0; i < n; i++) getSpan(img, 0, y0 + i, img->width, rows + i * w);
+    success = check( fwrite(rows, sizeof(uint8), n * w, f) == n * w, "Writing pixels failed" );
+  }
+  free(rows);
+  return success;
+}
+
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
@@ -288,14 +1172,14 @@ int ImageSave(Image img, const char* filename) { ///
   assert (img != NULL); //Garante que há uma imagem
   int w = img->width; //Largura da imagem
   int h = img->height; //Altura da imagem
-  uint8 maxval = img->maxval; //Valor máximo 
+  int maxval = img->maxval; //Valor máximo 
   FILE* f = NULL; //Ponteiro de arquivo 
 
   int success =
   check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) && //Abre o arquivo e verifica se há erros 
-  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) && //Escreve o cabeçalho
-  check( fwrite(img->pixel, sizeof(uint8), w*h, f) == w*h, "Writing pixels failed" ); //Escreve os pixels
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  check( fprintf(f, "P5\n%d %d\n%d\n", w, h, maxval) > 0, "Writing header failed" ) && //Escreve o cabeçalho
+  writePixels(img, f); //Escreve os pixels
+  PIXMEM += (unsigned long)w * h;  // count pixel memory accesses
 
   // Cleanup
   if (f != NULL) fclose(f); //Fecha o arquivo se não for NULL
@@ -303,20 +1187,918 @@ int ImageSave(Image img, const char* filename) { ///
 }
 
 
-/// Information queries
-
-/// These functions do not modify the image and never fail.
+// "00" to "99", for formatting two digits at a time.
+static const char digitPairs[201] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
 
-/// Get image width
-int ImageWidth(Image img) { ///
-  assert (img != NULL);
-  return img->width;
+// Write v in decimal at p (without terminator); returns the number of chars.
+static inline int formatLevel(char* p, unsigned v) {
+  char tmp[6];
+  char* q = tmp + sizeof(tmp);
+  while (v >= 100) {
+    q -= 2;
+    memcpy(q, digitPairs + 2*(v % 100), 2);
+    v /= 100;
+  }
+  if (v >= 10) {
+    q -= 2;
+    memcpy(q, digitPairs + 2*v, 2);
+  } else {
+    *--q = (char)('0' + v);
+  }
+  int n = (int)(tmp + sizeof(tmp) - q);
+  memcpy(p, q, n);
+  return n;
 }
 
-/// Get image height
-int ImageHeight(Image img) { ///
+/// Save image to an ASCII (plain) PGM file.
+/// Each row starts on a new line, and no line is longer than 70 chars.
+/// Accepts 16-bit images.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageSaveAscii(Image img, const char* filename) { ///
   assert (img != NULL);
-  return img->height;
+  enum { OUTBUF = 65536, LINE = 70 };
+  int w = img->width;
+  int h = img->height;
+  FILE* f = NULL;
+  char* out = NULL;
+  uint8* row = NULL;
+
+  int success =
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( fprintf(f, "P2\n%d %d\n%d\n", w, h, img->maxval) > 0, "Writing header failed" ) &&
+  check( (out = (char*)malloc(OUTBUF)) != NULL, "Memory allocation failed" ) &&
+  check( img->depth == 16 || (row = (uint8*)malloc((size_t)w + 1)) != NULL, "Memory allocation failed" );
+  size_t len = 0;
+  for (int y = 0; success && y < h; y++) {
+    const uint16_t* row16 = NULL;
+    if (img->depth == 16) row16 = (const uint16_t*)img->pixel + (size_t)y * w;
+    else getSpan(img, 0, y, w, row);
+    int col = 0;   // chars in the current line
+    for (int x = 0; x < w; x++) {
+      if (len > OUTBUF - 8) {
+        success = check( fwrite(out, 1, len, f) == len, "Writing pixels failed" );
+        if (!success) break;
+        len = 0;
+      }
+      unsigned v = (row16 != NULL) ? row16[x] : row[x];
+      char digits[6];
+      int n = formatLevel(digits, v);
+      if (col > 0) {
+        if (col + 1 + n > LINE) {
+          out[len++] = '\n';
+          col = 0;
+        } else {
+          out[len++] = ' ';
+          col++;
+        }
+      }
+      memcpy(out + len, digits, n);
+      len += n;
+      col += n;
+    }
+    out[len++] = '\n';
+  }
+  success = success && check( fwrite(out, 1, len, f) == len, "Writing pixels failed" );
+  PIXMEM += (unsigned long)w * h;  // count pixel memory accesses
+
+  // Cleanup
+  free(row);
+  free(out);
+  if (f != NULL) fclose(f);
+  return success;
+}
+
+
+/// Save image to a run-length file (see ImageLoad).
+/// Rows are compressed with PackBits; thresholded and sparse images take
+/// a small fraction of the size of a PGM file.
+/// Requires an 8-bit image.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageSaveRLE(Image img, const char* filename) { ///
+  assert (img != NULL);
+  assert (img->depth == 8);
+  FILE_IO++;
+  int w = img->width;
+  int h = img->height;
+  int nb = rleBands(img);
+  struct rleJob job = { .img = img, .rowMax = packedMax(w) };
+  FILE* f = NULL;
+  int success = 1;
+  if (!check( (job.off = (size_t*)malloc((h + 1) * sizeof(size_t))) != NULL &&
+              (job.data = (uint8*)malloc((size_t)h * job.rowMax + 1)) != NULL &&
+              (job.rows = (uint8*)malloc((size_t)nb * (w + 16))) != NULL,
+              "Memory allocation failed" )) {
+    MEM_ALLOC_FAILURES++;
+    success = 0;
+  }
+  size_t total = 0;
+  if (success) {
+    parallelBands(h, nb, packBand, &job);
+    // Index, in place of the first sizes, then the rows, packed together
+    // (each one moves down, to where the previous one ends)
+    uint8* index = (uint8*)job.off;
+    for (int y = 0; y < h; y++) {
+      size_t n = job.off[y];
+      memmove(job.data + total, job.data + (size_t)y * job.rowMax, n);
+      total += n;
+      uint8* b = index + 4 * (size_t)y;
+      b[0] = (uint8)n;
+      b[1] = (uint8)(n >> 8);
+      b[2] = (uint8)(n >> 16);
+      b[3] = (uint8)(n >> 24);
+    }
+    success =
+    check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+    check( fprintf(f, "PR\n%d %d\n%d\n", w, h, img->maxval) > 0, "Writing header failed" ) &&
+    check( fwrite(index, 1, 4 * (size_t)h, f) == 4 * (size_t)h &&
+           fwrite(job.data, 1, total, f) == total, "Writing pixels failed" );
+  }
+  PIXMEM += (unsigned long)w * h;  // count pixel memory accesses
+
+  // Cleanup
+  if (f != NULL) success = check( fclose(f) == 0, "Writing pixels failed" ) && success;
+  free(job.rows);
+  free(job.data);
+  free(job.off);
+  return success;
+}
+
+
+// Run-length files, one row at a time
+//
+// These functions work on the runs of a file without loading it into an
+// image, so they need memory for a few rows only (whatever the height).
+
+// An open run-length file, read one row at a time.
+struct rleReader {
+  struct pgmReader in;
+  int width, height, maxval;
+  uint8* index;         // row sizes, 4 bytes each
+  uint8* data;          // compressed row (packedMax(width) + 16 bytes)
+  int y;                // next row
+};
+
+static void rleClose(struct rleReader* r) {
+  if (r == NULL) return;
+  if (r->in.f != NULL) fclose(r->in.f);
+  free(r->data);
+  free(r->index);
+  free(r);
+}
+
+// Open run-length file filename, and read its header and row index.
+// On failure, returns NULL and errno/errCause are set accordingly.
+static struct rleReader* rleOpen(const char* filename) {
+  FILE_IO++;
+  struct rleReader* r = NULL;
+  FILE* f = NULL;
+  if (!check( (f = fopen(filename, "rb")) != NULL, "Open failed" )) return NULL;
+  if (!check( (r = (struct rleReader*)calloc(1, sizeof(*r))) != NULL, "Memory allocation failed" )) {
+    MEM_ALLOC_FAILURES++;
+    fclose(f);
+    return NULL;
+  }
+  readerInit(&r->in, f, 1);
+  int success =
+  check( readerByte(&r->in) == 'P' && readerByte(&r->in) == 'R' , "Invalid file format" ) &&
+  check( readerInt(&r->in, &r->width) , "Invalid width" ) &&
+  check( readerInt(&r->in, &r->height) , "Invalid height" ) &&
+  check( readerInt(&r->in, &r->maxval) && 0 < r->maxval && r->maxval <= PixMax , "Invalid maxval" ) &&
+  check( isspace(readerByte(&r->in)) , "Whitespace expected" );
+  if (success && !check( (r->index = (uint8*)malloc(4 * (size_t)r->height + 1)) != NULL &&
+                         (r->data = (uint8*)malloc(packedMax(r->width) + 16)) != NULL,
+                         "Memory allocation failed" )) {
+    MEM_ALLOC_FAILURES++;
+    success = 0;
+  }
+  success = success && check( readerRead(&r->in, r->index, 4 * (size_t)r->height), "Reading pixels" );
+  if (!success) {
+    int errsave = errno;
+    rleClose(r);
+    errno = errsave;
+    return NULL;
+  }
+  return r;
+}
+
+// Decode the next row of r into row (width + 16 bytes), mapping its levels
+// through lut (if not NULL).  Returns 0 on failure.
+static int rleRow(struct rleReader* r, uint8* row, const uint8* lut) {
+  assert (r->y < r->height);
+  const uint8* b = r->index + 4 * (size_t)r->y++;
+  size_t n = b[0] | (size_t)b[1] << 8 | (size_t)b[2] << 16 | (size_t)b[3] << 24;
+  PIXMEM += (unsigned long)r->width;  // count pixel memory accesses
+  return check( n <= packedMax(r->width) , "Corrupt run-length data" ) &&
+         check( readerRead(&r->in, r->data, n) , "Reading pixels" ) &&
+         check( unpackRow(r->data, n, row, r->width, lut) , "Corrupt run-length data" );
+}
+
+// Copy run-length file src to dst, replacing each level v by lut[v].
+// Runs are mapped as a whole, and each row is compressed again, as runs
+// may merge (after a threshold, for instance).
+static int mapRLE(const char* src, const char* dst, const uint8 lut[256]) {
+  struct rleReader* r = rleOpen(src);
+  if (r == NULL) return 0;
+  FILE_IO++;
+  int w = r->width;
+  int h = r->height;
+  uint8* row = NULL;
+  uint8* out = NULL;
+  uint8* index = NULL;
+  FILE* f = NULL;
+  int success = 1;
+  if (!check( (row = (uint8*)malloc((size_t)w + 16)) != NULL &&
+              (out = (uint8*)malloc(packedMax(w))) != NULL &&
+              (index = (uint8*)calloc(4 * (size_t)h + 1, 1)) != NULL,
+              "Memory allocation failed" )) {
+    MEM_ALLOC_FAILURES++;
+    success = 0;
+  }
+  // Header, then a provisional index, rewritten when the rows are known
+  int header = 0;
+  success = success &&
+  check( (f = fopen(dst, "wb")) != NULL, "Open failed" ) &&
+  check( (header = fprintf(f, "PR\n%d %d\n%d\n", w, h, r->maxval)) > 0, "Writing header failed" ) &&
+  check( fwrite(index, 1, 4 * (size_t)h, f) == 4 * (size_t)h, "Writing pixels failed" );
+  for (int y = 0; success && y < h; y++) {
+    success = rleRow(r, row, lut);
+    if (!success) break;
+    size_t n = packRow(row, w, out);
+    uint8* b = index + 4 * (size_t)y;
+    b[0] = (uint8)n;
+    b[1] = (uint8)(n >> 8);
+    b[2] = (uint8)(n >> 16);
+    b[3] = (uint8)(n >> 24);
+    success = check( fwrite(out, 1, n, f) == n, "Writing pixels failed" );
+  }
+  success = success &&
+  check( fseek(f, header, SEEK_SET) == 0 &&
+         fwrite(index, 1, 4 * (size_t)h, f) == 4 * (size_t)h, "Writing pixels failed" );
+
+  // Cleanup
+  if (f != NULL) success = check( fclose(f) == 0, "Writing pixels failed" ) && success;
+  int errsave = errno;
+  rleClose(r);
+  errno = errsave;
+  free(index);
+  free(out);
+  free(row);
+  return success;
+}
+
+/// Negative of the run-length file src, saved to the run-length file dst,
+/// as ImageNegative, without loading src into an image: each run is
+/// transformed as a whole, and memory is needed for one row only.
+/// dst must be a regular file, other than src.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageNegativeRLE(const char* src, const char* dst) { ///
+  assert (src != NULL && dst != NULL);
+  uint8 lut[256];
+  for (int v = 0; v < 256; v++) lut[v] = (uint8)(255 - v);
+  return mapRLE(src, dst, lut);
+}
+
+/// Threshold of the run-length file src, saved to the run-length file
+/// dst, as ImageThreshold, without loading src into an image (see
+/// ImageNegativeRLE).
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageThresholdRLE(const char* src, const char* dst, uint8 thr) { ///
+  assert (src != NULL && dst != NULL);
+  uint8 lut[256];
+  for (int v = 0; v < 256; v++) lut[v] = (v < thr) ? 0 : 255;
+  return mapRLE(src, dst, lut);
+}
+
+/// Locate the 8-bit image img2 inside the run-length file filename,
+/// without loading the file into an image: its rows are decoded in turn,
+/// and only the last img2 height rows are kept.
+/// If a match is found, returns 1 and the position of the first one (in
+/// raster order) is set in (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageLocateRLE(const char* filename, int* px, int* py, Image img2) { ///
+  assert (filename != NULL && img2 != NULL);
+  assert (img2->depth == 8);
+  struct rleReader* r = rleOpen(filename);
+  if (r == NULL) return -1;
+  int w = r->width;
+  int w2 = img2->width;
+  int h2 = img2->height;
+  uint8* rows = NULL;   // the last h2 rows of the file (row y at y % h2)
+  uint8* sub = NULL;    // the rows of img2
+  int found = 0;
+  if (!check( (rows = (uint8*)malloc((size_t)h2 * (w + 16) + 1)) != NULL &&
+              (sub = (uint8*)malloc((size_t)h2 * w2 + 1)) != NULL,
+              "Memory allocation failed" )) {
+    MEM_ALLOC_FAILURES++;
+    found = -1;
+  }
+  if (found == 0 && h2 == 0 && w2 <= w) {   // (an empty img2 is found anywhere)
+    *px = *py = 0;
+    found = 1;
+  }
+  if (found == 0 && w2 <= w && h2 <= r->height) {
+    for (int j = 0; j < h2; j++) getSpan(img2, 0, j, w2, sub + (size_t)j * w2);
+    for (int y = 0; found == 0 && y < r->height; y++) {
+      if (!rleRow(r, rows + (size_t)(y % h2) * (w + 16), NULL)) {
+        found = -1;
+        break;
+      }
+      int top = y - h2 + 1;   // candidate rows [top, y]
+      if (top < 0) continue;
+      for (int x = 0; found == 0 && x + w2 <= w; x++) {
+        int j = 0;
+        while (j < h2 && memcmp(rows + (size_t)((top + j) % h2) * (w + 16) + x, sub + (size_t)j * w2, w2) == 0) j++;
+        if (j == h2) {
+          *px = x;
+          *py = top;
+          found = 1;
+        }
+      }
+    }
+  }
+  int errsave = errno;
+  rleClose(r);
+  errno = errsave;
+  free(sub);
+  free(rows);
+  return found;
+}
+
+
+// Multi-image PGM streams
+
+struct imageReader {
+  int own;                // close in.f on ImageReaderClose?
+  struct pgmReader in;
+};
+
+struct imageWriter {
+  FILE* f;
+  int own;                // close f on ImageWriterClose?
+  char* buf;              // stdio buffer of f (if own)
+};
+
+#define WRITER_BUF 65536
+
+// Return a new reader of f (or NULL, on allocation failure).
+static ImageReader newReader(FILE* f, int own) {
+  ImageReader r = NULL;
+  if (check( (r = (ImageReader)malloc(sizeof(*r))) != NULL, "Memory allocation failed" )) {
+    r->own = own;
+    readerInit(&r->in, f, own);
+  } else {
+    MEM_ALLOC_FAILURES++;
+  }
+  return r;
+}
+
+/// Open a PGM file for reading its images in sequence.
+/// On success, a new reader is returned.
+/// (The caller is responsible for closing the returned reader!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageReader ImageReaderOpen(const char* filename) { ///
+  assert (filename != NULL);
+  FILE* f = NULL;
+  ImageReader r = NULL;
+  if (check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+      (r = newReader(f, 1)) == NULL) {
+    fclose(f);
+  }
+  return r;
+}
+
+/// Read images in sequence from the open stream f.
+/// The reader reads ahead, so f should not be used for input while the
+/// reader is open.  f is not closed by ImageReaderClose.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageReader ImageReaderFromFile(FILE* f) { ///
+  assert (f != NULL);
+  return newReader(f, 0);
+}
+
+/// Are there no more images in the stream?
+/// (Only whitespace and comments may follow the last image.)
+int ImageReaderDone(ImageReader r) { ///
+  assert (r != NULL);
+  readerSkip(&r->in);
+  return readerPeek(&r->in) == EOF;
+}
+
+/// Read the next image (raw or ASCII, 8-bit or 16-bit, as ImageLoad).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, or if there are no more images, returns NULL and
+/// errno/errCause are set accordingly.
+Image ImageReaderNext(ImageReader r) { ///
+  assert (r != NULL);
+  errno = 0;
+  if (!check( !ImageReaderDone(r), "No more images" )) return NULL;
+  return readImage(&r->in);
+}
+
+// Number of bytes from the current position of regular file f to its end,
+// or 0 if unknown (f is a pipe, for instance).
+static size_t fileRest(FILE* f) {
+  struct stat st;
+  long at = ftell(f);
+  if (at < 0 || fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < at) return 0;
+  return (size_t)(st.st_size - at);
+}
+
+/// Skip the next image, without storing its pixels.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageReaderSkip(ImageReader r) { ///
+  assert (r != NULL);
+  errno = 0;
+  if (!check( !ImageReaderDone(r), "No more images" )) return 0;
+  struct pgmReader* in = &r->in;
+  if (in->len - in->pos < 2) readerFill(in);
+  if (in->len - in->pos < 2 || memcmp(in->buf + in->pos, "P5", 2) != 0) {
+    // ASCII, PBM or run-length: the pixels must be decoded anyway
+    Image img = readImage(in);
+    int success = img != NULL;
+    ImageDestroy(&img);
+    return success;
+  }
+  int w = 0, h = 0, maxval = 0;
+  int success =
+  check( readerByte(in) == 'P' && readerByte(in) == '5' , "Invalid file format" ) &&
+  check( readerInt(in, &w) , "Invalid width" ) &&
+  check( readerInt(in, &h) , "Invalid height" ) &&
+  check( readerInt(in, &maxval) && 0 < maxval && maxval <= (int)PixMax16 , "Invalid maxval" ) &&
+  check( isspace(readerByte(in)) , "Whitespace expected" );
+  // Skip the pixels: first the buffered ones, then seek (or read) past the rest
+  size_t rest = (size_t)w * h * (maxval > PixMax ? 2 : 1);
+  while (success && rest > 0) {
+    size_t n = in->len - in->pos;
+    if (n > rest) n = rest;
+    in->pos += n;
+    rest -= n;
+    // (a seek may go past the end of the file, so only seek within its size)
+    if (rest > 0 && !in->eof && rest <= LONG_MAX && rest <= fileRest(in->f) && fseek(in->f, (long)rest, SEEK_CUR) == 0) break;
+    success = check( rest == 0 || readerFill(in) > 0, "Reading pixels" );
+  }
+  FILE_IO++;
+  return success;
+}
+
+/// Close the reader *pr, and set *pr to NULL.
+/// If *pr is NULL, no operation is performed.
+void ImageReaderClose(ImageReader* pr) { ///
+  assert (pr != NULL);
+  if (*pr == NULL) return;
+  if ((*pr)->own) fclose((*pr)->in.f);
+  free(*pr);
+  *pr = NULL;
+}
+
+// Return a new writer to f (or NULL, on allocation failure).
+static ImageWriter newWriter(FILE* f, int own) {
+  ImageWriter w = NULL;
+  if (!check( (w = (ImageWriter)malloc(sizeof(*w))) != NULL, "Memory allocation failed" )) {
+    MEM_ALLOC_FAILURES++;
+    return NULL;
+  }
+  w->f = f;
+  w->own = own;
+  w->buf = NULL;
+  // Large buffer for a stream we opened (otherwise f may have been used)
+  if (own && (w->buf = (char*)malloc(WRITER_BUF)) != NULL) {
+    setvbuf(f, w->buf, _IOFBF, WRITER_BUF);
+  }
+  return w;
+}
+
+/// Create (or truncate) a PGM file for writing a sequence of images.
+/// On success, a new writer is returned.
+/// (The caller is responsible for closing the returned writer!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageWriter ImageWriterOpen(const char* filename) { ///
+  assert (filename != NULL);
+  FILE* f = NULL;
+  ImageWriter w = NULL;
+  if (check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+      (w = newWriter(f, 1)) == NULL) {
+    fclose(f);
+  }
+  return w;
+}
+
+/// Write images in sequence to the open stream f.
+/// f is flushed, but not closed, by ImageWriterClose.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageWriter ImageWriterFromFile(FILE* f) { ///
+  assert (f != NULL);
+  return newWriter(f, 0);
+}
+
+/// Append img to the stream, as a raw PGM image.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial image may have been written.
+int ImageWriterPut(ImageWriter w, Image img) { ///
+  assert (w != NULL);
+  assert (img != NULL);
+  FILE_IO++;
+  int success =
+  check( fprintf(w->f, "P5\n%d %d\n%d\n", img->width, img->height, img->maxval) > 0, "Writing header failed" ) &&
+  writePixels(img, w->f);
+  PIXMEM += (unsigned long)img->width * img->height;  // count pixel memory accesses
+  return success;
+}
+
+/// Flush and close the writer *pw, and set *pw to NULL.
+/// If *pw is NULL, no operation is performed (and nonzero is returned).
+/// On success, returns nonzero.
+/// On failure (writing buffered data), returns 0 and errno/errCause are
+/// set appropriately.
+int ImageWriterClose(ImageWriter* pw) { ///
+  assert (pw != NULL);
+  ImageWriter w = *pw;
+  if (w == NULL) return 1;
+  int success = check( fflush(w->f) == 0, "Writing pixels failed" );
+  if (w->own) success = check( fclose(w->f) == 0, "Writing pixels failed" ) && success;
+  free(w->buf);   // (after fclose, which uses it)
+  free(w);
+  *pw = NULL;
+  return success;
+}
+
+
+// Shared memory export
+//
+// An exported image is a sealed memfd with an exportHeader, and the pixel
+// array (raster or tiled, 8 or 16 bits) exactly as stored in memory.
+// Importing maps it privately: pixels are shared with the exporter (and
+// other importers) until a page is modified, and then copied on write.
+
+#define EXPORT_MAGIC "IMG8EXP"   // (8 chars, with the terminator)
+
+struct exportHeader {
+  char magic[8];
+  int32_t width, height, maxval, depth, layout;
+  int32_t unused;
+  uint64_t size;          // size of the pixel array, in bytes
+};
+
+// Write n bytes from buf to fd at offset off.  Returns 0 on failure.
+static int writeAt(int fd, const void* buf, size_t n, off_t off) {
+  const uint8* p = (const uint8*)buf;
+  while (n > 0) {
+    ssize_t r = pwrite(fd, p, n, off);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return 0;
+    p += r;
+    n -= (size_t)r;
+    off += r;
+  }
+  return 1;
+}
+
+/// Export img to a new sealed shared memory file (memfd).
+/// The file holds a copy of the pixels (and size, maxval, layout and
+/// depth), and can no longer be modified, so the descriptor may be
+/// passed to other processes that ImageImport it.
+/// On success, returns the new descriptor (the caller must close it).
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageExport(Image img) { ///
+  assert (img != NULL);
+  int fd = -1;
+#if defined(MFD_ALLOW_SEALING)
+  fd = memfd_create("image8bit", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+  errno = ENOSYS;
+#endif
+  if (!check( fd >= 0, "Shared memory creation failed" )) return -1;
+  if (!ImageExportTo(img, fd)) {
+    errsave = errno;
+    close(fd);
+    errno = errsave;
+    return -1;
+  }
+  return fd;
+}
+
+/// Export img to the shared memory file fd, which must be empty and
+/// allow sealing (see memfd_create), and seal it, as ImageExport.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageExportTo(Image img, int fd) { ///
+  assert (img != NULL);
+  assert (fd >= 0);
+  FILE_IO++;
+  struct exportHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, EXPORT_MAGIC, sizeof(hdr.magic));
+  hdr.width = img->width;
+  hdr.height = img->height;
+  hdr.maxval = img->maxval;
+  hdr.depth = img->depth;
+  hdr.layout = img->layout;
+  hdr.size = img->size;
+  struct stat st;
+  int seals = 0;
+  int success =
+  check( (seals = fcntl(fd, F_GET_SEALS)) >= 0 && (seals & F_SEAL_SEAL) == 0, "Descriptor cannot be sealed" ) &&
+  check( fstat(fd, &st) == 0 && st.st_size == 0, "Descriptor is not empty" ) &&
+  check( ftruncate(fd, (off_t)(EXPORT_HDR + img->size)) == 0, "Writing pixels failed" ) &&
+  check( writeAt(fd, &hdr, sizeof(hdr), 0) &&
+         writeAt(fd, img->pixel, img->size, EXPORT_HDR), "Writing pixels failed" ) &&
+  check( fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0,
+         "Sealing failed" );
+  PIXMEM += (unsigned long)img->width * img->height;  // count pixel memory accesses
+  return success;
+}
+
+/// Import an image exported by ImageExport from descriptor fd, without
+/// copying its pixels: they are mapped from the shared memory file and
+/// only copied (a page at a time) when modified.
+/// The file must be sealed against writing and shrinking.
+/// fd is not closed (and may be closed right after the import).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageImport(int fd) { ///
+  assert (fd >= 0);
+  FILE_IO++;
+  const int sealed = F_SEAL_SHRINK | F_SEAL_WRITE;
+  struct exportHeader hdr;
+  struct stat st;
+  int seals = 0;
+  Image img = NULL;
+  void* base = MAP_FAILED;
+
+  int success =
+  check( (seals = fcntl(fd, F_GET_SEALS)) >= 0 && (seals & sealed) == sealed, "Image not sealed" ) &&
+  check( pread(fd, &hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr) &&
+         memcmp(hdr.magic, EXPORT_MAGIC, sizeof(hdr.magic)) == 0, "Invalid file format" ) &&
+  check( hdr.width >= 0 && hdr.height >= 0 &&
+         (hdr.depth == 8 || (hdr.depth == 16 && hdr.layout == IMAGE_RASTER)) &&
+         (hdr.layout == IMAGE_RASTER || hdr.layout == IMAGE_TILED) &&
+         0 < hdr.maxval && hdr.maxval <= (hdr.depth == 16 ? (int)PixMax16 : (int)PixMax),
+         "Invalid image header" ) &&
+  check( (img = (Image)malloc(sizeof(struct image))) != NULL, "Memory allocation failed for image structure" );
+  if (success) {
+    img->width = hdr.width;
+    img->height = hdr.height;
+    img->maxval = hdr.maxval;
+    img->depth = hdr.depth;
+    success =
+    check( layoutInit(img, (ImageLayout)hdr.layout) && hdr.size == img->size && fstat(fd, &st) == 0 &&
+           (uint64_t)st.st_size >= EXPORT_HDR + hdr.size, "Invalid image size" ) &&
+    check( (base = mmap(NULL, EXPORT_HDR + img->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)) != MAP_FAILED,
+           "Mapping failed" );
+  }
+  if (!success) {
+    free(img);
+    return NULL;
+  }
+  img->pixel = (uint8*)base + EXPORT_HDR;
+  img->mapped = EXPORT_HDR + img->size;
+  img->statsValid = 0;
+  img->pyramidLevels = 1;
+  img->blurred = NULL;
+  img->dirtyAll = 1;
+  img->dirtyCount = 0;
+  pthread_mutex_init(&img->lock, NULL);
+  IMG_CREATE_DESTROY++;
+  return img;
+}
+
+
+// Pixel-type generic kernels
+//
+// PIXEL_KERNELS(T, S) defines kernels for raster images with pixels of
+// type T, as static functions with suffix S.  Public functions that accept
+// 16-bit images dispatch on the image depth: 8-bit images keep their own
+// specialized paths (look-up tables, SIMD, tiles), so the kernels are
+// only instantiated for uint16_t.
+
+// Mean filter job: horizontal window sums of all rows (in bands of rows),
+// then vertical sums of those (in bands of columns), so that the work of
+// a band does not depend on the window size.
+struct boxJob {
+  Image img;
+  int dx, dy;
+  uint32_t* sums;     // horizontal window sums, w x h
+  uint64_t* acc;      // vertical running sums, one per column
+  uint8* out;         // result pixel array
+};
+
+#define PIXEL_KERNELS(T, S) \
+\
+/* Set *min and *max to the range of levels of img (0, 0 if empty). */ \
+static void range##S(Image img, T* min, T* max) { \
+  const T* p = (const T*)img->pixel; \
+  size_t n = (size_t)img->width * img->height; \
+  T lo = (T)img->maxval, hi = 0; \
+  for (size_t i = 0; i < n; i++) { \
+    if (p[i] < lo) lo = p[i]; \
+    if (p[i] > hi) hi = p[i]; \
+  } \
+  *min = (n == 0) ? 0 : lo; \
+  *max = hi; \
+} \
+\
+/* Point operations on the rectangle (x0, y0, w, h) of img. */ \
+static void negative##S(Image img, int x0, int y0, int w, int h) { \
+  for (int y = y0; y < y0 + h; y++) { \
+    T* p = (T*)img->pixel + (size_t)y * img->width + x0; \
+    for (int i = 0; i < w; i++) p[i] = (T)(img->maxval - p[i]); \
+  } \
+} \
+\
+static void brighten##S(Image img, int x0, int y0, int w, int h, double factor) { \
+  for (int y = y0; y < y0 + h; y++) { \
+    T* p = (T*)img->pixel + (size_t)y * img->width + x0; \
+    for (int i = 0; i < w; i++) { \
+      double v = p[i] * factor + 0.5; \
+      p[i] = (T)((v > img->maxval) ? img->maxval : v); \
+    } \
+  } \
+} \
+\
+/* Mirror the rows of src into dst (which may be src). */ \
+static void mirror##S(Image dst, Image src) { \
+  int w = src->width; \
+  for (int y = 0; y < src->height; y++) { \
+    const T* p = (const T*)src->pixel + (size_t)y * w; \
+    T* d = (T*)dst->pixel + (size_t)y * w; \
+    for (int i = 0, j = w - 1; i <= j; i++, j--) { \
+      T t = p[i]; \
+      d[i] = p[j]; \
+      d[j] = t; \
+    } \
+  } \
+} \
+\
+/* Rotate src into dst, 90 degrees anti-clockwise. */ \
+static void rotate##S(Image dst, Image src) { \
+  const T* p = (const T*)src->pixel; \
+  T* d = (T*)dst->pixel; \
+  int w = src->width, h = src->height; \
+  for (int ny = 0; ny < w; ny++) {   /* row ny is column w-1-ny of src */ \
+    for (int nx = 0; nx < h; nx++) d[(size_t)ny * h + nx] = p[(size_t)nx * w + (w - 1 - ny)]; \
+  } \
+} \
+\
+/* out[x] = sum of p[x-dx..x+dx] (clipped), using prefix sums pre[w+1]. */ \
+static void rowSums##S(const T* p, int w, int dx, uint64_t* pre, uint64_t* out) { \
+  pre[0] = 0; \
+  for (int x = 0; x < w; x++) pre[x + 1] = pre[x] + p[x]; \
+  for (int x = 0; x < w; x++) { \
+    int l = (x - dx < 0) ? 0 : x - dx; \
+    int r = (x + dx >= w) ? w - 1 : x + dx; \
+    out[x] = pre[r + 1] - pre[l]; \
+  } \
+} \
+\
+/* Mean filter, as ImageBlur, with running sums, in a single thread. */ \
+/* Returns 0 if out of memory (img unchanged). */ \
+static int blurSerial##S(Image img, int dx, int dy) { \
+  int w = img->width, h = img->height; \
+  const T* p = (const T*)img->pixel; \
+  T* out = (T*)malloc(img->size); \
+  uint64_t* sums = (uint64_t*)malloc(3 * ((size_t)w + 1) * sizeof(uint64_t)); \
+  if (out == NULL || sums == NULL) { \
+    free(out); \
+    free(sums); \
+    return 0; \
+  } \
+  uint64_t* pre = sums; \
+  uint64_t* row = pre + w + 1; \
+  uint64_t* acc = row + w + 1;   /* sums of the rows of the window */ \
+  memset(acc, 0, (size_t)w * sizeof(uint64_t)); \
+  for (int v = 0; v <= dy && v < h; v++) { \
+    rowSums##S(p + (size_t)v * w, w, dx, pre, row); \
+    for (int x = 0; x < w; x++) acc[x] += row[x]; \
+  } \
+  for (int y = 0; y < h; y++) { \
+    if (y > 0 && y + dy < h) { \
+      rowSums##S(p + (size_t)(y + dy) * w, w, dx, pre, row); \
+      for (int x = 0; x < w; x++) acc[x] += row[x]; \
+    } \
+    if (y - dy - 1 >= 0) { \
+      rowSums##S(p + (size_t)(y - dy - 1) * w, w, dx, pre, row); \
+      for (int x = 0; x < w; x++) acc[x] -= row[x]; \
+    } \
+    uint64_t rows = ((y + dy >= h) ? h - 1 : y + dy) - ((y - dy < 0) ? 0 : y - dy) + 1; \
+    for (int x = 0; x < w; x++) { \
+      uint64_t cols = ((x + dx >= w) ? w - 1 : x + dx) - ((x - dx < 0) ? 0 : x - dx) + 1; \
+      uint64_t n = rows * cols; \
+      out[(size_t)y * w + x] = (T)((2*acc[x] + n) / (2*n)); \
+    } \
+  } \
+  free(sums); \
+  freePixels(img); \
+  img->pixel = (uint8*)out; \
+  return 1; \
+} \
+\
+/* Horizontal window sums of rows [y0, y1) into job->sums. */ \
+static void boxRows##S(void* arg, int band, int y0, int y1) { \
+  struct boxJob* job = (struct boxJob*)arg; \
+  int w = job->img->width; \
+  int r = (job->dx < w) ? job->dx : w - 1; \
+  for (int y = y0; y < y1; y++) { \
+    const T* p = (const T*)job->img->pixel + (size_t)y * w; \
+    uint32_t* s = job->sums + (size_t)y * w; \
+    uint32_t acc = 0; \
+    for (int x = 0; x < r; x++) acc += p[x]; \
+    for (int x = 0; x < w; x++) { \
+      if (x + r < w) acc += p[x + r]; \
+      s[x] = acc; \
+      if (x - r >= 0) acc -= p[x - r]; \
+    } \
+  } \
+} \
+\
+/* Vertical window sums of columns [x0, x1) of job->sums, divided by */ \
+/* the number of pixels in each window, into job->out. */ \
+static void boxColumns##S(void* arg, int band, int x0, int x1) { \
+  struct boxJob* job = (struct boxJob*)arg; \
+  int w = job->img->width, h = job->img->height, dx = job->dx; \
+  int r = (job->dy < h) ? job->dy : h - 1; \
+  uint64_t* acc = job->acc; \
+  T* out = (T*)job->out; \
+  for (int x = x0; x < x1; x++) acc[x] = 0; \
+  for (int v = 0; v < r; v++) { \
+    const uint32_t* s = job->sums + (size_t)v * w; \
+    for (int x = x0; x < x1; x++) acc[x] += s[x]; \
+  } \
+  for (int y = 0; y < h; y++) { \
+    if (y + r < h) { \
+      const uint32_t* s = job->sums + (size_t)(y + r) * w; \
+      for (int x = x0; x < x1; x++) acc[x] += s[x]; \
+    } \
+    uint64_t rows = ((y + r >= h) ? h - 1 : y + r) - ((y - r < 0) ? 0 : y - r) + 1; \
+    for (int x = x0; x < x1; x++) { \
+      uint64_t cols = ((x + dx >= w) ? w - 1 : x + dx) - ((x - dx < 0) ? 0 : x - dx) + 1; \
+      uint64_t n = rows * cols; \
+      out[(size_t)y * w + x] = (T)((2*acc[x] + n) / (2*n)); \
+    } \
+    if (y - r >= 0) { \
+      const uint32_t* s = job->sums + (size_t)(y - r) * w; \
+      for (int x = x0; x < x1; x++) acc[x] -= s[x]; \
+    } \
+  } \
+} \
+\
+/* Mean filter, as ImageBlur, in parallel.  Returns 0 if out of memory */ \
+/* (img unchanged). */ \
+static int blur##S(Image img, int dx, int dy) { \
+  int w = img->width, h = img->height; \
+  if (w == 0 || h == 0) return 1; \
+  uint64_t span = (dx < w) ? 2*(uint64_t)dx + 1 : (uint64_t)w; \
+  if (span * img->maxval > UINT32_MAX) return blurSerial##S(img, dx, dy); \
+  struct boxJob job = { img, dx, dy, NULL, NULL, NULL }; \
+  job.sums = (uint32_t*)malloc((size_t)w * h * sizeof(uint32_t)); \
+  job.acc = (uint64_t*)malloc((size_t)w * sizeof(uint64_t)); \
+  job.out = (uint8*)malloc(img->size); \
+  int success = job.sums != NULL && job.acc != NULL && job.out != NULL; \
+  if (success) { \
+    parallelBands(h, numBands(img), boxRows##S, &job); \
+    parallelBands(w, bandsFor((size_t)w * h, w), boxColumns##S, &job); \
+    freePixels(img); \
+    img->pixel = job.out; \
+  } else { \
+    free(job.out); \
+  } \
+  free(job.sums); \
+  free(job.acc); \
+  return success; \
+}
+
+PIXEL_KERNELS(uint16_t, 16)
+
+
+/// Information queries
+
+/// These functions do not modify the image and never fail.
+
+/// Get image width
+int ImageWidth(Image img) { ///
+  assert (img != NULL);
+  return img->width;
+}
+
+/// Get image height
+int ImageHeight(Image img) { ///
+  assert (img != NULL);
+  return img->height;
 }
 
 /// Get image maximum gray level
@@ -325,6 +2107,18 @@ int ImageMaxval(Image img) { ///
   return img->maxval;
 }
 
+/// Get image memory layout
+ImageLayout ImageGetLayout(Image img) { ///
+  assert (img != NULL);
+  return img->layout;
+}
+
+/// Get image depth: the number of bits per pixel (8 or 16)
+int ImageDepth(Image img) { ///
+  assert (img != NULL);
+  return img->depth;
+}
+
 /// Pixel stats
 /// Find the minimum and maximum gray levels in image.
 /// On return,
@@ -332,21 +2126,179 @@ int ImageMaxval(Image img) { ///
 /// *max is set to the maximum.
 void ImageStats(Image img, uint8* min, uint8* max) { ///
   assert (img != NULL);
-  // Insert your code here!
-  *min = 255;  
-  *max = 0;    
-  //Percorre cada pixel
-  for (int y = 0; y < img->height; y++) {
-    for (int x = 0; x < img->width; x++) {
-      uint8 pixel = img->pixel[y * img->width + x]; //Obtém o valor do pixel
-      if (pixel < *min) {
-        *min = pixel; //Atualiza o mínimo
-      }
-      if (pixel > *max) {
-        *max = pixel; //Atualiza o máximo
+  assert (img->depth == 8);
+  ImageStatistics stats;
+  ImageStatsEx(img, &stats);
+  *min = stats.min;
+  *max = stats.max;
+}
+
+/// Pixel stats of an 8-bit or 16-bit image.
+/// Like ImageStats: find the minimum and maximum gray levels in image.
+/// For an empty image, both are 0.
+void ImageStats16(Image img, uint16_t* min, uint16_t* max) { ///
+  assert (img != NULL);
+  if (img->depth == 16) {
+    range16(img, min, max);
+    PIXMEM += (unsigned long)img->width * img->height;  // count pixel memory accesses
+    return;
+  }
+  uint8 lo, hi;
+  ImageStats(img, &lo, &hi);
+  *min = lo;
+  *max = hi;
+}
+
+// Histogram engine
+//
+// Counting pixels with a single array of counters is slow when many
+// consecutive pixels have the same level (e.g. a mostly white scan):
+// each increment must wait for the previous store to the same counter.
+// So, each band of rows is counted into four sub-histogram banks, used
+// in turn by consecutive pixels, which are merged at the end.
+
+// Maximum number of pixels counted in 32-bit histogram banks before merging
+#define HIST_CHUNK ((size_t)1 << 31)
+
+struct histJob {
+  Image img;
+  uint64_t (*hist)[256];  // one partial histogram per band
+};
+
+// Count the n pixels of p into the banks (n must not exceed HIST_CHUNK).
+static inline void histCount(uint32_t bank[4][256], const uint8* p, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    bank[0][p[i]]++;
+    bank[1][p[i+1]]++;
+    bank[2][p[i+2]]++;
+    bank[3][p[i+3]]++;
+  }
+  for (; i < n; i++) bank[0][p[i]]++;
+}
+
+// Add the banks to hist and clear them.
+static void histMerge(uint64_t hist[256], uint32_t bank[4][256]) {
+  for (int v = 0; v < 256; v++) {
+    hist[v] += (uint64_t)bank[0][v] + bank[1][v] + bank[2][v] + bank[3][v];
+    bank[0][v] = bank[1][v] = bank[2][v] = bank[3][v] = 0;
+  }
+}
+
+static void histBand(void* arg, int band, int y0, int y1) {
+  struct histJob* job = (struct histJob*)arg;
+  Image img = job->img;
+  uint64_t* hist = job->hist[band];
+
+  uint32_t bank[4][256];
+  memset(bank, 0, sizeof(bank));
+  memset(hist, 0, 256*sizeof(uint64_t));
+  if (img->layout == IMAGE_RASTER) {
+    const uint8* p = img->pixel + (size_t)y0 * img->width;
+    size_t n = (size_t)(y1 - y0) * img->width;
+    for (size_t i = 0; i < n; ) {
+      // Merge banks at least every 2^31 pixels, so 32-bit counters never overflow
+      size_t c = (n - i > HIST_CHUNK) ? HIST_CHUNK : n - i;
+      histCount(bank, p + i, c);
+      histMerge(hist, bank);
+      i += c;
+    }
+  } else {
+    // Tiled: rows of tiles [y0, y1), counting each tile (without padding)
+    size_t counted = 0;
+    for (int ty = y0; ty < y1; ty++) {
+      int h = img->height - (ty << TILE_SHIFT);
+      if (h > TILE) h = TILE;
+      for (int tx = 0; tx < img->tilesX; tx++) {
+        const uint8* p = img->pixel + ((size_t)ty * img->tilesX + tx) * TILE_PIXELS;
+        int w = spanLength(img, tx << TILE_SHIFT);
+        if (w == TILE) {
+          histCount(bank, p, (size_t)h * TILE);   // h full rows are contiguous
+        } else {
+          for (int i = 0; i < h; i++) histCount(bank, p + (i << TILE_SHIFT), (size_t)w);
+        }
+        counted += (size_t)h * w;
+        if (counted >= HIST_CHUNK) {
+          histMerge(hist, bank);
+          counted = 0;
+        }
       }
     }
+    histMerge(hist, bank);
+  }
+}
+
+// Compute the histogram of img into hist[256], in parallel row bands.
+static void computeHistogram(Image img, uint64_t hist[256]) {
+  int nbands = numBands(img);
+  struct histJob job = { img, NULL };
+  if (nbands > 1) job.hist = malloc(nbands * sizeof(*job.hist));
+  if (job.hist == NULL) {
+    // Single band: count directly into the result
+    job.hist = (uint64_t (*)[256])hist;
+    histBand(&job, 0, 0, storageRows(img));
+  } else {
+    parallelBands(storageRows(img), nbands, histBand, &job);
+    memcpy(hist, job.hist[0], 256*sizeof(uint64_t));
+    for (int b = 1; b < nbands; b++) {
+      for (int v = 0; v < 256; v++) hist[v] += job.hist[b][v];
+    }
+    free(job.hist);
+  }
+  PIXMEM += (unsigned long)img->width * img->height;  // count pixel memory accesses
+}
+
+/// Extended pixel stats
+/// Compute min, max, sum, mean, variance and histogram of the gray levels,
+/// in a single pass over the pixels, and copy them to (*stats).
+/// The result is cached in the image, so repeated calls are O(1) until
+/// the image is modified by some other function of this module.
+/// For an empty image, min=max=0, mean=variance=0 and hist is all zero.
+void ImageStatsEx(Image img, ImageStatistics* stats) { ///
+  assert (img != NULL);
+  assert (img->depth == 8);
+  assert (stats != NULL);
+  pthread_mutex_lock(&img->lock);
+  if (!img->statsValid) {
+    ImageStatistics* s = &img->stats;
+    size_t n = (size_t)img->width * img->height;
+
+    // The only pass over the pixels: the histogram.
+    computeHistogram(img, s->hist);
+
+    // Everything else follows exactly from the histogram, in O(256)
+    uint64_t sum = 0;
+    double sumsq = 0.0;
+    int min = -1, max = 0;
+    for (int v = 0; v < 256; v++) {
+      if (s->hist[v] == 0) continue;
+      if (min < 0) min = v;
+      max = v;
+      sum += s->hist[v] * (uint64_t)v;
+      sumsq += (double)s->hist[v] * v * v;
+    }
+    s->min = (uint8)(min < 0 ? 0 : min);
+    s->max = (uint8)max;
+    s->sum = sum;
+    s->mean = (n > 0) ? (double)sum / n : 0.0;
+    s->variance = (n > 0) ? sumsq / n - s->mean * s->mean : 0.0;
+    if (s->variance < 0.0) s->variance = 0.0;  // rounding
+    img->statsValid = 1;
   }
+  *stats = img->stats;
+  pthread_mutex_unlock(&img->lock);
+}
+
+/// Histogram
+/// Set hist[v] to the number of pixels with gray level v, for v in [0, 255].
+/// Large images are counted in parallel row bands.
+/// Like ImageStatsEx, the result is cached in the image.
+void ImageHistogram(Image img, uint64_t hist[256]) { ///
+  assert (img != NULL);
+  assert (hist != NULL);
+  ImageStatistics stats;
+  ImageStatsEx(img, &stats);  // computes and caches the histogram
+  memcpy(hist, stats.hist, 256*sizeof(uint64_t));
 }
 
 /// Check if pixel position (x,y) is inside img.
@@ -356,13 +2308,16 @@ int ImageValidPos(Image img, int x, int y) { ///
 }
 
 /// Check if rectangular area (x,y,w,h) is completely inside img.
+/// (A rectangle with negative width or height is not.)
 int ImageValidRect(Image img, int x, int y, int w, int h) { ///
   assert (img != NULL);
   // Insert your code here!
   // Primeiro, verifica se o canto esquerdo superior (x, y) está dentro da imagem,
   // e então verifica se o canto direito inferior (x + w, y + h) também está.
   // Isso é feito comparando as coordenadas x e y com as dimensões da imagem
-  return (0 <= x && x + w <= img->width) && (0 <= y && y + h <= img->height);
+  // (written as differences, which cannot overflow)
+  return (0 <= x && x <= img->width && 0 <= w && w <= img->width - x) &&
+         (0 <= y && y <= img->height && 0 <= h && h <= img->height - y);
 }
 
 
@@ -376,19 +2331,20 @@ int ImageValidRect(Image img, int x, int y, int w, int h) { ///
 // Transform (x, y) coords into linear pixel index.
 // This internal function is used in ImageGetPixel / ImageSetPixel. 
 // The returned index must satisfy (0 <= index < img->width*img->height)
-static inline int G(Image img, int x, int y) {
-  int index = y * img->width + x;
+static inline size_t G(Image img, int x, int y) {
+  size_t index = pixelOffset(img, x, y);  // layout-aware
   // Insert your code here!
   // Verifica se o índice calculado está dentro dos limites válidos da imagem.
   // Esta afirmação garante que o índice não seja negativo e que esteja dentro
   // do intervalo total de pixels da imagem (largura * altura)
-  assert (0 <= index && index < img->width*img->height);
+  assert (index < img->size);
   return index; //Devolve o índice calculado
 }
 
 /// Get the pixel (level) at position (x,y).
 uint8 ImageGetPixel(Image img, int x, int y) { ///
   assert (img != NULL);
+  assert (img->depth == 8);
   assert (ImageValidPos(img, x, y));
   PIXMEM += 1;  // count one pixel access (read)
   return img->pixel[G(img, x, y)];
@@ -398,11 +2354,36 @@ uint8 ImageGetPixel(Image img, int x, int y) { ///
 void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
   PIXEL_MODIFICATIONS++;
   assert (img != NULL);
+  assert (img->depth == 8);
   assert (ImageValidPos(img, x, y));
   PIXMEM += 1;  // count one pixel access (store)
   img->pixel[G(img, x, y)] = level;
+  imageModifiedRect(img, x, y, 1, 1);
 } 
 
+/// Get the pixel (level) at position (x,y), of an 8-bit or 16-bit image.
+uint16_t ImageGetPixel16(Image img, int x, int y) { ///
+  assert (img != NULL);
+  assert (ImageValidPos(img, x, y));
+  PIXMEM += 1;  // count one pixel access (read)
+  if (img->depth == 8) return img->pixel[G(img, x, y)];
+  return ((const uint16_t*)img->pixel)[(size_t)y * img->width + x];
+}
+
+/// Set the pixel at position (x,y) of an 8-bit or 16-bit image to new level.
+/// Requires: level <= maxval.
+void ImageSetPixel16(Image img, int x, int y, uint16_t level) { ///
+  PIXEL_MODIFICATIONS++;
+  assert (img != NULL);
+  assert (ImageValidPos(img, x, y));
+  assert (level <= img->maxval);
+  PIXMEM += 1;  // count one pixel access (store)
+  if (img->depth == 8) img->pixel[G(img, x, y)] = (uint8)level;
+  else ((uint16_t*)img->pixel)[(size_t)y * img->width + x] = level;
+  imageModifiedRect(img, x, y, 1, 1);
+}
+
+
 
 /// Pixel transformations
 
@@ -415,13 +2396,20 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
 /// resulting in a "photographic negative" effect.
+/// Accepts 16-bit images.
 void ImageNegative(Image img) { ///
   assert (img != NULL);
+  if (img->depth == 16) {
+    negative16(img, 0, 0, img->width, img->height);
+    imageModified(img);
+    return;
+  }
   // Insert your code here!
-  int totalPixels = img->width * img->height; //Calcula os pixels da imagem 
-  for (int i = 0; i < totalPixels; i++) {
+  size_t totalPixels = img->size; // all pixels (and tile padding, if tiled)
+  for (size_t i = 0; i < totalPixels; i++) {
     img->pixel[i] = 255 - img->pixel[i];  // Assuming 8-bit gray levels
   }
+  imageModified(img);
 }
 
 /// Apply threshold to image.
@@ -429,9 +2417,10 @@ void ImageNegative(Image img) { ///
 /// all pixels with level>=thr to white (maxval).
 void ImageThreshold(Image img, uint8 thr) { ///
   assert (img != NULL);
+  assert (img->depth == 8);
   // Insert your code here!
-  int totalPixels = img->width * img->height; //Calcula os pixels da imagem 
-  for (int i = 0; i < totalPixels; i++) {
+  size_t totalPixels = img->size; // all pixels (and tile padding, if tiled)
+  for (size_t i = 0; i < totalPixels; i++) {
     // Define o pixel como preto ou branco com base no limiar 'thr'
     if (img->pixel[i] < thr) {
       img->pixel[i] = 0;  // Black
@@ -439,60 +2428,356 @@ void ImageThreshold(Image img, uint8 thr) { ///
       img->pixel[i] = 255;  // White
     }
   }
+  imageModified(img);
 }
 
 /// Brighten image by a factor.
 /// Multiply each pixel level by a factor, but saturate at maxval.
 /// This will brighten the image if factor>1.0 and
 /// darken the image if factor<1.0.
+/// Accepts 16-bit images.
 void ImageBrighten(Image img, double factor) { ///
   assert(img != NULL && factor >= 0.0);
   // ? assert (factor >= 0.0);
+  if (img->depth == 16) {
+    brighten16(img, 0, 0, img->width, img->height, factor);
+    imageModified(img);
+    return;
+  }
   // Insert your code here!
-  int totalPixels = img->width * img->height; //Calcula os pixels da imagem 
-  for (int i = 0; i < totalPixels; i++) {
+  size_t totalPixels = img->size; // all pixels (and tile padding, if tiled)
+  for (size_t i = 0; i < totalPixels; i++) {
     int newLevel = (int)(img->pixel[i] * factor + 0.5); // Add 0.5 for rounding
     if (newLevel > img->maxval) newLevel = img->maxval; // Use img->maxval for saturation
     img->pixel[i] = (uint8)newLevel; // Atualiza o pixel com o novo nível de luminosidade
   }
+  imageModified(img);
 }
 
 
-/// Geometric transformations
+// Look-up table transformations
+//
+// Any point operation (where the new level depends only on the old level)
+// may be applied as a single pass that replaces each level v by lut[v].
 
-/// These functions apply geometric transformations to an image,
-/// returning a new image as a result.
-/// 
-/// Success and failure are treated as in ImageCreate:
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
+struct lutJob {
+  Image img;
+  const uint8* lut;
+};
 
-// Implementation hint: 
-// Call ImageCreate whenever you need a new image!
+static void lutBand(void* arg, int band, int y0, int y1) {
+  struct lutJob* job = (struct lutJob*)arg;
+  const uint8* lut = job->lut;
+  // Storage rows [y0, y1) (padding of tiled images is also mapped)
+  uint8* p = job->img->pixel + (size_t)y0 * storageRowBytes(job->img);
+  size_t n = (size_t)(y1 - y0) * storageRowBytes(job->img);
+  for (size_t i = 0; i < n; i++) {
+    p[i] = lut[p[i]];
+  }
+}
 
-/// Rotate an image.
-/// Returns a rotated version of the image.
-/// The rotation is 90 degrees anti-clockwise.
-/// Ensures: The original img is not modified.
-/// 
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
+// Replace each pixel level v in img by lut[v], in parallel row bands.
+static void applyLUT(Image img, const uint8 lut[256]) {
+  struct lutJob job = { img, lut };
+  parallelBands(storageRows(img), numBands(img), lutBand, &job);
+  PIXMEM += 2*(unsigned long)img->width * img->height;  // count pixel memory accesses
+  imageModified(img);
+}
+
+/// Apply a look-up table to image.
+/// Replace each pixel level v by lut[v].
+/// Any point transformation (or composition of point transformations)
+/// may be applied in a single pass in this way.
+void ImageApplyLUT(Image img, const uint8 lut[256]) { ///
+  assert (img != NULL);
+  assert (img->depth == 8);
+  assert (lut != NULL);
+  applyLUT(img, lut);
+}
+
+// Point operations on a rectangle
+//
+// The rows of the rectangle are split in bands, and each row in spans
+// that are contiguous in memory.  Negative and threshold use SSE2 on 16
+// pixels at a time; the rest of the pixels (and brighten) use a table.
+
+enum { RECT_NEG, RECT_THR, RECT_LUT };
+
+struct rectJob {
+  Image img;
+  int x, y, w;            // rows start at (x, y + band row), w pixels
+  int kind;               // RECT_NEG, RECT_THR or RECT_LUT
+  uint8 thr;              // threshold (RECT_THR)
+  uint8 lut[256];         // the operation as a table (for any kind)
+};
+
+static void rectSpan(const struct rectJob* job, uint8* p, int n) {
+  int i = 0;
+#if defined(__SSE2__)
+  if (job->kind != RECT_LUT) {
+    const __m128i ones = _mm_set1_epi8((char)0xFF);
+    const __m128i t = _mm_set1_epi8((char)job->thr);
+    for (; i + 16 <= n; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+      // 255 - v, or 255 where v >= thr (max(v, thr) == v) and 0 elsewhere
+      v = (job->kind == RECT_NEG) ? _mm_xor_si128(v, ones) : _mm_cmpeq_epi8(_mm_max_epu8(v, t), v);
+      _mm_storeu_si128((__m128i*)(p + i), v);
+    }
+  }
+#endif
+  for (; i < n; i++) p[i] = job->lut[p[i]];
+}
+
+static void rectBand(void* arg, int band, int y0, int y1) {
+  struct rectJob* job = (struct rectJob*)arg;
+  Image img = job->img;
+  for (int y = job->y + y0; y < job->y + y1; y++) {
+    for (int x = job->x, n = job->w; n > 0; ) {
+      int c = spanLength(img, x);
+      if (c > n) c = n;
+      rectSpan(job, img->pixel + pixelOffset(img, x, y), c);
+      x += c; n -= c;
+    }
+  }
+}
+
+// Apply job (with kind, thr and lut set) to the rectangle (x, y, w, h).
+static void applyRect(struct rectJob* job, Image img, int x, int y, int w, int h) {
+  job->img = img;
+  job->x = x;
+  job->y = y;
+  job->w = w;
+  parallelBands(h, bandsFor((size_t)w * h, h), rectBand, job);
+  PIXMEM += 2*(unsigned long)w * h;  // count pixel memory accesses
+  imageModifiedRect(img, x, y, w, h);
+}
+
+/// Transform the rectangle at (x,y) with size (w,h) to negative.
+/// Like ImageNegative on a crop of img pasted back, but in place.
+/// Requires: the rectangle must be inside img.
+/// Accepts 16-bit images.
+void ImageNegativeRect(Image img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  assert (ImageValidRect(img, x, y, w, h));
+  if (img->depth == 16) {
+    negative16(img, x, y, w, h);
+    imageModifiedRect(img, x, y, w, h);
+    return;
+  }
+  struct rectJob job = { .kind = RECT_NEG };
+  for (int v = 0; v < 256; v++) job.lut[v] = (uint8)(255 - v);
+  applyRect(&job, img, x, y, w, h);
+}
+
+/// Apply threshold to the rectangle at (x,y) with size (w,h).
+/// Like ImageThreshold on a crop of img pasted back, but in place.
+/// Requires: the rectangle must be inside img.
+void ImageThresholdRect(Image img, int x, int y, int w, int h, uint8 thr) { ///
+  assert (img != NULL);
+  assert (img->depth == 8);
+  assert (ImageValidRect(img, x, y, w, h));
+  struct rectJob job = { .kind = RECT_THR, .thr = thr };
+  for (int v = 0; v < 256; v++) job.lut[v] = (v < thr) ? 0 : 255;
+  applyRect(&job, img, x, y, w, h);
+}
+
+/// Brighten the rectangle at (x,y) with size (w,h) by a factor.
+/// Like ImageBrighten on a crop of img pasted back, but in place.
+/// Requires: the rectangle must be inside img.
+/// Accepts 16-bit images.
+void ImageBrightenRect(Image img, int x, int y, int w, int h, double factor) { ///
+  assert (img != NULL && factor >= 0.0);
+  assert (ImageValidRect(img, x, y, w, h));
+  if (img->depth == 16) {
+    brighten16(img, x, y, w, h, factor);
+    imageModifiedRect(img, x, y, w, h);
+    return;
+  }
+  struct rectJob job = { .kind = RECT_LUT };
+  for (int v = 0; v < 256; v++) {
+    int level = (int)(v * factor + 0.5);
+    job.lut[v] = (uint8)((level > img->maxval) ? img->maxval : level);
+  }
+  applyRect(&job, img, x, y, w, h);
+}
+
+/// Equalize the histogram of the image.
+/// Map each level v to round(maxval * (cdf(v)-cdf(min)) / (N-cdf(min))),
+/// where cdf(v) is the number of pixels with level <= v, N is the number
+/// of pixels and min is the minimum level, spreading levels over [0, maxval].
+/// An image with a single gray level is not modified.
+void ImageEqualize(Image img) { ///
+  assert (img != NULL);
+  ImageStatistics stats;
+  ImageStatsEx(img, &stats);
+  uint64_t n = (uint64_t)img->width * img->height;
+  uint64_t cdfmin = stats.hist[stats.min];
+  if (n == cdfmin) return;  // single gray level (or empty image)
+
+  uint8 lut[256];
+  uint64_t cdf = 0;
+  for (int v = 0; v < 256; v++) {
+    cdf += stats.hist[v];
+    lut[v] = (cdf <= cdfmin) ? 0 :
+      (uint8)(((double)(cdf - cdfmin) * img->maxval) / (double)(n - cdfmin) + 0.5);
+  }
+  applyLUT(img, lut);
+}
+
+/// Apply threshold to image, with an automatically chosen level.
+/// The level is chosen by Otsu's method, to maximize the between-class
+/// variance of the resulting black and white pixel classes.
+/// The threshold is applied as in ImageThreshold.
+/// Returns the threshold level used.
+/// (For an image with a single gray level, that level is returned.)
+uint8 ImageAutoThreshold(Image img) { ///
+  assert (img != NULL);
+  ImageStatistics stats;
+  ImageStatsEx(img, &stats);
+  double n = (double)img->width * img->height;
+
+  // Class 0 = levels [0, thr), class 1 = levels [thr, 255]
+  int thr = stats.min;
+  double best = 0.0;
+  double n0 = 0.0, sum0 = 0.0;
+  for (int t = 1; t <= 255; t++) {
+    n0 += (double)stats.hist[t-1];
+    sum0 += (double)stats.hist[t-1] * (t-1);
+    double n1 = n - n0;
+    if (n0 == 0.0) continue;
+    if (n1 == 0.0) break;
+    double mean0 = sum0 / n0;
+    double mean1 = ((double)stats.sum - sum0) / n1;
+    double between = n0 * n1 * (mean0 - mean1) * (mean0 - mean1);
+    if (between > best) {
+      best = between;
+      thr = t;
+    }
+  }
+
+  uint8 lut[256];
+  for (int v = 0; v < 256; v++) {
+    lut[v] = (v < thr) ? 0 : 255;  // as in ImageThreshold
+  }
+  applyLUT(img, lut);
+  return (uint8)thr;
+}
+
+
+/// Geometric transformations
+
+/// These functions apply geometric transformations to an image,
+/// returning a new image as a result.
+/// 
+/// Success and failure are treated as in ImageCreate:
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+
+// Implementation hint: 
+// Call ImageCreate whenever you need a new image!
+
+// Row reversal
+//
+// Mirroring reverses each row, which is contiguous in memory.
+// With SSE2, 16 pixels are reversed at a time: swap the bytes within each
+// 16-bit word, then the words within each 64-bit half, then the halves.
+
+#if defined(__SSE2__)
+static inline __m128i reverse16(__m128i v) {
+  v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+  v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+  v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+  return _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+}
+#endif
+
+// Store the n pixels of src in reverse order in dst (no overlap).
+static void reverseRow(uint8* dst, const uint8* src, int n) {
+  int i = 0;
+#if defined(__SSE2__)
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + n - 16 - i));
+    _mm_storeu_si128((__m128i*)(dst + i), reverse16(v));
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = src[n - 1 - i];
+  }
+}
+
+// Reverse the n pixels of row p in place.
+static void reverseRowInPlace(uint8* p, int n) {
+  int i = 0, j = n;   // swap p[i..] with p[..j-1]
+#if defined(__SSE2__)
+  for (; j - i >= 32; i += 16, j -= 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(p + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(p + j - 16));
+    _mm_storeu_si128((__m128i*)(p + i), reverse16(b));
+    _mm_storeu_si128((__m128i*)(p + j - 16), reverse16(a));
+  }
+#endif
+  for (j--; i < j; i++, j--) {
+    uint8 t = p[i];
+    p[i] = p[j];
+    p[j] = t;
+  }
+}
+
+// Rotate tiled image img into tiled image newImg, one newImg tile at a time.
+// A row of a newImg tile is a column of a single img tile, so all reads
+// and writes of a tile stay within two 4 KiB blocks.
+static void rotateTiled(Image newImg, Image img) {
+  for (int ty = 0; ty < newImg->tilesY; ty++) {
+    for (int tx = 0; tx < newImg->tilesX; tx++) {
+      int x0 = tx << TILE_SHIFT;
+      int y0 = ty << TILE_SHIFT;
+      int w = spanLength(newImg, x0);
+      int y1 = (newImg->height - y0 < TILE) ? newImg->height : y0 + TILE;
+      for (int ny = y0; ny < y1; ny++) {
+        // Row ny of newImg is column (img->width-1-ny) of img
+        uint8* d = newImg->pixel + pixelOffset(newImg, x0, ny);
+        const uint8* p = img->pixel + pixelOffset(img, img->width - 1 - ny, x0);
+        for (int i = 0; i < w; i++) {
+          d[i] = p[(size_t)i << TILE_SHIFT];
+        }
+      }
+    }
+  }
+}
+
+/// Rotate an image.
+/// Returns a rotated version of the image.
+/// The rotation is 90 degrees anti-clockwise.
+/// Ensures: The original img is not modified.
+/// Accepts 16-bit images.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img) { ///
   TRANSFORM_OPS++; //Incrementa o contador de operações de transformação
   assert (img != NULL);
   // Insert your code here!
-  Image newImg = ImageCreate(img->height, img->width, img->maxval); //Cria nova imagem com as medidas invertidas
+  Image newImg = imageLike(img, img->height, img->width); //Cria nova imagem com as medidas invertidas
   if (newImg == NULL) return NULL;
 
+  if (img->depth == 16) {
+    rotate16(newImg, img);
+    return newImg;
+  }
+
+  if (img->layout == IMAGE_TILED) {
+    rotateTiled(newImg, img);
+    return newImg;
+  }
   for (int x = 0; x < img->width; x++) {
     for (int y = 0; y < img->height; y++) {
-      uint8 pixel = img->pixel[y * img->width + x];
+      uint8 pixel = img->pixel[(size_t)y * img->width + x];
       //Calcula novas coordenadas após rotação
       int newX = y;
       int newY = img->width - 1 - x;
-      newImg->pixel[newY * newImg->width + newX] = pixel; //Atribui pixel à nova imagem
+      newImg->pixel[(size_t)newY * newImg->width + newX] = pixel; //Atribui pixel à nova imagem
     }
   }
 
@@ -502,28 +2787,219 @@ Image ImageRotate(Image img) { ///
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
+/// Accepts 16-bit images.
 /// 
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageMirror(Image img) { ///
   assert (img != NULL);
-  // Insert your code here!
-  Image newImg = ImageCreate(img->width, img->height, img->maxval); //Cria imagem com as mesmas dimensões do original
+  Image newImg = imageLike(img, img->width, img->height); //Cria imagem com as mesmas dimensões do original
   if (newImg == NULL) return NULL;
 
-  for (int x = 0; x < img->width; x++) {
-    for (int y = 0; y < img->height; y++) {
-      uint8 pixel = img->pixel[y * img->width + x];
-      int newX = img->width - 1 - x; //Calcula as novas coordenadas após o espelhamento 
-      newImg->pixel[y * newImg->width + newX] = pixel; //Atribui o pixel à nova imagem 
+  if (img->depth == 16) {
+    mirror16(newImg, img);
+    return newImg;
+  }
+
+  // Each row of the new image is the reversed row of the original
+  for (int y = 0; y < img->height; y++) {
+    if (img->layout == IMAGE_RASTER) {
+      size_t row = (size_t)y * img->width;
+      reverseRow(newImg->pixel + row, img->pixel + row, img->width);
+      continue;
+    }
+    // Tiled: one destination tile row at a time
+    uint8 buf[TILE];
+    for (int x = 0; x < img->width; x += TILE) {
+      int c = spanLength(newImg, x);
+      getSpan(img, img->width - x - c, y, c, buf);
+      reverseRow(newImg->pixel + pixelOffset(newImg, x, y), buf, c);
     }
   }
+  PIXMEM += 2*(unsigned long)img->width * img->height;  // count pixel memory accesses
 
   return newImg; //Devolve a nova imagem
 }
 
+/// Mirror an image in-place = flip left-right.
+/// This modifies img in-place: no allocation involved.
+/// Ensures: The result is the same as ImageMirror(img).
+/// Accepts 16-bit images.
+void ImageMirrorInPlace(Image img) { ///
+  assert (img != NULL);
+  if (img->depth == 16) {
+    mirror16(img, img);
+    imageModified(img);
+    return;
+  }
+  for (int y = 0; y < img->height; y++) {
+    if (img->layout == IMAGE_RASTER) {
+      reverseRowInPlace(img->pixel + (size_t)y * img->width, img->width);
+      continue;
+    }
+    // Tiled: swap reversed chunks from both ends, towards the middle
+    uint8 a[TILE], b[TILE], r[TILE];
+    for (int i = 0; img->width - 2*i > 1; ) {
+      int c = (img->width - 2*i) / 2;
+      if (c > TILE) c = TILE;
+      int j = img->width - i - c;   // right chunk [j, j+c) mirrors [i, i+c)
+      getSpan(img, i, y, c, a);
+      getSpan(img, j, y, c, b);
+      reverseRow(r, b, c);
+      putSpan(img, i, y, c, r);
+      reverseRow(r, a, c);
+      putSpan(img, j, y, c, r);
+      i += c;
+    }
+  }
+  PIXMEM += 2*(unsigned long)img->width * img->height;  // count pixel memory accesses
+  imageModified(img);
+}
+
+/// Flip an image in-place = flip top-bottom.
+/// This modifies img in-place: no allocation involved.
+/// Accepts 16-bit images.
+void ImageFlipVertical(Image img) { ///
+  assert (img != NULL);
+  uint8 tmp[4096];   // rows are swapped in chunks of this size
+  size_t bpp = img->depth / 8;   // bytes per pixel
+  for (int y = 0; y < img->height / 2; y++) {
+    // Same columns of both rows have the same contiguous spans
+    for (int x = 0; x < img->width; ) {
+      int c = spanLength(img, x);
+      if (c * bpp > sizeof(tmp)) c = sizeof(tmp) / bpp;
+      uint8* top = img->pixel + pixelOffset(img, x, y) * bpp;
+      uint8* bottom = img->pixel + pixelOffset(img, x, img->height - 1 - y) * bpp;
+      memcpy(tmp, top, c * bpp);
+      memcpy(top, bottom, c * bpp);
+      memcpy(bottom, tmp, c * bpp);
+      x += c;
+    }
+  }
+  PIXMEM += 4*(unsigned long)img->width * (img->height / 2);  // count pixel memory accesses
+  imageModified(img);
+}
+
+/// Flip an image = flip top-bottom.
+/// Returns a flipped version of the image.
+/// Ensures: The original img is not modified.
+/// Accepts 16-bit images.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageFlip(Image img) { ///
+  assert (img != NULL);
+  Image newImg = imageLike(img, img->width, img->height);
+  if (newImg == NULL) return NULL;
+  size_t bpp = img->depth / 8;   // bytes per pixel
+  // Each row goes to the opposite row, with the same contiguous spans
+  for (int y = 0; y < img->height; y++) {
+    for (int x = 0; x < img->width; ) {
+      int c = spanLength(img, x);
+      memcpy(newImg->pixel + pixelOffset(newImg, x, img->height - 1 - y) * bpp,
+             img->pixel + pixelOffset(img, x, y) * bpp, c * bpp);
+      x += c;
+    }
+  }
+  PIXMEM += 2*(unsigned long)img->width * img->height;  // count pixel memory accesses
+  return newImg;
+}
+
+
+
+// Block transfer (blit) of pixel rectangles
+//
+// ImageCrop and ImagePaste both copy a w x h rectangle between two raster
+// scans with (possibly) different row lengths (strides).  Each row of the
+// rectangle is contiguous in memory, so it is copied with a single memcpy.
+// When both strides equal w, the whole rectangle is one contiguous block.
+//
+// When the destination block is larger than the last-level cache (LLC),
+// regular stores would evict useful data and pay for a read-for-ownership
+// of every destination line that is never read back.  In that case, rows
+// are written with non-temporal (streaming) stores, if available.
+
+// Fallback LLC size, when it cannot be queried from the system.
+#define BLIT_DEFAULT_LLC (8u << 20)
+
+static size_t llc = BLIT_DEFAULT_LLC;
+static pthread_once_t llcOnce = PTHREAD_ONCE_INIT;
+
+static void detectLLC(void) {
+  long sz = -1;
+#if defined(_SC_LEVEL3_CACHE_SIZE)
+  sz = sysconf(_SC_LEVEL3_CACHE_SIZE);
+  if (sz <= 0) sz = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+  if (sz > 0) llc = (size_t)sz;
+}
+
+// Size of the last-level cache, in bytes (queried once).
+static size_t llcSize(void) {
+  pthread_once(&llcOnce, detectLLC);
+  return llc;
+}
+
+// Copy n bytes from src to dst bypassing the cache for dst.
+// Regions must not overlap.
+static void streamCopy(uint8* dst, const uint8* src, size_t n) {
+#if defined(__SSE2__)
+  // Head: advance until dst is 16-byte aligned
+  size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+  if (head > n) head = n;
+  memcpy(dst, src, head);
+  dst += head; src += head; n -= head;
+  // Body: 64 bytes (one cache line) per iteration
+  for (; n >= 64; n -= 64, dst += 64, src += 64) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(src +  0));
+    __m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+    __m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+    __m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+    _mm_stream_si128((__m128i*)(dst +  0), a);
+    _mm_stream_si128((__m128i*)(dst + 16), b);
+    _mm_stream_si128((__m128i*)(dst + 32), c);
+    _mm_stream_si128((__m128i*)(dst + 48), d);
+  }
+  for (; n >= 16; n -= 16, dst += 16, src += 16) {
+    _mm_stream_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+  }
+#endif
+  // Tail (or everything, without SSE2)
+  memcpy(dst, src, n);
+}
+
+// Copy a w x h rectangle of pixels.
+//   dst, dstStride : top left pixel and row length of the destination.
+//   src, srcStride : top left pixel and row length of the source.
+// Requires: rectangles must not overlap.
+static void blit(uint8* dst, size_t dstStride, const uint8* src, size_t srcStride,
+                 size_t w, int h) {
+  assert (h >= 0);
+  assert (dstStride >= w && srcStride >= w);
+  size_t total = w * h;
+  if (total == 0) return;
+  int stream = total > llcSize();
 
+  if (dstStride == w && srcStride == w) {
+    // Full-width rectangle: a single contiguous block
+    if (stream) streamCopy(dst, src, total);
+    else memcpy(dst, src, total);
+  } else {
+    for (int i = 0; i < h; i++) {
+      uint8* d = dst + i * dstStride;
+      const uint8* s = src + i * srcStride;
+      if (stream) streamCopy(d, s, w);
+      else memcpy(d, s, w);
+    }
+  }
+#if defined(__SSE2__)
+  // Make streaming stores globally visible before returning
+  if (stream) _mm_sfence();
+#endif
+  PIXMEM += 2*(unsigned long)total;  // count pixel memory accesses
+}
 
 /// Crop a rectangular subimage from img.
 /// The rectangle is specified by the top left corner coords (x, y) and
@@ -533,6 +3009,7 @@ Image ImageMirror(Image img) { ///
 /// Ensures:
 ///   The original img is not modified.
 ///   The returned image has width w and height h.
+/// Accepts 16-bit images.
 /// 
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
@@ -541,36 +3018,277 @@ Image ImageCrop(Image img, int x, int y, int w, int h) { ///
   assert (img != NULL);
   assert (ImageValidRect(img, x, y, w, h));
   // Insert your code here!
-  Image croppedImg = ImageCreate(w, h, img->maxval); //Cria nova imagem
+  Image croppedImg = imageLike(img, w, h); //Cria nova imagem
   if (croppedImg == NULL) return NULL;
 
-  for (int i = 0; i < h; ++i) {
-    for (int j = 0; j < w; ++j) {
-      croppedImg->pixel[i * w + j] = img->pixel[(y + i) * img->width + (x + j)]; //Copia os pixels da área específica para a nova imagem 
-    }
+  // Copia as linhas da área específica para a nova imagem
+  if (img->depth == 16) {
+    blit(croppedImg->pixel, 2*(size_t)w, img->pixel + 2*((size_t)y * img->width + x), 2*(size_t)img->width, 2*(size_t)w, h);
+  } else if (img->layout == IMAGE_RASTER) {
+    blit(croppedImg->pixel, w, img->pixel + (size_t)y * img->width + x, img->width, w, h);
+  } else {
+    for (int i = 0; i < h; i++) copySpan(croppedImg, 0, i, img, x, y + i, w);
+    PIXMEM += 2*(unsigned long)w * h;  // count pixel memory accesses
   }
 
   return croppedImg; //Devolve a nova imagem
 }
 
 
+// Resizing
+//
+// Resizing is separable: each output pixel is a weighted sum of a few
+// source pixels in its row (taps along x) of a weighted sum of a few
+// source rows (taps along y).  The taps of each output column and row are
+// computed once, in a table per axis.  The vertical pass goes first,
+// with SIMD over whole source rows, so that, when shrinking, the scalar
+// horizontal pass only runs on the (fewer) output rows.
+//
+// Weights are integers, and the sum of the weights of each output pixel
+// is the same for all pixels of an axis (the scale of the axis).
+// For integer ratios, area averaging uses weights of 1 (an exact mean);
+// otherwise, weights are fixed-point fractions of RESIZE_ONE.
+
+#define RESIZE_SHIFT 14
+#define RESIZE_ONE (1 << RESIZE_SHIFT)
+
+struct resizeAxis {
+  int n;                  // number of output pixels
+  int maxTaps;            // maximum number of taps per output pixel
+  int* first;             // first source pixel of each output pixel
+  int* taps;              // number of taps of each output pixel
+  int* weight;            // weights, maxTaps per output pixel
+  int64_t scale;          // sum of the weights of each output pixel
+};
+
+// Build the taps for resizing an axis of src pixels to dst pixels.
+// Returns 0 on allocation failure.
+static int resizeAxisInit(struct resizeAxis* a, int src, int dst, ImageScaling mode) {
+  a->n = dst;
+  if (mode == IMAGE_BILINEAR) {
+    a->maxTaps = 2;
+  } else {
+    a->maxTaps = (src + dst - 1) / dst + 1;  // pixels overlapped by src/dst
+  }
+  a->first = (int*)malloc((size_t)dst * sizeof(int));
+  a->taps = (int*)malloc((size_t)dst * sizeof(int));
+  a->weight = (int*)malloc((size_t)dst * a->maxTaps * sizeof(int));
+  if (a->first == NULL || a->taps == NULL || a->weight == NULL) return 0;
+
+  if (mode == IMAGE_AREA && src % dst == 0) {
+    // Integer ratio: exact mean of src/dst pixels
+    int f = src / dst;
+    a->maxTaps = f;
+    a->scale = f;
+    for (int o = 0; o < dst; o++) {
+      a->first[o] = o * f;
+      a->taps[o] = f;
+      for (int t = 0; t < f; t++) a->weight[o*f + t] = 1;
+    }
+    return 1;
+  }
+  a->scale = RESIZE_ONE;
+  for (int o = 0; o < dst; o++) {
+    int* w = a->weight + (size_t)o * a->maxTaps;
+    if (mode == IMAGE_BILINEAR) {
+      // Sample at the center of the output pixel, in source coordinates
+      double c = (o + 0.5) * src / dst - 0.5;
+      if (c < 0.0) c = 0.0;
+      int i = (int)c;
+      if (i >= src - 1) {
+        i = src - 1;
+        c = i;
+      }
+      int w1 = (int)((c - i) * RESIZE_ONE + 0.5);
+      a->first[o] = i;
+      a->taps[o] = (w1 == 0) ? 1 : 2;
+      w[0] = RESIZE_ONE - w1;
+      w[1] = w1;
+    } else {
+      // Output pixel o covers [o*src, (o+1)*src), source pixel i covers
+      // [i*dst, (i+1)*dst), in units of 1/dst source pixels
+      int64_t lo = (int64_t)o * src, hi = lo + src;
+      int i0 = (int)(lo / dst), i1 = (int)((hi - 1) / dst);
+      // (Weights are differences of rounded cumulative overlaps, so that
+      // they add up to exactly RESIZE_ONE, with rounding errors spread.)
+      int64_t cum = 0;
+      int prev = 0;
+      for (int i = i0; i <= i1; i++) {
+        int64_t l = (i*(int64_t)dst > lo) ? i*(int64_t)dst : lo;
+        int64_t r = ((i+1)*(int64_t)dst < hi) ? (i+1)*(int64_t)dst : hi;
+        cum += r - l;
+        int next = (int)((cum * RESIZE_ONE + src/2) / src);
+        w[i - i0] = next - prev;
+        prev = next;
+      }
+      a->first[o] = i0;
+      a->taps[o] = i1 - i0 + 1;
+    }
+  }
+  return 1;
+}
+
+static void resizeAxisFree(struct resizeAxis* a) {
+  free(a->first);
+  free(a->taps);
+  free(a->weight);
+}
+
+struct resizeJob {
+  Image img;              // source
+  Image dst;              // result
+  struct resizeAxis ax, ay;
+  int shift;              // log2 of ax.scale * ay.scale, or -1
+  uint8* work;            // work memory, bandBytes for each band
+  size_t bandBytes;
+};
+
+// acc[x] += weight * p[x], for x in [0, n).
+// Requires: 0 <= weight < 2^15.
+static void resizeAccRow(int32_t* acc, const uint8* p, int n, int weight) {
+  int x = 0;
+#if defined(__SSE2__)
+  // 16-bit pixels, zero-extended to 32 bits: madd with (weight, 0) pairs
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i w = _mm_set1_epi32(weight);
+  for (; x + 16 <= n; x += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p + x));
+    __m128i lo = _mm_unpacklo_epi8(v, zero);
+    __m128i hi = _mm_unpackhi_epi8(v, zero);
+    __m128i* a = (__m128i*)(acc + x);
+    _mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), _mm_madd_epi16(_mm_unpacklo_epi16(lo, zero), w)));
+    _mm_storeu_si128(a+1, _mm_add_epi32(_mm_loadu_si128(a+1), _mm_madd_epi16(_mm_unpackhi_epi16(lo, zero), w)));
+    _mm_storeu_si128(a+2, _mm_add_epi32(_mm_loadu_si128(a+2), _mm_madd_epi16(_mm_unpacklo_epi16(hi, zero), w)));
+    _mm_storeu_si128(a+3, _mm_add_epi32(_mm_loadu_si128(a+3), _mm_madd_epi16(_mm_unpackhi_epi16(hi, zero), w)));
+  }
+#endif
+  for (; x < n; x++) acc[x] += weight * p[x];
+}
+
+static void resizeBand(void* arg, int band, int y0, int y1) {
+  struct resizeJob* job = (struct resizeJob*)arg;
+  Image img = job->img;
+  const struct resizeAxis* ax = &job->ax;
+  const struct resizeAxis* ay = &job->ay;
+  int sw = img->width, dw = ax->n;
+  int64_t scale = ax->scale * ay->scale;
+  int maxval = img->maxval;
+  // Work memory: vertical sums, source row, output row
+  uint8* mem = job->work + (size_t)band * job->bandBytes;
+  int32_t* acc = (int32_t*)mem;
+  uint8* row = (uint8*)(acc + sw);
+  uint8* out = row + sw;
+
+  for (int y = y0; y < y1; y++) {
+    // Vertical pass: weighted sum of the source rows of output row y
+    memset(acc, 0, (size_t)sw * sizeof(int32_t));
+    const int* wy = ay->weight + (size_t)y * ay->maxTaps;
+    for (int t = 0; t < ay->taps[y]; t++) {
+      int sy = ay->first[y] + t;
+      const uint8* p;
+      if (img->layout == IMAGE_RASTER) {
+        p = img->pixel + (size_t)sy * sw;
+      } else {
+        getSpan(img, 0, sy, sw, row);
+        p = row;
+      }
+      resizeAccRow(acc, p, sw, wy[t]);
+    }
+    // Horizontal pass, then rounding division by the scale
+    for (int x = 0; x < dw; x++) {
+      const int* wx = ax->weight + (size_t)x * ax->maxTaps;
+      const int32_t* a = acc + ax->first[x];
+      int64_t sum = 0;
+      for (int t = 0; t < ax->taps[x]; t++) sum += (int64_t)wx[t] * a[t];
+      int64_t q = (job->shift >= 0) ? (sum + (scale >> 1)) >> job->shift
+                                    : (2*sum + scale) / (2*scale);
+      out[x] = (uint8)((q > maxval) ? maxval : q);
+    }
+    putSpan(job->dst, 0, y, dw, out);
+  }
+}
+
+/// Resize an image.
+/// Returns a width x height version of the image, scaled with the
+/// given mode:
+///   IMAGE_AREA: each pixel is the mean of the source area it covers,
+///     weighted by overlap; the mean is exact when the source size is a
+///     multiple of the new size (on each axis), and computed with 14-bit
+///     fixed-point weights otherwise.  Best for shrinking.
+///   IMAGE_BILINEAR: each pixel is interpolated from the 2x2 source
+///     pixels around its center.  Best for enlarging.
+/// Requires: img is not empty; width, height > 0.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int width, int height, ImageScaling mode) { ///
+  assert (img != NULL);
+  assert (img->depth == 8);
+  assert (img->width > 0 && img->height > 0);
+  assert (width > 0 && height > 0);
+  assert (mode == IMAGE_AREA || mode == IMAGE_BILINEAR);
+  // Vertical sums must fit in 32 bits
+  assert (mode == IMAGE_BILINEAR || img->height % height != 0 ||
+          (int64_t)(img->height / height) * PixMax < INT32_MAX);
+
+  struct resizeJob job;
+  memset(&job, 0, sizeof(job));
+  job.img = img;
+  if (!check( resizeAxisInit(&job.ax, img->width, width, mode) &&
+              resizeAxisInit(&job.ay, img->height, height, mode), "Memory allocation failed" )) {
+    MEM_ALLOC_FAILURES++;
+  } else if ((job.dst = ImageCreateLayout(width, height, img->maxval, img->layout)) != NULL) {
+    int64_t scale = job.ax.scale * job.ay.scale;
+    job.shift = -1;
+    if ((scale & (scale - 1)) == 0) {
+      job.shift = 0;
+      while (((int64_t)1 << job.shift) < scale) job.shift++;
+    }
+    job.bandBytes = (size_t)img->width * (sizeof(int32_t) + 1) + (size_t)width;
+    job.bandBytes = (job.bandBytes + 15) & ~(size_t)15;
+    int nbands = numBands(img);
+    if (nbands > height) nbands = height;
+    if (!check( (job.work = (uint8*)malloc(nbands * job.bandBytes)) != NULL, "Memory allocation failed" )) {
+      MEM_ALLOC_FAILURES++;
+      ImageDestroy(&job.dst);
+    } else {
+      parallelBands(height, nbands, resizeBand, &job);
+      PIXMEM += (unsigned long)img->width * img->height + (unsigned long)width * height;
+    }
+  }
+  free(job.work);
+  resizeAxisFree(&job.ax);
+  resizeAxisFree(&job.ay);
+  return job.dst;
+}
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
 /// This modifies img1 in-place: no allocation involved.
-/// Requires: img2 must fit inside img1 at position (x, y).
+/// Requires: img2 must fit inside img1 at position (x, y), and have the
+/// same depth (8 or 16 bits).  Accepts 16-bit images.
 void ImagePaste(Image img1, int x, int y, Image img2) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidRect(img1, x, y, img2->width, img2->height));
+  assert (img1->depth == img2->depth);
   // Insert your code here!
-  // Copia os pixels de img2 para img1 
-  for (int i = 0; i < img2->height; ++i) {
-    for (int j = 0; j < img2->width; ++j) {
-      img1->pixel[(y + i) * img1->width + (x + j)] = img2->pixel[i * img2->width + j];
-    }
+  // Copia as linhas de img2 para img1
+  if (img1->depth == 16) {
+    blit(img1->pixel + 2*((size_t)y * img1->width + x), 2*(size_t)img1->width,
+         img2->pixel, 2*(size_t)img2->width, 2*(size_t)img2->width, img2->height);
+  } else if (img1->layout == IMAGE_RASTER && img2->layout == IMAGE_RASTER) {
+    blit(img1->pixel + (size_t)y * img1->width + x, img1->width,
+         img2->pixel, img2->width, img2->width, img2->height);
+  } else {
+    for (int i = 0; i < img2->height; i++) copySpan(img1, x, y + i, img2, 0, i, img2->width);
+    PIXMEM += 2*(unsigned long)img2->width * img2->height;  // count pixel memory accesses
   }
+  imageModifiedRect(img1, x, y, img2->width, img2->height);
 }
 
 /// Blend an image into a larger image.
@@ -581,18 +3299,20 @@ void ImagePaste(Image img1, int x, int y, Image img2) { ///
 /// may provide interesting effects.  Over/underflows should saturate.
 void ImageBlend(Image img1, int x, int y, Image img2, double alpha) { ///
   assert(img1 != NULL && img2 != NULL); // Verifica se as imagens não são nulas
+  assert(img1->depth == 8 && img2->depth == 8);
   assert(ImageValidRect(img1, x, y, img2->width, img2->height)); //Verifica se a opsição é válida
   assert(alpha >= 0.0 && alpha <= 1.0); // Verifica se o alpha está no intervalo
   // Junta os pixels de img2 em img1 usando o fator alpha
   for (int i = 0; i < img2->height; ++i) {
     for (int j = 0; j < img2->width; ++j) {
-      int idx1 = (y + i) * img1->width + (x + j);
-      int idx2 = i * img2->width + j;
+      size_t idx1 = G(img1, x + j, y + i);
+      size_t idx2 = G(img2, j, i);
       // Calcula o valor do combinado e garante a saturação
       double blendedValue = alpha * img2->pixel[idx2] + (1 - alpha) * img1->pixel[idx1];
       img1->pixel[idx1] = (uint8)(blendedValue > 255.0 ? 255.0 : blendedValue + 0.5);
     }
   }
+  imageModifiedRect(img1, x, y, img2->width, img2->height);
 }
 
 /// Compare an image to a subimage of a larger image.
@@ -601,36 +3321,102 @@ void ImageBlend(Image img1, int x, int y, Image img2, double alpha) { ///
 int ImageMatchSubImage(Image img1, int x, int y, Image img2) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
+  assert (img1->depth == 8 && img2->depth == 8);
   assert (ImageValidPos(img1, x, y));
   // Insert your code here!
   if (x + img2->width > img1->width || y + img2->height > img1->height) { // Verifica se img2 cabe em img1 
     return 0; 
   }
-  // Compara cada pixel de img2 com a imagem correspondente em img1
+  // Compara cada linha de img2 com a linha correspondente em img1
   for (int i = 0; i < img2->height; ++i) {
-    for (int j = 0; j < img2->width; ++j) {
-      if (img1->pixel[(y + i) * img1->width + (x + j)] != img2->pixel[i * img2->width + j]) {
-        return 0; 
-      }
+    if (!equalSpan(img1, x, y + i, img2, 0, i, img2->width)) {
+      return 0; 
     }
   }
 
   return 1; // Se for tudo igual devolve verdadeiro
 }
 
+struct locateJob {
+  Image img1, img2;
+  uint8* rows;          // a row buffer per band (img1 width bytes)
+  uint8* first;         // first row of img2
+  int found[MAX_THREADS];    // first match in each band (if found)
+  int x[MAX_THREADS], y[MAX_THREADS];
+};
+
+// Find the first match of img2 in rows [y0, y1) of candidate positions.
+// Each row of img1 is scanned with memchr for the first pixel of img2,
+// and only positions that match the first row of img2 are checked fully.
+static void locateBand(void* arg, int band, int y0, int y1) {
+  struct locateJob* job = (struct locateJob*)arg;
+  Image img1 = job->img1;
+  Image img2 = job->img2;
+  int w2 = img2->width;
+  uint8* row = job->rows + (size_t)band * img1->width;
+  for (int y = y0; y < y1; y++) {
+    getSpan(img1, 0, y, img1->width, row);
+    const uint8* p = row;
+    const uint8* end = row + (img1->width - w2) + 1;   // past the last candidate
+    while (p < end && (p = (const uint8*)memchr(p, job->first[0], (size_t)(end - p))) != NULL) {
+      int x = (int)(p - row);
+      if (memcmp(p, job->first, (size_t)w2) == 0 && ImageMatchSubImage(img1, x, y, img2)) {
+        job->found[band] = 1;
+        job->x[band] = x;
+        job->y[band] = y;
+        return;
+      }
+      p++;
+    }
+  }
+}
+
 /// Locate a subimage inside another image.
 /// Searches for img2 inside img1.
-/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If a match is found, returns 1 and the position of the first one
+/// (in raster order) is set in vars (*px, *py).
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// Rows of candidate positions are scanned in parallel bands, each one
+/// for the first pixel of img2 (with memchr); only positions that match
+/// it are compared further.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
+  assert (img1->depth == 8 && img2->depth == 8);
   // Insert your code here!
   // Verifica se os ponteiros não são nulos
   assert(px != NULL);
   assert(py != NULL);
+  if (img2->width > img1->width || img2->height > img1->height) return 0;
+  if (img2->width == 0 || img2->height == 0) {   // (found anywhere)
+    *px = *py = 0;
+    return 1;
+  }
+
+  int ny = img1->height - img2->height + 1;   // rows of candidates
+  int nb = bandsFor((size_t)ny * img1->width, ny);
+  struct locateJob job = { .img1 = img1, .img2 = img2 };
+  job.rows = (uint8*)malloc((size_t)nb * img1->width);
+  job.first = (uint8*)malloc((size_t)img2->width);
+  if (job.rows != NULL && job.first != NULL) {
+    getSpan(img2, 0, 0, img2->width, job.first);
+    parallelBands(ny, nb, locateBand, &job);
+    free(job.first);
+    free(job.rows);
+    for (int b = 0; b < nb; b++) {   // (bands are in raster order)
+      if (job.found[b]) {
+        *px = job.x[b];
+        *py = job.y[b];
+        return 1;
+      }
+    }
+    return 0;
+  }
+  free(job.first);
+  free(job.rows);
 
   // Tenta encontrar uma correspondência de img2 em img1
+  // (without the buffers: position by position)
   for (int y = 0; y <= img1->height - img2->height; y++) {
     for (int x = 0; x <= img1->width - img2->width; x++) {
       if (ImageMatchSubImage(img1, x, y, img2)) { // Usa a função ImageMatchSubImage para ver se img2 correponde a uma subimagem de img1
@@ -644,61 +3430,1733 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
   return 0; // Correspondência não foi encontrada
 }
 
+// Coarse-to-fine search parameters (see ImageFindSubImage)
+#define FIND_MIN_TEMPLATE 16   // minimum template size at the coarsest level
+#define FIND_CANDIDATES 16     // number of candidates kept at each level
+#define FIND_RADIUS 2          // radius of refinement windows
 
-/// Filtering
+// Sum of absolute differences of the n pixels of p and q.
+static uint64_t sadBytes(const uint8* p, const uint8* q, int n) {
+  uint64_t sum = 0;
+  int i = 0;
+#if defined(__SSE2__)
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(p + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(q + i));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(a, b));
+  }
+  uint64_t part[2];
+  _mm_storeu_si128((__m128i*)part, acc);
+  sum = part[0] + part[1];
+#endif
+  for (; i < n; i++) {
+    sum += (p[i] > q[i]) ? p[i] - q[i] : q[i] - p[i];
+  }
+  return sum;
+}
 
-/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
-/// Each pixel is substituted by the mean of the pixels in the rectangle
-/// [x-dx, x+dx]x[y-dy, y+dy].
-/// The image is changed in-place.
-void ImageBlur(Image img, int dx, int dy) { ///
-  // Insert your code here!
-  assert(img != NULL); // Verifica se existe imagem 
-  FILTER_OPS++; // Incrementa o contador de operações de filtragem
-  // Armazena as dimensões da imagem 
-  int width = img->width;
-  int height = img->height;
-  uint8* tempPixels = (uint8*)malloc(width * height * sizeof(uint8)); // Destina um buffer temporário para os pixels
-  if (!tempPixels) {
-    return; // Se falhar devolve sem fazer alterações
+// Sums needed for the cross-correlation of a and b
+struct corrSums {
+  uint64_t sa, sb;        // sums of levels
+  uint64_t saa, sbb, sab; // sums of products
+};
+
+// Add the n pixels of p (from a) and q (from b) to the sums in c.
+static void corrBytes(struct corrSums* c, const uint8* p, const uint8* q, int n) {
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  while (i + 16 <= n) {
+    // 32-bit lanes get at most 2*2*255*255 per step: flush every 4096 steps
+    __m128i sa = zero, sb = zero, saa = zero, sbb = zero, sab = zero;
+    for (int k = 0; k < 4096 && i + 16 <= n; k++, i += 16) {
+      __m128i a = _mm_loadu_si128((const __m128i*)(p + i));
+      __m128i b = _mm_loadu_si128((const __m128i*)(q + i));
+      sa = _mm_add_epi64(sa, _mm_sad_epu8(a, zero));
+      sb = _mm_add_epi64(sb, _mm_sad_epu8(b, zero));
+      __m128i alo = _mm_unpacklo_epi8(a, zero), ahi = _mm_unpackhi_epi8(a, zero);
+      __m128i blo = _mm_unpacklo_epi8(b, zero), bhi = _mm_unpackhi_epi8(b, zero);
+      saa = _mm_add_epi32(saa, _mm_add_epi32(_mm_madd_epi16(alo, alo), _mm_madd_epi16(ahi, ahi)));
+      sbb = _mm_add_epi32(sbb, _mm_add_epi32(_mm_madd_epi16(blo, blo), _mm_madd_epi16(bhi, bhi)));
+      sab = _mm_add_epi32(sab, _mm_add_epi32(_mm_madd_epi16(alo, blo), _mm_madd_epi16(ahi, bhi)));
+    }
+    uint64_t s64[2];
+    uint32_t s32[4];
+    _mm_storeu_si128((__m128i*)s64, sa);  c->sa += s64[0] + s64[1];
+    _mm_storeu_si128((__m128i*)s64, sb);  c->sb += s64[0] + s64[1];
+    _mm_storeu_si128((__m128i*)s32, saa); c->saa += (uint64_t)s32[0] + s32[1] + s32[2] + s32[3];
+    _mm_storeu_si128((__m128i*)s32, sbb); c->sbb += (uint64_t)s32[0] + s32[1] + s32[2] + s32[3];
+    _mm_storeu_si128((__m128i*)s32, sab); c->sab += (uint64_t)s32[0] + s32[1] + s32[2] + s32[3];
+  }
+#endif
+  for (; i < n; i++) {
+    c->sa += p[i];
+    c->sb += q[i];
+    c->saa += (uint64_t)p[i] * p[i];
+    c->sbb += (uint64_t)q[i] * q[i];
+    c->sab += (uint64_t)p[i] * q[i];
+  }
+}
+
+/// Sum of absolute differences between img2 and the subimage of img1
+/// at position (x, y).
+/// Requires: img2 must fit inside img1 at position (x, y).
+uint64_t ImageMatchSAD(Image img1, int x, int y, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (img1->depth == 8 && img2->depth == 8);
+  assert (ImageValidRect(img1, x, y, img2->width, img2->height));
+  uint64_t sum = 0;
+  for (int i = 0; i < img2->height; i++) {
+    for (int j = 0; j < img2->width; ) {
+      int c = commonSpan(img1, x + j, img2, j, img2->width - j);
+      sum += sadBytes(img1->pixel + pixelOffset(img1, x + j, y + i),
+                      img2->pixel + pixelOffset(img2, j, i), c);
+      j += c;
+    }
+  }
+  return sum;
+}
+
+/// Normalized cross-correlation between img2 and the subimage of img1
+/// at position (x, y), in [-1.0, 1.0].
+/// If either of them has a single gray level, the result is 1.0 if both
+/// have a single level, or 0.0 otherwise.
+/// Requires: img2 must fit inside img1 at position (x, y).
+double ImageMatchNCC(Image img1, int x, int y, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (img1->depth == 8 && img2->depth == 8);
+  assert (ImageValidRect(img1, x, y, img2->width, img2->height));
+  struct corrSums c = { 0, 0, 0, 0, 0 };
+  for (int i = 0; i < img2->height; i++) {
+    for (int j = 0; j < img2->width; ) {
+      int n = commonSpan(img1, x + j, img2, j, img2->width - j);
+      corrBytes(&c, img1->pixel + pixelOffset(img1, x + j, y + i),
+                img2->pixel + pixelOffset(img2, j, i), n);
+      j += n;
+    }
+  }
+  double n = (double)img2->width * img2->height;
+  double va = n * (double)c.saa - (double)c.sa * c.sa;   // n^2 * variances
+  double vb = n * (double)c.sbb - (double)c.sb * c.sb;
+  if (va <= 0.0 || vb <= 0.0) {
+    return (va <= 0.0 && vb <= 0.0) ? 1.0 : 0.0;
   }
+  double ncc = (n * (double)c.sab - (double)c.sa * c.sb) / sqrt(va * vb);
+  return ncc > 1.0 ? 1.0 : ncc < -1.0 ? -1.0 : ncc;  // rounding
+}
 
-  // Copia os pixels originais para um buffer temporário
-  memcpy(tempPixels, img->pixel, width * height * sizeof(uint8));
+// A candidate position in coarse-to-fine search
+struct candidate {
+  double cost;  // SAD, or -NCC (lower is better)
+  int x, y;
+};
 
-  // Aplica o desfoque a cada pixel
-  for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x) {
-      double sum = 0;
-      int count = 0;
+// Insert candidate (x, y) with given cost in list c[0..(*pn)-1], sorted by
+// increasing cost, keeping at most FIND_CANDIDATES.
+// Positions already in the list are ignored.
+// Among equal costs, the earliest inserted comes first.
+static void addCandidate(struct candidate c[], int* pn, double cost, int x, int y) {
+  for (int i = 0; i < *pn; i++) {
+    if (c[i].x == x && c[i].y == y) return;
+  }
+  int i = *pn;
+  if (i == FIND_CANDIDATES) {
+    if (cost >= c[i-1].cost) return;
+    i--;  // drop the worst
+  } else {
+    (*pn)++;
+  }
+  for (; i > 0 && c[i-1].cost > cost; i--) c[i] = c[i-1];
+  c[i].cost = cost;
+  c[i].x = x;
+  c[i].y = y;
+}
 
-      // Calcula a média para os pixels à volta
-      for (int i = -dy; i <= dy; ++i) {
-        for (int j = -dx; j <= dx; ++j) {
-          int newY = y + i;
-          int newX = x + j;
+// Cost of matching img2 at position (x, y) of img1.
+static double matchCost(Image img1, int x, int y, Image img2, ImageMetric metric) {
+  if (metric == IMAGE_NCC) return -ImageMatchNCC(img1, x, y, img2);
+  return (double)ImageMatchSAD(img1, x, y, img2);
+}
 
-          // Verifica se as novas coordenadas estão dentro dos limites da imagem
-          if (newY >= 0 && newY < height && newX >= 0 && newX < width) {
-            sum += tempPixels[newY * width + newX];
-            count++;
-          }
-        }
-      }
+struct searchJob {
+  Image a, b;             // search b in a
+  ImageMetric metric;
+  struct candidate cand[MAX_THREADS][FIND_CANDIDATES];  // best, per band
+  int ncand[MAX_THREADS];
+};
 
-      // Atualiza o valor do pixel com a média
-      img->pixel[y * width + x] = (uint8)(sum / count + 0.5); // Adding 0.5 for rounding
+// Try all positions of rows [y0, y1) of a.
+static void searchBand(void* arg, int band, int y0, int y1) {
+  struct searchJob* job = (struct searchJob*)arg;
+  job->ncand[band] = 0;
+  for (int y = y0; y < y1; y++) {
+    for (int x = 0; x <= job->a->width - job->b->width; x++) {
+      addCandidate(job->cand[band], &job->ncand[band],
+                   matchCost(job->a, x, y, job->b, job->metric), x, y);
     }
   }
-
-  // Esvazia com o buffer temporário
-  free(tempPixels);
 }
+
+/// Find the position where img2 best matches a subimage of img1.
+/// The search runs coarse-to-fine on the pyramids of both images:
+/// exhaustively at the coarsest level where img2 is still at least 16x16,
+/// and then in small windows around the best candidates at each finer
+/// level.  So, it is much faster than an exhaustive search, but the
+/// global optimum is not guaranteed (though an exact occurrence of a
+/// textured img2 is normally found).
+/// Sets (*px, *py) to the position found and returns its score
+/// according to metric (see ImageMatchSAD and ImageMatchNCC).
+/// Requires: img2 must fit inside img1.
+double ImageFindSubImage(Image img1, int* px, int* py, Image img2, ImageMetric metric) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (img1->depth == 8 && img2->depth == 8);
+  assert (px != NULL && py != NULL);
+  assert (img2->width <= img1->width && img2->height <= img1->height);
+  assert (metric == IMAGE_SAD || metric == IMAGE_NCC);
+
+  // Coarsest level where img2 is at least FIND_MIN_TEMPLATE pixels wide and
+  // high.  If some level cannot be built (out of memory), start below it.
+  int top = 0;
+  while (top + 1 < PYRAMID_MAX &&
+         (img2->width >> (top + 1)) >= FIND_MIN_TEMPLATE &&
+         (img2->height >> (top + 1)) >= FIND_MIN_TEMPLATE) {
+    if (ImagePyramidLevel(img1, top + 1) == NULL ||
+        ImagePyramidLevel(img2, top + 1) == NULL) break;
+    top++;
+  }
+
+  // Exhaustive search at the top level, in parallel bands of positions.
+  // Merging the bands' lists in order keeps ties in raster order.
+  struct candidate cand[FIND_CANDIDATES];
+  int ncand = 0;
+  struct searchJob job;
+  job.a = ImagePyramidLevel(img1, top);
+  job.b = ImagePyramidLevel(img2, top);
+  job.metric = metric;
+  int rows = job.a->height - job.b->height + 1;
+  int nbands = numBands(job.a);
+  if (nbands > rows) nbands = rows;
+  parallelBands(rows, nbands, searchBand, &job);
+  for (int band = 0; band < nbands; band++) {
+    for (int c = 0; c < job.ncand[band]; c++) {
+      addCandidate(cand, &ncand, job.cand[band][c].cost, job.cand[band][c].x, job.cand[band][c].y);
+    }
+  }
+  Image a, b;
+
+  // Refinement: positions double from one level to the next
+  for (int k = top - 1; k >= 0; k--) {
+    a = ImagePyramidLevel(img1, k);
+    b = ImagePyramidLevel(img2, k);
+    struct candidate next[FIND_CANDIDATES];
+    int nnext = 0;
+    for (int c = 0; c < ncand; c++) {
+      for (int y = 2*cand[c].y - FIND_RADIUS; y <= 2*cand[c].y + FIND_RADIUS; y++) {
+        for (int x = 2*cand[c].x - FIND_RADIUS; x <= 2*cand[c].x + FIND_RADIUS; x++) {
+          if (x < 0 || y < 0 || x > a->width - b->width || y > a->height - b->height) continue;
+          addCandidate(next, &nnext, matchCost(a, x, y, b, metric), x, y);
+        }
+      }
+    }
+    memcpy(cand, next, nnext * sizeof(struct candidate));
+    ncand = nnext;
+  }
+
+  *px = cand[0].x;
+  *py = cand[0].y;
+  return (metric == IMAGE_NCC) ? -cand[0].cost : cand[0].cost;
+}
+
+
+/// Image pyramid
+
+/// The pyramid of an image is a sequence of images (levels) of decreasing
+/// resolution.  Level 0 is the image itself; level k+1 is level k reduced
+/// by averaging each 2x2 block of pixels (with rounding), so level k has
+/// (width >> k) x (height >> k) pixels.
+/// Levels are built on demand and cached in the image until it is modified.
+
+// Levels 1, 2, ... are raster images, stored in img->pyramid[], and
+// protected by img->lock.  They are destroyed by imageModified.
+
+// Store in dst[0..n-1] the rounded means of the 2x2 blocks formed by
+// pixels 2i, 2i+1 of rows p0 and p1.
+static void reduceRow(uint8* dst, const uint8* p0, const uint8* p1, int n) {
+  int i = 0;
+#if defined(__SSE2__)
+  // 16 outputs at a time: add even and odd bytes of both rows in 16-bit lanes
+  const __m128i even = _mm_set1_epi16(0x00FF);
+  const __m128i two = _mm_set1_epi16(2);
+  for (; i + 16 <= n; i += 16) {
+    __m128i s[2];
+    for (int h = 0; h < 2; h++) {
+      __m128i a = _mm_loadu_si128((const __m128i*)(p0 + 2*i + 16*h));
+      __m128i b = _mm_loadu_si128((const __m128i*)(p1 + 2*i + 16*h));
+      __m128i sa = _mm_add_epi16(_mm_and_si128(a, even), _mm_srli_epi16(a, 8));
+      __m128i sb = _mm_add_epi16(_mm_and_si128(b, even), _mm_srli_epi16(b, 8));
+      s[h] = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(sa, sb), two), 2);
+    }
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(s[0], s[1]));
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = (uint8)((p0[2*i] + p0[2*i+1] + p1[2*i] + p1[2*i+1] + 2) >> 2);
+  }
+}
+
+struct reduceJob {
+  Image dst;        // (raster) level being built
+  Image src;        // previous level
+};
+
+static void reduceBand(void* arg, int band, int y0, int y1) {
+  struct reduceJob* job = (struct reduceJob*)arg;
+  Image src = job->src;
+  int w = 2 * job->dst->width;   // source columns used
+  for (int y = y0; y < y1; y++) {
+    uint8* d = job->dst->pixel + (size_t)y * job->dst->width;
+    // Spans start at even columns (tile boundaries)
+    for (int x = 0; x < w; ) {
+      int c = spanLength(src, x);
+      if (c > w - x) c = w - x;
+      reduceRow(d + x/2, src->pixel + pixelOffset(src, x, 2*y),
+                src->pixel + pixelOffset(src, x, 2*y + 1), c/2);
+      x += c;
+    }
+  }
+}
+
+// Destroy the cached pyramid levels of img.
+static void pyramidDrop(Image img) {
+  for (int k = 1; k < img->pyramidLevels; k++) {
+    ImageDestroy(&img->pyramid[k]);
+  }
+  img->pyramidLevels = 1;
+}
+
+/// Number of (nonempty) levels of the pyramid of img.
+/// (For an empty image, returns 1.)
+int ImagePyramidDepth(Image img) { ///
+  assert (img != NULL);
+  assert (img->depth == 8);
+  int d = 1;
+  while (d < PYRAMID_MAX && (img->width >> d) > 0 && (img->height >> d) > 0) d++;
+  return d;
+}
+
+/// Get level k of the pyramid of img, building it if needed.
+/// The returned image belongs to img: it must not be modified or
+/// destroyed, and it is only valid until img is modified or destroyed.
+/// Requires: 0 <= k < ImagePyramidDepth(img).
+/// On failure (out of memory), returns NULL and errno/errCause are set.
+Image ImagePyramidLevel(Image img, int k) { ///
+  assert (img != NULL);
+  assert (0 <= k && k < ImagePyramidDepth(img));
+  if (k == 0) return img;
+  pthread_mutex_lock(&img->lock);
+  while (img->pyramidLevels <= k) {
+    int l = img->pyramidLevels;
+    struct reduceJob job;
+    job.src = (l == 1) ? img : img->pyramid[l-1];
+    job.dst = ImageCreate(job.src->width / 2, job.src->height / 2, (uint8)job.src->maxval);
+    if (job.dst == NULL) break;
+    parallelBands(job.dst->height, numBands(job.dst), reduceBand, &job);
+    PIXMEM += 5*(unsigned long)job.dst->width * job.dst->height;  // count pixel memory accesses
+    img->pyramid[l] = job.dst;
+    img->pyramidLevels = l + 1;
+  }
+  Image level = (img->pyramidLevels > k) ? img->pyramid[k] : NULL;
+  pthread_mutex_unlock(&img->lock);
+  return level;
+}
+
+
+/// Filtering
+
+/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
+/// Each pixel is substituted by the mean of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy].
+/// The image is changed in-place.
+/// Accepts 16-bit images.
+void ImageBlur(Image img, int dx, int dy) { ///
+  assert(img != NULL); // Verifica se existe imagem 
+  assert(dx >= 0 && dy >= 0);
+  if (img->depth == 16) {
+    FILTER_OPS++; // Incrementa o contador de operações de filtragem
+    if (blur16(img, dx, dy)) imageModified(img);
+    return;
+  }
+  // A mean filter is a convolution with kernels of ones, with the
+  // shrinking window semantics of IMAGE_BORDER_SHRINK.
+  int r = (dx > dy) ? dx : dy;
+  int* ones = (int*)malloc((2*(size_t)r + 1) * sizeof(int));
+  if (!ones) {
+    return; // Se falhar devolve sem fazer alterações
+  }
+  for (int i = 0; i <= 2*r; i++) ones[i] = 1;
+  ImageKernel kx = { dx, ones };
+  ImageKernel ky = { dy, ones };
+  ImageConvolveSeparable(img, kx, ky, IMAGE_BORDER_SHRINK);
+  free(ones);
+}
+
+// Separable convolution engine
+//
+// Each band of output rows is computed in two passes.  The horizontal pass
+// turns each source row into a row of exact integer sums H, which are
+// kept in a ring buffer of rows.  The vertical pass accumulates the H rows
+// of the window, weighted, into a row of sums, which are then divided,
+// rounded and saturated.  Pixels outside the image come from a mapping of
+// coordinates (clamp, reflect), or are left out (shrink).
+//
+// When H fits in 16 bits and the vertical sums in 32 bits ("fast" kernels),
+// both passes use SSE2 on 8 pixels at a time; otherwise, 32-bit H rows and
+// 64-bit sums are used.  Kernels of ones (box filters) use running sums in
+// both directions, so their cost per pixel does not depend on the radius.
+
+// Maximum sum of absolute weights for 16-bit H (255 * 128 < 2^15)
+#define CONV_FAST_X 128
+// Maximum sum of absolute weights for 32-bit vertical sums of 16-bit H
+#define CONV_FAST_Y 65535
+
+struct convJob {
+  Image img;              // source (not modified during the passes)
+  int x0, y0, w, h;       // rectangle of img that is convolved
+  struct image dst;       // destination: w x h, at (0, 0) of its pixel array
+  const int* kx;          // horizontal weights, for offsets -rx..rx
+  const int* ky;          // vertical weights, for offsets -ry..ry
+  int rx, ry;
+  ImageBorder border;
+  int fast;               // 16-bit H rows and 32-bit sums?
+  int box;                // all weights are 1?
+  const int64_t* divX;    // divisor of each column (times divY[y])
+  const int64_t* divY;    // divisor of each row
+  uint8* work;            // work memory, bandBytes for each band
+  size_t bandBytes;
+};
+
+// Map coordinate i to [0, n) according to border, or -1 if left out.
+static inline int borderIndex(int i, int n, ImageBorder border) {
+  if (0 <= i && i < n) return i;
+  switch (border) {
+  case IMAGE_BORDER_CLAMP:
+    return (i < 0) ? 0 : n - 1;
+  case IMAGE_BORDER_REFLECT:
+    i %= 2*n;
+    if (i < 0) i += 2*n;
+    return (i < n) ? i : 2*n - 1 - i;
+  default:
+    return -1;
+  }
+}
+
+// Row v (possibly outside the rectangle) of the source, extended by rx
+// pixels on each side: ext[rx + x] is pixel x.  Returns 0 if the row is
+// left out.  Pixels outside the rectangle are handled as outside the image.
+static int extendedRow(const struct convJob* job, int v, uint8* ext) {
+  int sy = borderIndex(v, job->h, job->border);
+  if (sy < 0) return 0;
+  int w = job->w, rx = job->rx;
+  getSpan(job->img, job->x0, job->y0 + sy, w, ext + rx);
+  for (int j = 1; j <= rx; j++) {
+    int l = borderIndex(-j, w, job->border);
+    int r = borderIndex(w - 1 + j, w, job->border);
+    ext[rx - j] = (l < 0) ? 0 : ext[rx + l];       // 0: no contribution
+    ext[rx + w - 1 + j] = (r < 0) ? 0 : ext[rx + r];
+  }
+  return 1;
+}
+
+// Horizontal pass on an extended row: h[x] = sum of k[j] * ext[x + j].
+static void hPass(const struct convJob* job, const uint8* ext, void* h) {
+  int w = job->w, n = 2*job->rx + 1;
+  const int* k = job->kx;
+  if (job->box) {
+    // Running sum of n pixels
+    int32_t sum = 0;
+    for (int j = 0; j < n; j++) sum += ext[j];
+    for (int x = 0; x < w; x++) {
+      if (job->fast) ((int16_t*)h)[x] = (int16_t)sum;
+      else ((int32_t*)h)[x] = sum;
+      sum += ext[x + n] - ext[x];   // ext has one spare byte at the end
+    }
+  } else if (job->fast) {
+    int16_t* h16 = (int16_t*)h;
+    int x = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 8 <= w; x += 8) {
+      __m128i acc = zero;
+      for (int j = 0; j < n; j++) {
+        __m128i p = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(ext + x + j)), zero);
+        acc = _mm_add_epi16(acc, _mm_mullo_epi16(p, _mm_set1_epi16((short)k[j])));
+      }
+      _mm_storeu_si128((__m128i*)(h16 + x), acc);
+    }
+#endif
+    for (; x < w; x++) {
+      int sum = 0;
+      for (int j = 0; j < n; j++) sum += k[j] * ext[x + j];
+      h16[x] = (int16_t)sum;
+    }
+  } else {
+    int32_t* h32 = (int32_t*)h;
+    for (int x = 0; x < w; x++) {
+      int32_t sum = 0;
+      for (int j = 0; j < n; j++) sum += k[j] * ext[x + j];
+      h32[x] = sum;
+    }
+  }
+}
+
+// Vertical pass step: acc[x] += k * h[x], for all x.
+static void vAdd(const struct convJob* job, void* acc, const void* h, int k) {
+  int w = job->w;
+  if (job->fast) {
+    int32_t* a = (int32_t*)acc;
+    const int16_t* h16 = (const int16_t*)h;
+    int x = 0;
+#if defined(__SSE2__)
+    // 16x16 -> 32-bit products, from the low and high halves
+    const __m128i kk = _mm_set1_epi16((short)k);
+    for (; x + 8 <= w; x += 8) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(h16 + x));
+      __m128i lo = _mm_mullo_epi16(v, kk);
+      __m128i hi = _mm_mulhi_epi16(v, kk);
+      __m128i a0 = _mm_loadu_si128((const __m128i*)(a + x));
+      __m128i a1 = _mm_loadu_si128((const __m128i*)(a + x + 4));
+      _mm_storeu_si128((__m128i*)(a + x), _mm_add_epi32(a0, _mm_unpacklo_epi16(lo, hi)));
+      _mm_storeu_si128((__m128i*)(a + x + 4), _mm_add_epi32(a1, _mm_unpackhi_epi16(lo, hi)));
+    }
+#endif
+    for (; x < w; x++) a[x] += k * h16[x];
+  } else {
+    int64_t* a = (int64_t*)acc;
+    const int32_t* h32 = (const int32_t*)h;
+    for (int x = 0; x < w; x++) a[x] += (int64_t)k * h32[x];
+  }
+}
+
+// Round v/d to the nearest integer (halves up) and saturate to [0, maxval].
+// Requires: d > 0.
+static inline uint8 roundSat(int64_t v, int64_t d, int maxval) {
+  if (v <= 0) return 0;   // (v < 0 rounds to <= 0; 0/d is 0)
+  int64_t q = (2*v + d) / (2*d);
+  return (uint8)((q > maxval) ? maxval : q);
+}
+
+static void convBand(void* arg, int band, int y0, int y1) {
+  struct convJob* job = (struct convJob*)arg;
+  int w = job->w, rx = job->rx, ry = job->ry;
+  int maxval = job->img->maxval;
+  size_t esize = job->fast ? sizeof(int16_t) : sizeof(int32_t);
+  size_t asize = job->fast ? sizeof(int32_t) : sizeof(int64_t);
+  int R = 2*ry + 2;   // ring rows: window + 1 (for running sums)
+
+  // Work memory: ring of H rows, sums, extended row, output row, flags
+  uint8* mem = job->work + (size_t)band * job->bandBytes;
+  uint8* ring = mem;
+  void* acc = ring + (size_t)R * w * esize;
+  uint8* ext = (uint8*)acc + (size_t)w * asize;
+  uint8* out = ext + w + 2*rx + 1;
+  uint8* valid = out + w;
+
+  // H row of virtual row v goes to ring slot slot(v)
+#define SLOT(v) ((((v) % R) + R) % R)
+#define HROW(v) (ring + (size_t)SLOT(v) * w * esize)
+  for (int v = y0 - ry; v < y0 + ry; v++) {
+    valid[SLOT(v)] = extendedRow(job, v, ext);
+    if (valid[SLOT(v)]) hPass(job, ext, HROW(v));
+  }
+  for (int y = y0; y < y1; y++) {
+    int v = y + ry;   // new row entering the window
+    valid[SLOT(v)] = extendedRow(job, v, ext);
+    if (valid[SLOT(v)]) hPass(job, ext, HROW(v));
+
+    if (job->box && y > y0) {
+      // Running sum: add the entering row, subtract the leaving one
+      if (valid[SLOT(v)]) vAdd(job, acc, HROW(v), 1);
+      if (valid[SLOT(y - ry - 1)]) vAdd(job, acc, HROW(y - ry - 1), -1);
+    } else {
+      memset(acc, 0, (size_t)w * asize);
+      for (int i = -ry; i <= ry; i++) {
+        if (valid[SLOT(y + i)]) vAdd(job, acc, HROW(y + i), job->ky[ry + i]);
+      }
+    }
+
+    int64_t dy = job->divY[y];
+    for (int x = 0; x < w; x++) {
+      int64_t sum = job->fast ? ((int32_t*)acc)[x] : ((int64_t*)acc)[x];
+      out[x] = roundSat(sum, job->divX[x] * dy, maxval);
+    }
+    putSpan((Image)&job->dst, 0, y, w, out);
+  }
+#undef HROW
+#undef SLOT
+}
+
+// Sum of the absolute values of the 2r+1 weights of k.
+static int64_t absWeight(const int* k, int r) {
+  int64_t s = 0;
+  for (int i = 0; i <= 2*r; i++) s += (k[i] < 0) ? -(int64_t)k[i] : k[i];
+  return s;
+}
+
+// Set div[i], for i in [0, n), to the divisor for the (2r+1)-weight kernel k
+// at coordinate i: the sum of the weights (of the weights used, with
+// IMAGE_BORDER_SHRINK) if positive, or 1 otherwise.
+static void divisors(int64_t* div, int n, const int* k, int r, ImageBorder border) {
+  int64_t total = 0;
+  for (int j = 0; j <= 2*r; j++) total += k[j];
+  for (int i = 0; i < n; i++) {
+    int64_t d = total;
+    if (total > 0 && border == IMAGE_BORDER_SHRINK && (i < r || i + r >= n)) {
+      d = 0;
+      for (int j = -r; j <= r; j++) {
+        if (0 <= i + j && i + j < n) d += k[r + j];
+      }
+    }
+    div[i] = (total > 0 && d > 0) ? d : 1;
+  }
+}
+
+// Convolve the rectangle (x, y, w, h) of img with kx and ky, as if it
+// were a separate image (see ImageConvolveSeparable).  The whole image is
+// computed into a new pixel array; a smaller rectangle, into a buffer
+// that is then copied into place.
+static int convolve(Image img, int x, int y, int w, int h,
+                    ImageKernel kx, ImageKernel ky, ImageBorder border) {
+  int64_t ax = absWeight(kx.weight, kx.radius);
+  int64_t ay = absWeight(ky.weight, ky.radius);
+  assert (ax < ((int64_t)1 << 23));   // so that H fits in 32 bits
+  FILTER_OPS++; // Incrementa o contador de operações de filtragem
+  if (w == 0 || h == 0) return 1;
+  int whole = w == img->width && h == img->height;
+
+  struct convJob job;
+  job.img = img;
+  job.x0 = x;
+  job.y0 = y;
+  job.w = w;
+  job.h = h;
+  job.dst = *img;   // (only layout fields and pixel are used)
+  if (!whole) {
+    job.dst.width = w;
+    job.dst.height = h;
+    layoutInit(&job.dst, IMAGE_RASTER);
+  }
+  job.kx = kx.weight;
+  job.ky = ky.weight;
+  job.rx = kx.radius;
+  job.ry = ky.radius;
+  job.border = border;
+  job.fast = ax <= CONV_FAST_X && ay <= CONV_FAST_Y;
+  job.box = 1;
+  for (int j = 0; j <= 2*kx.radius; j++) job.box &= kx.weight[j] == 1;
+  for (int i = 0; i <= 2*ky.radius; i++) job.box &= ky.weight[i] == 1;
+  size_t esize = job.fast ? sizeof(int16_t) : sizeof(int32_t);
+  size_t asize = job.fast ? sizeof(int32_t) : sizeof(int64_t);
+  size_t R = 2*(size_t)ky.radius + 2;
+  job.bandBytes = R * w * esize + (size_t)w * asize +
+                  (w + 2*(size_t)kx.radius + 1) + (size_t)w + R;
+  job.bandBytes = (job.bandBytes + 15) & ~(size_t)15;
+  int nbands = whole ? numBands(img) : bandsFor((size_t)w * h, h);
+
+  uint8* pixels = NULL;
+  int64_t* div = NULL;
+  job.work = NULL;
+  int success =
+    check( (pixels = (uint8*)malloc(job.dst.size)) != NULL, "Memory allocation failed for pixel data" ) &&
+    check( (job.work = (uint8*)malloc(nbands * job.bandBytes)) != NULL, "Memory allocation failed" ) &&
+    check( (div = (int64_t*)malloc(((size_t)w + h) * sizeof(int64_t))) != NULL, "Memory allocation failed" );
+  if (success) {
+    if (job.dst.size > (size_t)w * h) memset(pixels, 0, job.dst.size);  // tile padding
+    job.dst.pixel = pixels;
+    divisors(div, w, kx.weight, kx.radius, border);
+    divisors(div + w, h, ky.weight, ky.radius, border);
+    job.divX = div;
+    job.divY = div + w;
+    parallelBands(h, nbands, convBand, &job);
+    PIXMEM += 2*(unsigned long)w * h;  // count pixel memory accesses
+    if (whole) {
+      freePixels(img);
+      img->pixel = pixels;
+    } else {
+      for (int i = 0; i < h; i++) putSpan(img, x, y + i, w, pixels + (size_t)i * w);
+      free(pixels);
+    }
+    imageModifiedRect(img, x, y, w, h);
+  } else {
+    MEM_ALLOC_FAILURES++;
+    free(pixels);
+  }
+  free(job.work);
+  free(div);
+  return success;
+}
+
+/// Convolve an image with a separable kernel.
+/// Each pixel (x,y) is substituted by the sum of
+///   kx.weight[rx+j] * ky.weight[ry+i] * pixel(x+j, y+i)
+/// for j in [-rx, rx], i in [-ry, ry] (rx = kx.radius, ry = ky.radius),
+/// divided by the product of the sums of the weights of kx and ky
+/// (a sum that is not positive counts as 1), rounded to the nearest
+/// integer and saturated to [0, maxval].
+/// Pixels outside the image are handled according to border.
+/// With IMAGE_BORDER_SHRINK, they are left out, and so are their weights
+/// from the divisor: kernels of ones give the same result as ImageBlur.
+/// Kernels whose absolute weights add up to at most 128 (kx) and
+/// 65535 (ky) are applied with 16-bit fixed-point SIMD arithmetic.
+/// The image is changed in-place.
+/// Requires: radii >= 0; absolute weights of kx add up to less than 2^23.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// accordingly, and the image is left unchanged.
+int ImageConvolveSeparable(Image img, ImageKernel kx, ImageKernel ky, ImageBorder border) { ///
+  assert (img != NULL);
+  assert (img->depth == 8);
+  assert (kx.radius >= 0 && kx.weight != NULL);
+  assert (ky.radius >= 0 && ky.weight != NULL);
+  assert (border == IMAGE_BORDER_SHRINK || border == IMAGE_BORDER_CLAMP ||
+          border == IMAGE_BORDER_REFLECT);
+  return convolve(img, 0, 0, img->width, img->height, kx, ky, border);
+}
+
+/// Blur the rectangle at (x,y) with size (w,h) with a (2dx+1)x(2dy+1)
+/// mean filter, in place.
+/// Like ImageBlur on a crop of img pasted back: pixels outside the
+/// rectangle are left out of the means, and are not changed.
+/// Only a buffer of the size of the rectangle is used.
+/// Requires: the rectangle must be inside img; an 8-bit image.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// accordingly, and the image is left unchanged.
+int ImageBlurRect(Image img, int x, int y, int w, int h, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (img->depth == 8);
+  assert (ImageValidRect(img, x, y, w, h));
+  assert (dx >= 0 && dy >= 0);
+  int r = (dx > dy) ? dx : dy;
+  int* ones = NULL;
+  if (!check( (ones = (int*)malloc((2*(size_t)r + 1) * sizeof(int))) != NULL, "Memory allocation failed" )) {
+    MEM_ALLOC_FAILURES++;
+    return 0;
+  }
+  for (int i = 0; i <= 2*r; i++) ones[i] = 1;
+  ImageKernel kx = { dx, ones };
+  ImageKernel ky = { dy, ones };
+  int success = convolve(img, x, y, w, h, kx, ky, IMAGE_BORDER_SHRINK);
+  free(ones);
+  return success;
+}
+
+/// Cached blur
+
+/// An image may keep a blurred copy of itself (see ImageBlurCached).
+/// Functions that modify only a rectangle of the image (ImageSetPixel,
+/// ImagePaste, ImageBlend, ImageBlurRect and the point operations on a
+/// rectangle) record it as dirty, and only the pixels of the copy within
+/// the filter size of the dirty rectangles are blurred again.  Other
+/// modifications make the whole image dirty.
+
+// The copy is img->blurred, protected by img->lock.  The dirty
+// rectangles (img->dirty) are recorded by imageModifiedRect, only while
+// there is a copy; when there are more than DIRTY_MAX, they are merged.
+
+// Expand r by (dx, dy) on each side, within a w x h image.
+static struct dirtyRect rectExpand(struct dirtyRect r, int dx, int dy, int w, int h) {
+  r.x0 = (dx < r.x0) ? r.x0 - dx : 0;
+  r.y0 = (dy < r.y0) ? r.y0 - dy : 0;
+  r.x1 = (dx < w - r.x1) ? r.x1 + dx : w;
+  r.y1 = (dy < h - r.y1) ? r.y1 + dy : h;
+  return r;
+}
+
+// Number of pixels that blurUpdate would blur for all dirty rectangles.
+static uint64_t blurUpdateCost(Image img) {
+  uint64_t cost = 0;
+  for (int i = 0; i < img->dirtyCount; i++) {
+    struct dirtyRect e = rectExpand(img->dirty[i], img->blurDx, img->blurDy, img->width, img->height);
+    struct dirtyRect s = rectExpand(e, img->blurDx, img->blurDy, img->width, img->height);
+    cost += (uint64_t)rectArea(&s);
+  }
+  return cost;
+}
+
+// Blur img into a new img->blurred.  Returns 0 on failure.
+static int blurAll(Image img, int dx, int dy) {
+  Image b = ImageCrop(img, 0, 0, img->width, img->height);
+  if (b == NULL) return 0;
+  if (!ImageBlurRect(b, 0, 0, b->width, b->height, dx, dy)) {
+    ImageDestroy(&b);
+    return 0;
+  }
+  ImageDestroy(&img->blurred);
+  img->blurred = b;
+  img->blurDx = dx;
+  img->blurDy = dy;
+  img->dirtyAll = 0;
+  img->dirtyCount = 0;
+  return 1;
+}
+
+// Blur again the pixels of img->blurred whose means include pixels of
+// img in rectangle r.  Returns 0 on failure.
+static int blurUpdate(Image img, struct dirtyRect r) {
+  // Pixels in e are blurred again, from the pixels in s: the mean of a
+  // pixel in e only includes pixels in s, and pixels of the image beyond
+  // the borders of s are beyond the borders of the image.
+  struct dirtyRect e = rectExpand(r, img->blurDx, img->blurDy, img->width, img->height);
+  struct dirtyRect s = rectExpand(e, img->blurDx, img->blurDy, img->width, img->height);
+  Image tmp = ImageCrop(img, s.x0, s.y0, s.x1 - s.x0, s.y1 - s.y0);
+  if (tmp == NULL) return 0;
+  int success = ImageBlurRect(tmp, 0, 0, tmp->width, tmp->height, img->blurDx, img->blurDy);
+  if (success) {
+    for (int y = e.y0; y < e.y1; y++) {
+      copySpan(img->blurred, e.x0, y, tmp, e.x0 - s.x0, y - s.y0, e.x1 - e.x0);
+    }
+    PIXMEM += 2*(unsigned long)(e.x1 - e.x0) * (e.y1 - e.y0);  // count pixel memory accesses
+    imageModifiedRect(img->blurred, e.x0, e.y0, e.x1 - e.x0, e.y1 - e.y0);
+  }
+  ImageDestroy(&tmp);
+  return success;
+}
+
+/// Get img blurred by a (2dx+1)x(2dy+1) mean filter, as by ImageBlur.
+/// The blurred image is cached in img and kept up to date: after
+/// modifications of small rectangles of img, only the pixels near them
+/// are blurred again.
+/// The returned image belongs to img: it must not be modified or
+/// destroyed, and it is only valid until img is modified or destroyed,
+/// or ImageBlurCached is called on img with another dx or dy.
+/// Requires: an 8-bit image; dx, dy >= 0.
+/// On failure (out of memory), returns NULL and errno/errCause are set.
+Image ImageBlurCached(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (img->depth == 8);
+  assert (dx >= 0 && dy >= 0);
+  pthread_mutex_lock(&img->lock);
+  int success = 1;
+  if (img->blurred == NULL || img->dirtyAll || dx != img->blurDx || dy != img->blurDy ||
+      blurUpdateCost(img) >= (uint64_t)img->width * img->height / 2) {
+    // (blurring the whole image is parallel, and has no overlaps)
+    success = blurAll(img, dx, dy);
+  } else {
+    while (success && img->dirtyCount > 0) {
+      success = blurUpdate(img, img->dirty[img->dirtyCount - 1]);
+      if (success) img->dirtyCount--;
+    }
+  }
+  Image b = success ? img->blurred : NULL;
+  pthread_mutex_unlock(&img->lock);
+  return b;
+}
+
+/// Blur an image with an approximate Gaussian filter.
+/// The filter is three successive mean filters (box passes), sized so
+/// that their combination has standard deviation close to sigma.
+/// The cost per pixel does not depend on sigma.
+/// The image is changed in-place.
+/// Requires: sigma >= 0.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// accordingly, and the image may be partially filtered.
+int ImageGaussianBlur(Image img, double sigma, ImageBorder border) { ///
+  assert (img != NULL);
+  assert (sigma >= 0.0);
+  // Box widths wl and wl+2 (odd), m passes of the first, 3-m of the second,
+  // such that the sum of the box variances (w^2-1)/12 is close to sigma^2.
+  const int n = 3;
+  int wl = (int)sqrt(12.0*sigma*sigma/n + 1.0);
+  if (wl % 2 == 0) wl--;
+  int m = (int)floor((12.0*sigma*sigma - n*wl*wl - 4.0*n*wl - 3.0*n) / (-4.0*wl - 4.0) + 0.5);
+
+  int rmax = (wl + 1) / 2;   // radius of the larger box
+  int* ones = NULL;
+  if (!check( (ones = (int*)malloc((2*(size_t)rmax + 1) * sizeof(int))) != NULL, "Memory allocation failed" )) {
+    MEM_ALLOC_FAILURES++;
+    return 0;
+  }
+  for (int i = 0; i <= 2*rmax; i++) ones[i] = 1;
+  int success = 1;
+  for (int pass = 0; pass < n && success; pass++) {
+    int r = (pass < m) ? (wl - 1) / 2 : (wl + 1) / 2;
+    if (r == 0) continue;   // identity
+    ImageKernel k = { r, ones };
+    success = ImageConvolveSeparable(img, k, k, border);
+  }
+  free(ones);
+  return success;
+}
+// Constant-time median filter
+//
+// Each band keeps one histogram per column, of the pixels of that column
+// in the rows of the window, and a histogram of the whole window (the
+// kernel histogram).  Moving one row down updates each column histogram
+// with two pixels; moving one pixel right adds one column histogram to
+// the kernel histogram and subtracts another.  So the cost per pixel
+// does not depend on the window size.
+// Histograms are split in 16 coarse bins (high nibble) and 256 fine bins.
+// The coarse kernel histogram is always kept up to date; each 16-bin
+// segment of the fine one is only brought up to date when the median
+// falls in its coarse bin, which is where most of the work would go.
+
+#define MEDIAN_COARSE 16
+
+struct medianJob {
+  Image img;              // source (not modified during the passes)
+  struct image dst;       // destination: img with another pixel array
+  int dx, dy;
+  uint8* work;            // work memory, bandBytes for each band
+  size_t bandBytes;
+};
+
+// Add (sign = 1) or subtract (sign = -1) the pixels of row buffer p
+// to the column histograms.
+static void medianRow(uint16_t* coarse, uint16_t* fine, const uint8* p, int w, int sign) {
+  for (int x = 0; x < w; x++) {
+    coarse[(size_t)x*MEDIAN_COARSE + (p[x] >> 4)] += sign;
+    fine[(size_t)x*256 + p[x]] += sign;
+  }
+}
+
+static void medianBand(void* arg, int band, int y0, int y1) {
+  struct medianJob* job = (struct medianJob*)arg;
+  Image img = job->img;
+  int w = img->width, h = img->height, dx = job->dx, dy = job->dy;
+
+  // Work memory: column histograms, row and output buffers
+  uint8* mem = job->work + (size_t)band * job->bandBytes;
+  uint16_t* coarse = (uint16_t*)mem;
+  uint16_t* fine = coarse + (size_t)w * MEDIAN_COARSE;
+  uint8* row = (uint8*)(fine + (size_t)w * 256);
+  uint8* out = row + w;
+
+  // Column histograms for the window of row y0
+  memset(mem, 0, (size_t)w * (MEDIAN_COARSE + 256) * sizeof(uint16_t));
+  int top = (y0 - dy < 0) ? 0 : y0 - dy;
+  int bottom = (y0 + dy >= h) ? h - 1 : y0 + dy;
+  for (int v = top; v <= bottom; v++) {
+    getSpan(img, 0, v, w, row);
+    medianRow(coarse, fine, row, w, 1);
+  }
+
+  uint32_t kc[MEDIAN_COARSE];   // kernel histogram, coarse
+  uint32_t kf[256];         // kernel histogram, fine (by segments)
+  int last[MEDIAN_COARSE];      // column of the window of each kf segment
+  for (int y = y0; y < y1; y++) {
+    if (y > y0) {
+      if (y + dy < h) {
+        getSpan(img, 0, y + dy, w, row);
+        medianRow(coarse, fine, row, w, 1);
+      }
+      if (y - dy - 1 >= 0) {
+        getSpan(img, 0, y - dy - 1, w, row);
+        medianRow(coarse, fine, row, w, -1);
+      }
+    }
+    int rows = ((y + dy >= h) ? h - 1 : y + dy) - ((y - dy < 0) ? 0 : y - dy) + 1;
+
+    memset(kc, 0, sizeof(kc));
+    for (int c = 0; c < MEDIAN_COARSE; c++) last[c] = INT_MIN;
+    for (int u = 0; u <= dx && u < w; u++) {
+      for (int c = 0; c < MEDIAN_COARSE; c++) kc[c] += coarse[u*MEDIAN_COARSE + c];
+    }
+    for (int x = 0; x < w; x++) {
+      if (x > 0) {
+        int in = x + dx, gone = x - dx - 1;
+        if (in < w) {
+          for (int c = 0; c < MEDIAN_COARSE; c++) kc[c] += coarse[in*MEDIAN_COARSE + c];
+        }
+        if (gone >= 0) {
+          for (int c = 0; c < MEDIAN_COARSE; c++) kc[c] -= coarse[gone*MEDIAN_COARSE + c];
+        }
+      }
+      int left = (x - dx < 0) ? 0 : x - dx;
+      int right = (x + dx >= w) ? w - 1 : x + dx;
+      // Rank of the median (the lower one, for an even number of pixels)
+      uint32_t rank = ((uint32_t)(right - left + 1) * rows - 1) / 2;
+
+      int c = 0;
+      while (kc[c] <= rank) rank -= kc[c++];
+
+      // Bring segment c of kf up to date: from scratch, or by moving
+      // its window from column last[c] to column x
+      uint32_t* seg = kf + c*MEDIAN_COARSE;
+      if (last[c] == INT_MIN || x - last[c] > 2*dx) {
+        memset(seg, 0, MEDIAN_COARSE * sizeof(uint32_t));
+        for (int u = left; u <= right; u++) {
+          const uint16_t* f = fine + (size_t)u*256 + c*MEDIAN_COARSE;
+          for (int i = 0; i < MEDIAN_COARSE; i++) seg[i] += f[i];
+        }
+      } else {
+        for (int p = last[c] + 1; p <= x; p++) {
+          if (p + dx < w) {
+            const uint16_t* f = fine + (size_t)(p + dx)*256 + c*MEDIAN_COARSE;
+            for (int i = 0; i < MEDIAN_COARSE; i++) seg[i] += f[i];
+          }
+          if (p - dx - 1 >= 0) {
+            const uint16_t* f = fine + (size_t)(p - dx - 1)*256 + c*MEDIAN_COARSE;
+            for (int i = 0; i < MEDIAN_COARSE; i++) seg[i] -= f[i];
+          }
+        }
+      }
+      last[c] = x;
+
+      int i = 0;
+      while (seg[i] <= rank) rank -= seg[i++];
+      out[x] = (uint8)(c*MEDIAN_COARSE + i);
+    }
+    putSpan((Image)&job->dst, 0, y, w, out);
+  }
+}
+
+/// Apply a median filter to an image.
+/// Each pixel is substituted by the median of the pixels in a
+/// (2dx+1)x(2dy+1) rectangle centered on it, clipped to the image, as
+/// in ImageBlur.  When the rectangle has an even number of pixels, the
+/// lower of the two middle values is used.
+/// The cost per pixel does not depend on dx and dy.
+/// The image is changed in-place.
+/// Requires: dx, dy >= 0; dy < 32768.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// accordingly, and the image is left unchanged.
+int ImageMedian(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (img->depth == 8);
+  assert (dx >= 0 && dy >= 0);
+  assert (dy < 32768);   // column counts fit in 16 bits
+  FILTER_OPS++; // Incrementa o contador de operações de filtragem
+  int w = img->width, h = img->height;
+  if (w == 0 || h == 0 || (dx == 0 && dy == 0)) return 1;
+
+  struct medianJob job;
+  job.img = img;
+  job.dst = *img;   // (only layout fields and pixel are used)
+  job.dx = dx;
+  job.dy = dy;
+  job.bandBytes = (size_t)w * (MEDIAN_COARSE + 256) * sizeof(uint16_t) + 2*(size_t)w;
+  job.bandBytes = (job.bandBytes + 15) & ~(size_t)15;
+  int nbands = numBands(img);
+
+  uint8* pixels = NULL;
+  job.work = NULL;
+  int success =
+    check( (pixels = (uint8*)malloc(img->size)) != NULL, "Memory allocation failed for pixel data" ) &&
+    check( (job.work = (uint8*)malloc(nbands * job.bandBytes)) != NULL, "Memory allocation failed" );
+  if (success) {
+    if (img->size > (size_t)w * h) memset(pixels, 0, img->size);  // tile padding
+    job.dst.pixel = pixels;
+    parallelBands(h, nbands, medianBand, &job);
+    PIXMEM += 4*(unsigned long)w * h;  // count pixel memory accesses
+    freePixels(img);
+    img->pixel = pixels;
+    imageModified(img);
+  } else {
+    MEM_ALLOC_FAILURES++;
+    free(pixels);
+  }
+  free(job.work);
+  return success;
+}
+
+// Morphology: erosion and dilation with rectangles
+//
+// A (2dx+1)x(2dy+1) minimum (or maximum) filter is separable: first along
+// rows, then along columns.  Each pass uses the van Herk/Gil-Werman
+// algorithm: the line, padded with r identity values on each side, is cut
+// in blocks of k = 2r+1; g holds running minima from the start of each
+// block, h from its end, and the minimum of the window starting at
+// padded position i is min(h[i], g[i+k-1]).  This takes about 3
+// comparisons per pixel, whatever the value of k.
+// The column pass works on row segments at a time, with SIMD min/max,
+// in bands of columns: bands of rows would each go through up to 2r
+// padding rows, so their cost would grow with r.
+
+struct morphJob {
+  Image img;              // source (not modified during the passes)
+  struct image dst;       // destination: img with another pixel array
+  int rx, ry;             // radii, clipped to the image size
+  int dilate;             // max (dilation) rather than min (erosion)?
+  uint8* rows;            // row pass result, w x h (raster)
+  uint8* work;            // work memory, bandBytes for each band
+  size_t bandBytes;
+};
+
+static inline uint8 morphOp(uint8 a, uint8 b, int dilate) {
+  return dilate ? ((a > b) ? a : b) : ((a < b) ? a : b);
+}
+
+// dst[i] = min (or max) of a[i] and b[i], for i in [0, n).
+static void morphRows(uint8* dst, const uint8* a, const uint8* b, int n, int dilate) {
+  int i = 0;
+#if defined(__SSE2__)
+  if (dilate) {
+    for (; i + 16 <= n; i += 16) {
+      __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+      _mm_storeu_si128((__m128i*)(dst + i), _mm_max_epu8(va, vb));
+    }
+  } else {
+    for (; i + 16 <= n; i += 16) {
+      __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+      _mm_storeu_si128((__m128i*)(dst + i), _mm_min_epu8(va, vb));
+    }
+  }
+#endif
+  for (; i < n; i++) dst[i] = morphOp(a[i], b[i], dilate);
+}
+
+// Row pass: rows [y0, y1) of the source, filtered along x, into job->rows.
+static void morphRowBand(void* arg, int band, int y0, int y1) {
+  struct morphJob* job = (struct morphJob*)arg;
+  int w = job->img->width, r = job->rx, k = 2*r + 1, n = w + 2*r;
+  int dilate = job->dilate;
+  uint8 ident = dilate ? 0 : PixMax;
+  uint8* ext = job->work + (size_t)band * job->bandBytes;  // padded line
+  uint8* g = ext + n;
+  uint8* h = g + n;
+  memset(ext, ident, r);
+  memset(ext + r + w, ident, r);
+  for (int y = y0; y < y1; y++) {
+    uint8* out = job->rows + (size_t)y * w;
+    getSpan(job->img, 0, y, w, ext + r);
+    if (r == 0) {
+      memcpy(out, ext, w);
+      continue;
+    }
+    for (int b = 0; b < n; b += k) {
+      int e = (b + k < n) ? b + k : n;   // block [b, e)
+      g[b] = ext[b];
+      for (int i = b + 1; i < e; i++) g[i] = morphOp(g[i-1], ext[i], dilate);
+      h[e-1] = ext[e-1];
+      for (int i = e - 2; i >= b; i--) h[i] = morphOp(h[i+1], ext[i], dilate);
+    }
+    for (int x = 0; x < w; x++) out[x] = morphOp(h[x], g[x + k - 1], dilate);
+  }
+}
+
+// Column pass: columns [x0, x1) of the destination, from job->rows.
+static void morphColumnBand(void* arg, int band, int x0, int x1) {
+  struct morphJob* job = (struct morphJob*)arg;
+  int w = x1 - x0, height = job->img->height;
+  int r = job->ry, k = 2*r + 1;
+  int dilate = job->dilate;
+  // Work memory: identity row, block of h rows, block of g rows
+  // (rows of w pixels: the columns of the band)
+  uint8* ident = job->work + (size_t)band * job->bandBytes;
+  uint8* H = ident + w;
+  uint8* G = H + (size_t)k * w;
+  memset(ident, dilate ? 0 : PixMax, w);
+  // Padded row i is source row i - r
+#define PROW(i) (((i) - r < 0 || (i) - r >= height) ? ident : \
+                 job->rows + (size_t)((i) - r) * job->img->width + x0)
+  int nb = height;
+  for (int b = 0; b < nb; b += k) {
+    // h of block [b, b+k), g of the next block (first k-1 rows)
+    memcpy(H + (size_t)(k-1) * w, PROW(b + k - 1), w);
+    for (int i = k - 2; i >= 0; i--) {
+      morphRows(H + (size_t)i * w, PROW(b + i), H + (size_t)(i+1) * w, w, dilate);
+    }
+    int m = (nb - b < k) ? nb - b : k;   // output rows in this block
+    if (m > 1) memcpy(G, PROW(b + k), w);
+    for (int i = 1; i < m - 1; i++) {
+      morphRows(G + (size_t)i * w, G + (size_t)(i-1) * w, PROW(b + k + i), w, dilate);
+    }
+    putSpan((Image)&job->dst, x0, b, w, H);
+    for (int i = 1; i < m; i++) {
+      uint8* out = H + (size_t)i * w;   // (H row i is not needed again)
+      morphRows(out, out, G + (size_t)(i-1) * w, w, dilate);
+      putSpan((Image)&job->dst, x0, b + i, w, out);
+    }
+  }
+#undef PROW
+}
+
+// Erode (or dilate) img with a (2dx+1)x(2dy+1) rectangle.
+static int morph(Image img, int dx, int dy, int dilate) {
+  assert (img != NULL);
+  assert (img->depth == 8);
+  assert (dx >= 0 && dy >= 0);
+  FILTER_OPS++; // Incrementa o contador de operações de filtragem
+  int w = img->width, h = img->height;
+  if (w == 0 || h == 0) return 1;
+
+  struct morphJob job;
+  job.img = img;
+  job.dst = *img;   // (only layout fields and pixel are used)
+  job.rx = (dx < w) ? dx : w - 1;   // larger windows give the same result
+  job.ry = (dy < h) ? dy : h - 1;
+  job.dilate = dilate;
+  int nbands = numBands(img);                     // bands of rows
+  int cbands = bandsFor((size_t)w * h, w);         // bands of columns
+  int nwork = (nbands > cbands) ? nbands : cbands;
+  size_t bw = ((size_t)w + cbands - 1) / cbands;   // widest band of columns
+  size_t rowBytes = 3 * ((size_t)w + 2*(size_t)job.rx);
+  size_t colBytes = (2 * (size_t)job.ry + 1) * 2 * bw + bw;
+  job.bandBytes = (rowBytes > colBytes) ? rowBytes : colBytes;
+  job.bandBytes = (job.bandBytes + 15) & ~(size_t)15;
+
+  uint8* pixels = NULL;
+  job.rows = NULL;
+  job.work = NULL;
+  int success =
+    check( (pixels = (uint8*)malloc(img->size)) != NULL, "Memory allocation failed for pixel data" ) &&
+    check( (job.rows = (uint8*)malloc((size_t)w * h)) != NULL, "Memory allocation failed" ) &&
+    check( (job.work = (uint8*)malloc(nwork * job.bandBytes)) != NULL, "Memory allocation failed" );
+  if (success) {
+    if (img->size > (size_t)w * h) memset(pixels, 0, img->size);  // tile padding
+    job.dst.pixel = pixels;
+    parallelBands(h, nbands, morphRowBand, &job);
+    parallelBands(w, cbands, morphColumnBand, &job);
+    PIXMEM += 4*(unsigned long)w * h;  // count pixel memory accesses
+    freePixels(img);
+    img->pixel = pixels;
+    imageModified(img);
+  } else {
+    MEM_ALLOC_FAILURES++;
+    free(pixels);
+  }
+  free(job.rows);
+  free(job.work);
+  return success;
+}
+
+/// Erode an image with a rectangular structuring element.
+/// Each pixel is substituted by the minimum of the pixels in a
+/// (2dx+1)x(2dy+1) rectangle centered on it, clipped to the image.
+/// The cost per pixel does not depend on dx and dy.
+/// The image is changed in-place.
+/// Requires: dx, dy >= 0.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// accordingly, and the image is left unchanged.
+int ImageErode(Image img, int dx, int dy) { ///
+  return morph(img, dx, dy, 0);
+}
+
+/// Dilate an image with a rectangular structuring element.
+/// Like ImageErode, with the maximum instead of the minimum.
+int ImageDilate(Image img, int dx, int dy) { ///
+  return morph(img, dx, dy, 1);
+}
+
+/// Open an image with a rectangular structuring element:
+/// erode, then dilate, with the same rectangle (see ImageErode).
+/// Removes bright details smaller than the rectangle.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// accordingly, and the image may be eroded only.
+int ImageOpen(Image img, int dx, int dy) { ///
+  return morph(img, dx, dy, 0) && morph(img, dx, dy, 1);
+}
+
+/// Close an image with a rectangular structuring element:
+/// dilate, then erode, with the same rectangle (see ImageErode).
+/// Removes dark details smaller than the rectangle.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// accordingly, and the image may be dilated only.
+int ImageClose(Image img, int dx, int dy) { ///
+  return morph(img, dx, dy, 1) && morph(img, dx, dy, 0);
+}
+
+/// Binary images
+
+// A BitImage packs 64 pixels in each 64-bit word, so that logical
+// operations, counts and comparisons handle 64 pixels at a time.
+// Each row starts on a new word.  Pixel x of a row is bit x%64 of word
+// x/64 (the least significant bit is the leftmost pixel), and is 1 for
+// white (level >= threshold, see BitImageFromImage) and 0 for black.
+// The bits after the last pixel of each row are always 0.
+// PBM files store the opposite (1 is black, most significant bit first),
+// and are converted a byte at a time.
+
+struct bitImage {
+  int width, height;
+  size_t words;         // number of words per row
+  uint64_t* bits;       // height rows of words
+};
+
+// Pointer to the first word of row y of b.
+static inline uint64_t* bitRow(BitImage b, int y) {
+  return b->bits + (size_t)y * b->words;
+}
+
+// Mask of the bits of pixels in the last word of each row of b.
+static inline uint64_t lastMask(BitImage b) {
+  int r = b->width % 64;
+  return r == 0 ? ~(uint64_t)0 : ((uint64_t)1 << r) - 1;
+}
+
+// The 64 bits of row w (n words) starting at bit off, which may be
+// negative or past the end: missing bits are taken from fill.
+static inline uint64_t bitsAt(const uint64_t* w, long n, long off, uint64_t fill) {
+  long i = (off >= 0) ? off / 64 : -((63 - off) / 64);
+  int s = (int)(off - 64 * i);
+  uint64_t lo = (i >= 0 && i < n) ? w[i] : fill;
+  if (s == 0) return lo;
+  uint64_t hi = (i + 1 >= 0 && i + 1 < n) ? w[i + 1] : fill;
+  return (lo >> s) | (hi << (64 - s));
+}
+
+/// Create a new binary image, with all pixels black (0).
+///   width, height : the dimensions of the new image.
+/// Requires: width and height must be non-negative.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageCreate(int width, int height) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  BitImage b = NULL;
+  size_t words = ((size_t)width + 63) / 64;
+  if (!check( (b = (BitImage)malloc(sizeof(*b))) != NULL &&
+              (b->bits = (uint64_t*)calloc(words * height + 1, sizeof(uint64_t))) != NULL,
+              "Memory allocation failed" )) {
+    MEM_ALLOC_FAILURES++;
+    free(b);
+    return NULL;
+  }
+  b->width = width;
+  b->height = height;
+  b->words = words;
+  IMG_CREATE_DESTROY++;
+  return b;
+}
+
+/// Destroy the binary image pointed to by (*bp).
+///   bp : address of a BitImage variable.
+/// If (*bp)==NULL, no operation is performed.
+/// Ensures: (*bp)==NULL.
+/// Should never fail, and should preserve global errno/errCause.
+void BitImageDestroy(BitImage* bp) { ///
+  assert (bp != NULL);
+  if (*bp != NULL) {
+    free((*bp)->bits);
+    free(*bp);
+    *bp = NULL;
+  }
+  IMG_CREATE_DESTROY++;
+}
+
+/// Get binary image width
+int BitImageWidth(BitImage b) { ///
+  assert (b != NULL);
+  return b->width;
+}
+
+/// Get binary image height
+int BitImageHeight(BitImage b) { ///
+  assert (b != NULL);
+  return b->height;
+}
+
+/// Get the pixel (1 or 0) at position (x,y).
+int BitImageGetPixel(BitImage b, int x, int y) { ///
+  assert (b != NULL);
+  assert (0 <= x && x < b->width && 0 <= y && y < b->height);
+  return (int)(bitRow(b, y)[x / 64] >> (x % 64)) & 1;
+}
+
+/// Set the pixel at position (x,y) to bit (nonzero is 1).
+void BitImageSetPixel(BitImage b, int x, int y, int bit) { ///
+  assert (b != NULL);
+  assert (0 <= x && x < b->width && 0 <= y && y < b->height);
+  uint64_t m = (uint64_t)1 << (x % 64);
+  uint64_t* w = bitRow(b, y) + x / 64;
+  *w = bit ? (*w | m) : (*w & ~m);
+}
+
+struct bitJob {
+  Image img;
+  BitImage b;
+  uint8 level;          // threshold or maxval
+  uint8* rows;          // a row buffer per band, width + 64 bytes each
+};
+
+// Bits of the 64 pixels at p: 1 where p[i] >= thr.
+static inline uint64_t packWord(const uint8* p, uint8 thr) {
+  uint64_t w = 0;
+#if defined(__SSE2__)
+  __m128i t = _mm_set1_epi8((char)thr);
+  for (int k = 0; k < 4; k++) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p + 16*k));
+    uint64_t m = (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, t), v));
+    w |= m << (16*k);
+  }
+#else
+  for (int i = 0; i < 64; i++) w |= (uint64_t)(p[i] >= thr) << i;
+#endif
+  return w;
+}
+
+// Store the 64 pixels of bits w at p: maxval for 1, 0 for 0.
+static inline void unpackWord(uint8* p, uint64_t w, uint8 maxval) {
+#if defined(__SSE2__)
+  const __m128i sel = _mm_set1_epi64x((long long)0x8040201008040201ULL);
+  const __m128i mv = _mm_set1_epi8((char)maxval);
+  for (int k = 0; k < 4; k++, w >>= 16) {
+    // Byte i of each half repeats one byte of bits; keep bit i of it
+    __m128i v = _mm_set_epi64x((long long)(((w >> 8) & 0xFF) * 0x0101010101010101ULL),
+                               (long long)((w & 0xFF) * 0x0101010101010101ULL));
+    v = _mm_cmpeq_epi8(_mm_and_si128(v, sel), sel);
+    _mm_storeu_si128((__m128i*)(p + 16*k), _mm_and_si128(v, mv));
+  }
+#else
+  for (int i = 0; i < 64; i++) p[i] = ((w >> i) & 1) ? maxval : 0;
+#endif
+}
+
+static void toBitsBand(void* arg, int band, int y0, int y1) {
+  struct bitJob* job = (struct bitJob*)arg;
+  int w = job->img->width;
+  uint8* row = job->rows + (size_t)band * (w + 64);
+  memset(row + w, 0, 64);
+  for (int y = y0; y < y1; y++) {
+    getSpan(job->img, 0, y, w, row);
+    uint64_t* bits = bitRow(job->b, y);
+    for (size_t i = 0; i < job->b->words; i++) bits[i] = packWord(row + 64*i, job->level);
+    if (job->b->words > 0) bits[job->b->words - 1] &= lastMask(job->b);
+  }
+}
+
+static void fromBitsBand(void* arg, int band, int y0, int y1) {
+  struct bitJob* job = (struct bitJob*)arg;
+  int w = job->img->width;
+  uint8* row = job->rows + (size_t)band * (w + 64);
+  for (int y = y0; y < y1; y++) {
+    const uint64_t* bits = bitRow(job->b, y);
+    for (size_t i = 0; i < job->b->words; i++) unpackWord(row + 64*i, bits[i], job->level);
+    putSpan(job->img, 0, y, w, row);
+  }
+}
+
+// Run func on the rows of job->img, with a row buffer per band.
+static int bitBands(struct bitJob* job, BandFunc func) {
+  int nb = numBands(job->img);
+  if (!check( (job->rows = (uint8*)malloc((size_t)nb * (job->img->width + 64))) != NULL,
+              "Memory allocation failed" )) {
+    MEM_ALLOC_FAILURES++;
+    return 0;
+  }
+  parallelBands(job->img->height, nb, func, job);
+  free(job->rows);
+  PIXMEM += (unsigned long)job->img->width * job->img->height;  // count pixel memory accesses
+  return 1;
+}
+
+/// Convert image to a binary image, as ImageThreshold does:
+/// pixels with level<thr become 0 (black), and those with level>=thr
+/// become 1 (white).  img is not changed.
+/// Requires an 8-bit image.
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageFromImage(Image img, uint8 thr) { ///
+  assert (img != NULL);
+  assert (img->depth == 8);
+  struct bitJob job = { .img = img, .level = thr };
+  if ((job.b = BitImageCreate(img->width, img->height)) == NULL) return NULL;
+  if (!bitBands(&job, toBitsBand)) BitImageDestroy(&job.b);
+  return job.b;
+}
+
+/// Convert a binary image to a (raster) image with the given maxval:
+/// 0 becomes black (0) and 1 becomes white (maxval).
+/// Requires: 0 < maxval <= PixMax.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image BitImageToImage(BitImage b, uint8 maxval) { ///
+  assert (b != NULL);
+  assert (0 < maxval);
+  struct bitJob job = { .b = b, .level = maxval };
+  if ((job.img = ImageCreate(b->width, b->height, maxval)) == NULL) return NULL;
+  if (!bitBands(&job, fromBitsBand)) ImageDestroy(&job.img);
+  return job.img;
+}
+
+/// Logical operations on binary images.
+/// Each pixel of dst is replaced by the AND, OR or XOR of itself and the
+/// same pixel of src; NOT inverts all pixels of b.
+/// Requires: dst and src must have the same size.
+void BitImageAnd(BitImage dst, BitImage src) { ///
+  assert (dst != NULL && src != NULL);
+  assert (dst->width == src->width && dst->height == src->height);
+  size_t n = dst->words * dst->height;
+  for (size_t i = 0; i < n; i++) dst->bits[i] &= src->bits[i];
+}
+
+void BitImageOr(BitImage dst, BitImage src) { ///
+  assert (dst != NULL && src != NULL);
+  assert (dst->width == src->width && dst->height == src->height);
+  size_t n = dst->words * dst->height;
+  for (size_t i = 0; i < n; i++) dst->bits[i] |= src->bits[i];
+}
+
+void BitImageXor(BitImage dst, BitImage src) { ///
+  assert (dst != NULL && src != NULL);
+  assert (dst->width == src->width && dst->height == src->height);
+  size_t n = dst->words * dst->height;
+  for (size_t i = 0; i < n; i++) dst->bits[i] ^= src->bits[i];
+}
+
+void BitImageNot(BitImage b) { ///
+  assert (b != NULL);
+  if (b->words == 0) return;
+  uint64_t last = lastMask(b);
+  for (int y = 0; y < b->height; y++) {
+    uint64_t* w = bitRow(b, y);
+    for (size_t i = 0; i < b->words; i++) w[i] = ~w[i];
+    w[b->words - 1] &= last;
+  }
+}
+
+/// Number of white (1) pixels of b.
+/// (The mean level of the image is this count over width*height.)
+size_t BitImageCount(BitImage b) { ///
+  assert (b != NULL);
+  size_t n = b->words * b->height;
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++) count += (size_t)__builtin_popcountll(b->bits[i]);
+  return count;
+}
+
+/// Number of white (1) pixels in the rectangle at (x,y) with size (w,h).
+/// Requires: the rectangle must be inside b.
+size_t BitImageCountRect(BitImage b, int x, int y, int w, int h) { ///
+  assert (b != NULL);
+  assert (0 <= x && 0 <= w && x + w <= b->width);
+  assert (0 <= y && 0 <= h && y + h <= b->height);
+  size_t count = 0;
+  uint64_t last = (w % 64 == 0) ? ~(uint64_t)0 : ((uint64_t)1 << (w % 64)) - 1;
+  for (int j = y; j < y + h; j++) {
+    const uint64_t* row = bitRow(b, j);
+    for (int i = 0; i < w; i += 64) {
+      uint64_t v = bitsAt(row, (long)b->words, x + i, 0);
+      if (w - i < 64) v &= last;
+      count += (size_t)__builtin_popcountll(v);
+    }
+  }
+  return count;
+}
+
+// Erode (op = AND) or dilate (op = OR) buf, n words, in place:
+// word i becomes the op of the span bits [64*i, 64*i + len).
+// Bits past the end count as fill (the identity of op).
+// The span doubles at each step, as a combination of two shifted copies
+// of itself (which may overlap: both ops are idempotent).
+static void spanBits(uint64_t* buf, long n, int len, int dilate) {
+  uint64_t fill = dilate ? 0 : ~(uint64_t)0;
+  for (int span = 1; span < len; ) {
+    int s = (2*span <= len) ? span : len - span;
+    for (long i = 0; i < n; i++) {
+      uint64_t v = bitsAt(buf, n, 64*i + s, fill);   // (word i is read first)
+      buf[i] = dilate ? (buf[i] | v) : (buf[i] & v);
+    }
+    span += s;
+  }
+}
+
+// Erode or dilate b with the (2dx+1)x(2dy+1) rectangle, as ImageErode
+// and ImageDilate do with gray levels: a pixel becomes the AND (OR) of
+// the pixels in the rectangle centered on it that are inside the image.
+static int bitMorph(BitImage b, int dx, int dy, int dilate) {
+  assert (b != NULL);
+  assert (dx >= 0 && dy >= 0);
+  if (b->words == 0 || b->height == 0) return 1;
+  if (dx >= b->width) dx = b->width - 1;
+  if (dy >= b->height) dy = b->height - 1;
+  uint64_t fill = dilate ? 0 : ~(uint64_t)0;
+  long n = (long)b->words;
+  long m = ((long)b->width + 2*dx + 63) / 64;   // words of a padded row
+  long ext = (long)b->height + 2*dy;             // rows of the padded image
+  uint64_t* row = NULL;
+  uint64_t* col = NULL;
+  if (!check( (row = (uint64_t*)malloc((m + n) * sizeof(uint64_t))) != NULL &&
+              (dy == 0 || (col = (uint64_t*)malloc(ext * n * sizeof(uint64_t))) != NULL),
+              "Memory allocation failed" )) {
+    MEM_ALLOC_FAILURES++;
+    free(row);
+    return 0;
+  }
+  uint64_t last = lastMask(b);
+  uint64_t* tmp = row + m;
+  // Rows: pad with dx fill bits on each side, span 2dx+1 bits
+  if (dx > 0) {
+    for (int y = 0; y < b->height; y++) {
+      uint64_t* w = bitRow(b, y);
+      memcpy(tmp, w, n * sizeof(uint64_t));
+      tmp[n - 1] |= fill & ~last;
+      for (long i = 0; i < m; i++) row[i] = bitsAt(tmp, n, 64*i - dx, fill);
+      spanBits(row, m, 2*dx + 1, dilate);
+      memcpy(w, row, n * sizeof(uint64_t));
+      w[n - 1] &= last;
+    }
+  }
+  // Columns: pad with dy fill rows on each side, span 2dy+1 rows
+  if (dy > 0) {
+    for (long i = 0; i < dy * n; i++) col[i] = col[(b->height + dy) * n + i] = fill;
+    memcpy(col + dy * n, b->bits, (size_t)b->height * n * sizeof(uint64_t));
+    for (int span = 1; span < 2*dy + 1; ) {
+      int s = (2*span <= 2*dy + 1) ? span : 2*dy + 1 - span;
+      size_t k = (size_t)(ext - s) * n;
+      for (size_t i = 0; i < k; i++) {
+        col[i] = dilate ? (col[i] | col[i + s*n]) : (col[i] & col[i + s*n]);
+      }
+      span += s;
+    }
+    memcpy(b->bits, col, (size_t)b->height * n * sizeof(uint64_t));
+  }
+  free(col);
+  free(row);
+  return 1;
+}
+
+/// Erode a binary image with a rectangular structuring element.
+/// Each pixel becomes 1 only if all pixels in the (2dx+1)x(2dy+1)
+/// rectangle centered on it (and inside the image) are 1.
+/// Gives the same pixels as ImageErode on the thresholded image.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// accordingly, and the image may be eroded horizontally only.
+int BitImageErode(BitImage b, int dx, int dy) { ///
+  return bitMorph(b, dx, dy, 0);
+}
+
+/// Dilate a binary image with a rectangular structuring element.
+/// Like BitImageErode, with any 1 pixel instead of all.
+int BitImageDilate(BitImage b, int dx, int dy) { ///
+  return bitMorph(b, dx, dy, 1);
+}
+
+// Does b2 match the subimage of b1 at (x, y)?
+static int bitMatch(BitImage b1, int x, int y, BitImage b2) {
+  uint64_t last = lastMask(b2);
+  long n = (long)b2->words;
+  for (int j = 0; j < b2->height; j++) {
+    const uint64_t* w1 = bitRow(b1, y + j);
+    const uint64_t* w2 = bitRow(b2, j);
+    for (long i = 0; i < n; i++) {
+      uint64_t d = bitsAt(w1, (long)b1->words, x + 64*i, 0) ^ w2[i];
+      if (i == n - 1) d &= last;
+      if (d != 0) return 0;
+    }
+  }
+  return 1;
+}
+
+/// Locate a binary subimage inside another binary image.
+/// Searches for b2 inside b1, comparing 64 pixels at a time.
+/// If a match is found, returns 1 and the position of the first one
+/// (in raster order) is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int BitImageLocate(BitImage b1, int* px, int* py, BitImage b2) { ///
+  assert (b1 != NULL && b2 != NULL);
+  assert (px != NULL && py != NULL);
+  for (int y = 0; y <= b1->height - b2->height; y++) {
+    for (int x = 0; x <= b1->width - b2->width; x++) {
+      if (bitMatch(b1, x, y, b2)) {
+        *px = x;
+        *py = y;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// PBM byte of the 8 pixels in byte v of a row of bits, or vice versa:
+// reverse the order of the bits and invert them.
+static inline uint8 pbmByte(uint8 v) {
+  v = (uint8)((v >> 4) | (v << 4));
+  v = (uint8)(((v & 0xCC) >> 2) | ((v & 0x33) << 2));
+  v = (uint8)(((v & 0xAA) >> 1) | ((v & 0x55) << 1));
+  return (uint8)~v;
+}
+
+/// Load a binary image from a raw PBM file (P4).
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageLoad(const char* filename) { ///
+  FILE_IO++;
+  FILE* f = NULL;
+  BitImage b = NULL;
+  uint8* buf = NULL;
+  struct pgmReader r;
+  int w = 0, h = 0;
+
+  if (check( (f = fopen(filename, "rb")) != NULL, "Open failed" )) readerInit(&r, f, 1);
+  int success =
+  f != NULL &&
+  check( readerByte(&r) == 'P' && readerByte(&r) == '4', "Invalid file format" ) &&
+  check( readerInt(&r, &w) , "Invalid width" ) &&
+  check( readerInt(&r, &h) , "Invalid height" ) &&
+  check( isspace(readerByte(&r)) , "Whitespace expected" ) &&
+  (b = BitImageCreate(w, h)) != NULL;
+  size_t bytes = ((size_t)w + 7) / 8;
+  if (success && !check( (buf = (uint8*)malloc(bytes + 1)) != NULL, "Memory allocation failed" )) {
+    MEM_ALLOC_FAILURES++;
+    success = 0;
+  }
+  for (int y = 0; success && y < h; y++) {
+    if (!(success = check( readerRead(&r, buf, bytes), "Reading pixels" ))) break;
+    uint64_t* row = bitRow(b, y);
+    for (size_t i = 0; i < bytes; i++) row[i / 8] |= (uint64_t)pbmByte(buf[i]) << (8 * (i % 8));
+    if (b->words > 0) row[b->words - 1] &= lastMask(b);
+  }
+
+  // Cleanup
+  errsave = errno;
+  free(buf);
+  if (f != NULL) fclose(f);
+  if (!success) BitImageDestroy(&b);
+  errno = errsave;
+  return b;
+}
+
+/// Save a binary image to a raw PBM file (P4).
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int BitImageSave(BitImage b, const char* filename) { ///
+  assert (b != NULL);
+  FILE_IO++;
+  FILE* f = NULL;
+  uint8* buf = NULL;
+  size_t bytes = ((size_t)b->width + 7) / 8;
+  int success =
+  check( (buf = (uint8*)malloc(bytes + 1)) != NULL, "Memory allocation failed" ) &&
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( fprintf(f, "P4\n%d %d\n", b->width, b->height) > 0, "Writing header failed" );
+  for (int y = 0; success && y < b->height; y++) {
+    const uint64_t* row = bitRow(b, y);
+    for (size_t i = 0; i < bytes; i++) buf[i] = pbmByte((uint8)(row[i / 8] >> (8 * (i % 8))));
+    // (padding bits of the last byte must be 0, which is white in PBM)
+    if (b->width % 8 != 0) buf[bytes - 1] &= (uint8)(0xFF << (8 - b->width % 8));
+    success = check( fwrite(buf, 1, bytes, f) == bytes, "Writing pixels failed" );
+  }
+
+  // Cleanup
+  if (f != NULL) success = check( fclose(f) == 0, "Writing pixels failed" ) && success;
+  free(buf);
+  return success;
+}
+
 void ImageFree(Image img) {
   if (img != NULL) {
     if (img->pixel != NULL) {
-        free(img->pixel);
+        freePixels(img);
     }
+    pyramidDrop(img);
+    ImageDestroy(&img->blurred);
+    pthread_mutex_destroy(&img->lock);
 
     free(img);
   }
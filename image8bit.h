@@ -13,6 +13,7 @@
 #define IMAGE8BIT_H
 
 #include <inttypes.h>
+#include <stdio.h>
 
 // Type for pixel levels
 typedef uint8_t uint8;
@@ -20,9 +21,60 @@ typedef uint8_t uint8;
 // Maximum value you can store in a pixel (maximum maxval accepted)
 extern const uint8 PixMax;
 
+// Maximum maxval of 16-bit images (see ImageCreate16)
+extern const uint16_t PixMax16;
+
 // Type Image is a pointer to image objects
 typedef struct image *Image;
 
+// Memory layout of the pixel array (see ImageCreateLayout)
+typedef enum {
+  IMAGE_RASTER = 0,     // raster scan: left to right, top to bottom
+  IMAGE_TILED = 1       // 64x64 tiles, each one a raster scan, in raster order
+} ImageLayout;
+
+// Readers and writers of multi-image PGM streams (see ImageReaderOpen)
+typedef struct imageReader *ImageReader;
+typedef struct imageWriter *ImageWriter;
+
+// Type BitImage is a pointer to binary (1 bit per pixel) images
+typedef struct bitImage *BitImage;
+
+// Similarity measures (see ImageFindSubImage)
+typedef enum {
+  IMAGE_SAD = 0,        // sum of absolute differences (lower is better)
+  IMAGE_NCC = 1         // normalized cross-correlation (higher is better)
+} ImageMetric;
+
+// Interpolation modes of ImageResize
+typedef enum {
+  IMAGE_AREA = 0,       // mean of the covered source area (for shrinking)
+  IMAGE_BILINEAR = 1    // bilinear interpolation (for enlarging)
+} ImageScaling;
+
+// Border handling of filters (see ImageConvolveSeparable)
+typedef enum {
+  IMAGE_BORDER_SHRINK = 0,  // use only the pixels inside the image (as ImageBlur)
+  IMAGE_BORDER_CLAMP = 1,   // pixels outside repeat the nearest edge pixel
+  IMAGE_BORDER_REFLECT = 2  // pixels outside mirror those inside: cba|abcd|dcb
+} ImageBorder;
+
+// One-dimensional convolution kernel with integer (fixed-point) weights
+typedef struct imageKernel {
+  int radius;           // number of weights on each side of the center
+  const int* weight;    // 2*radius+1 weights, for offsets -radius..radius
+} ImageKernel;
+
+// Extended pixel statistics (see ImageStatsEx)
+typedef struct imageStats {
+  uint8 min;            // minimum gray level
+  uint8 max;            // maximum gray level
+  uint64_t sum;         // sum of all gray levels
+  double mean;          // mean gray level
+  double variance;      // (population) variance of the gray levels
+  uint64_t hist[256];   // hist[v] = number of pixels with gray level v
+} ImageStatistics;
+
 /// Error handling functions
 
 /// Error cause.
@@ -33,9 +85,29 @@ typedef struct image *Image;
 ///
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
+/// The error cause is kept per thread, like errno.
 char* ImageErrMsg() ;
 
-/// Init Image library.  (Call once!)
+/// Thread safety
+///
+/// All functions of this module may be called concurrently from several
+/// threads, as long as each thread works on distinct Images.
+/// The same Image may be used concurrently by several threads only if
+/// none of them modifies it (queries such as ImageStats, ImageStatsEx or
+/// ImageGetPixel, and functions that create new images from it, such as
+/// ImageCrop, do not modify it).
+/// Error causes (ImageErrMsg) and instrumentation counters are kept
+/// per thread; InstrPrint shows the sum over all threads.
+/// Some operations split their work among several threads: as many as
+/// processors, unless the IMAGE8BIT_THREADS environment variable, or
+/// ImageSetThreads, sets fewer.
+
+/// Limit the number of threads used by each operation called from the
+/// calling thread to n (n <= 0 removes the limit).
+/// For callers that already run operations in several threads.
+void ImageSetThreads(int n) ;
+
+/// Init Image library.  (Call once, before starting other threads!)
 /// Currently, simply calibrate instrumentation and set names of counters.
 void ImageInit(void) ;
 
@@ -51,6 +123,23 @@ void ImageInit(void) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCreate(int width, int height, uint8 maxval) ;
 
+/// Create a new black image with the given memory layout.
+/// Like ImageCreate, which creates IMAGE_RASTER images.
+/// All functions of this module work on images of either layout,
+/// and images created from an image keep its layout.
+/// IMAGE_TILED stores each 64x64 block of pixels contiguously, which
+/// favors column-wise access (ImageRotate, vertical filter passes,
+/// 2D searches) on wide images.  Rows are converted to raster order
+/// only when saving.
+Image ImageCreateLayout(int width, int height, uint8 maxval, ImageLayout layout) ;
+
+/// Create a new black 16-bit image.
+/// Like ImageCreate, but pixels have 16 bits and maxval may be up to
+/// PixMax16.  16-bit images are always IMAGE_RASTER.
+/// Only some functions accept 16-bit images: those documented as such,
+/// and the information queries, ImageDestroy and ImageSave.
+Image ImageCreate16(int width, int height, uint16_t maxval) ;
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -58,10 +147,21 @@ Image ImageCreate(int width, int height, uint8 maxval) ;
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) ;
 
+/// Convert image to the given memory layout.
+/// The pixels (and cached stats) are not changed.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// accordingly, and the image is left unchanged.
+int ImageSetLayout(Image img, ImageLayout layout) ;
+
 /// PGM file operations
 
-/// Load a raw PGM file.
-/// Only 8 bit PGM files are accepted.
+/// Load a PGM file, raw (P5) or ASCII (P2), a run-length file (see
+/// ImageSaveRLE) or a raw PBM file (see BitImageSave); the format is
+/// detected from the file contents.
+/// 8-bit and 16-bit (maxval > PixMax) PGM files are accepted; the latter
+/// give 16-bit images (see ImageCreate16).
+/// PBM files give images with levels 0 (black) and PixMax (white).
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
@@ -73,6 +173,139 @@ Image ImageLoad(const char* filename) ;
 /// a partial and invalid file may be left in the system.
 int ImageSave(Image img, const char* filename) ;
 
+/// Save image to an ASCII (plain) PGM file.
+/// Each row starts on a new line, and no line is longer than 70 chars.
+/// Accepts 16-bit images.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageSaveAscii(Image img, const char* filename) ;
+
+/// Save image to a run-length file (see ImageLoad).
+/// Rows are compressed with PackBits; thresholded and sparse images take
+/// a small fraction of the size of a PGM file.
+/// Requires an 8-bit image.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageSaveRLE(Image img, const char* filename) ;
+
+/// Run-length files may also be transformed and searched without loading
+/// them into an image, one row at a time (for images too large for memory).
+
+/// Negative of the run-length file src, saved to the run-length file dst,
+/// as ImageNegative, without loading src into an image: each run is
+/// transformed as a whole, and memory is needed for one row only.
+/// dst must be a regular file, other than src.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageNegativeRLE(const char* src, const char* dst) ;
+
+/// Threshold of the run-length file src, saved to the run-length file
+/// dst, as ImageThreshold, without loading src into an image (see
+/// ImageNegativeRLE).
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageThresholdRLE(const char* src, const char* dst, uint8 thr) ;
+
+/// Locate the 8-bit image img2 inside the run-length file filename,
+/// without loading the file into an image: its rows are decoded in turn,
+/// and only the last img2 height rows are kept.
+/// If a match is found, returns 1 and the position of the first one (in
+/// raster order) is set in (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageLocateRLE(const char* filename, int* px, int* py, Image img2) ;
+
+/// Multi-image PGM streams
+/// A PGM file may hold a sequence of images, one after the other
+/// (each with its own header).  Readers and writers process such
+/// sequences through a single open stream, with buffered I/O.
+
+/// Open a PGM file for reading its images in sequence.
+/// On success, a new reader is returned.
+/// (The caller is responsible for closing the returned reader!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageReader ImageReaderOpen(const char* filename) ;
+
+/// Read images in sequence from the open stream f.
+/// The reader reads ahead, so f should not be used for input while the
+/// reader is open.  f is not closed by ImageReaderClose.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageReader ImageReaderFromFile(FILE* f) ;
+
+/// Are there no more images in the stream?
+/// (Only whitespace and comments may follow the last image.)
+int ImageReaderDone(ImageReader r) ;
+
+/// Read the next image (raw or ASCII, 8-bit or 16-bit, as ImageLoad).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, or if there are no more images, returns NULL and
+/// errno/errCause are set accordingly.
+Image ImageReaderNext(ImageReader r) ;
+
+/// Skip the next image, without storing its pixels.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageReaderSkip(ImageReader r) ;
+
+/// Close the reader *pr, and set *pr to NULL.
+/// If *pr is NULL, no operation is performed.
+void ImageReaderClose(ImageReader* pr) ;
+
+/// Create (or truncate) a PGM file for writing a sequence of images.
+/// On success, a new writer is returned.
+/// (The caller is responsible for closing the returned writer!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageWriter ImageWriterOpen(const char* filename) ;
+
+/// Write images in sequence to the open stream f.
+/// f is flushed, but not closed, by ImageWriterClose.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageWriter ImageWriterFromFile(FILE* f) ;
+
+/// Append img to the stream, as a raw PGM image.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial image may have been written.
+int ImageWriterPut(ImageWriter w, Image img) ;
+
+/// Flush and close the writer *pw, and set *pw to NULL.
+/// If *pw is NULL, no operation is performed (and nonzero is returned).
+/// On success, returns nonzero.
+/// On failure (writing buffered data), returns 0 and errno/errCause are
+/// set appropriately.
+int ImageWriterClose(ImageWriter* pw) ;
+
+/// Shared memory export (Linux)
+
+/// Export img to a new sealed shared memory file (memfd).
+/// The file holds a copy of the pixels (and size, maxval, layout and
+/// depth), and can no longer be modified, so the descriptor may be
+/// passed to other processes that ImageImport it.
+/// On success, returns the new descriptor (the caller must close it).
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageExport(Image img) ;
+
+/// Export img to the shared memory file fd, which must be empty and
+/// allow sealing (see memfd_create), and seal it, as ImageExport.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageExportTo(Image img, int fd) ;
+
+/// Import an image exported by ImageExport from descriptor fd, without
+/// copying its pixels: they are mapped from the shared memory file and
+/// only copied (a page at a time) when modified.
+/// The file must be sealed against writing and shrinking.
+/// fd is not closed (and may be closed right after the import).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageImport(int fd) ;
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -86,6 +319,12 @@ int ImageHeight(Image img) ;
 /// Get image maximum gray level
 int ImageMaxval(Image img) ;
 
+/// Get image memory layout
+ImageLayout ImageGetLayout(Image img) ;
+
+/// Get image depth: the number of bits per pixel (8 or 16)
+int ImageDepth(Image img) ;
+
 /// Pixel stats
 /// Find the minimum and maximum gray levels in image.
 /// On return,
@@ -93,10 +332,30 @@ int ImageMaxval(Image img) ;
 /// *max is set to the maximum.
 void ImageStats(Image img, uint8* min, uint8* max) ;
 
+/// Pixel stats of an 8-bit or 16-bit image.
+/// Like ImageStats: find the minimum and maximum gray levels in image.
+/// For an empty image, both are 0.
+void ImageStats16(Image img, uint16_t* min, uint16_t* max) ;
+
+/// Extended pixel stats
+/// Compute min, max, sum, mean, variance and histogram of the gray levels,
+/// in a single pass over the pixels, and copy them to (*stats).
+/// The result is cached in the image, so repeated calls are O(1) until
+/// the image is modified by some other function of this module.
+/// For an empty image, min=max=0, mean=variance=0 and hist is all zero.
+void ImageStatsEx(Image img, ImageStatistics* stats) ;
+
+/// Histogram
+/// Set hist[v] to the number of pixels with gray level v, for v in [0, 255].
+/// Large images are counted in parallel row bands.
+/// Like ImageStatsEx, the result is cached in the image.
+void ImageHistogram(Image img, uint64_t hist[256]) ;
+
 /// Check if pixel position (x,y) is inside img.
 int ImageValidPos(Image img, int x, int y) ;
 
 /// Check if rectangular area (x,y,w,h) is completely inside img.
+/// (A rectangle with negative width or height is not.)
 int ImageValidRect(Image img, int x, int y, int w, int h) ;
 
 /// Pixel get & set operations
@@ -112,6 +371,13 @@ uint8 ImageGetPixel(Image img, int x, int y) ;
 /// Set the pixel at position (x,y) to new level.
 void ImageSetPixel(Image img, int x, int y, uint8 level) ;
 
+/// Get the pixel (level) at position (x,y), of an 8-bit or 16-bit image.
+uint16_t ImageGetPixel16(Image img, int x, int y) ;
+
+/// Set the pixel at position (x,y) of an 8-bit or 16-bit image to new level.
+/// Requires: level <= maxval.
+void ImageSetPixel16(Image img, int x, int y, uint16_t level) ;
+
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
@@ -122,6 +388,7 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) ;
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
 /// resulting in a "photographic negative" effect.
+/// Accepts 16-bit images.
 void ImageNegative(Image img) ;
 
 /// Apply threshold to image.
@@ -133,8 +400,47 @@ void ImageThreshold(Image img, uint8 thr) ;
 /// Multiply each pixel level by a factor, but saturate at maxval.
 /// This will brighten the image if factor>1.0 and
 /// darken the image if factor<1.0.
+/// Accepts 16-bit images.
 void ImageBrighten(Image img, double factor) ;
 
+/// Transform the rectangle at (x,y) with size (w,h) to negative.
+/// Like ImageNegative on a crop of img pasted back, but in place.
+/// Requires: the rectangle must be inside img.
+/// Accepts 16-bit images.
+void ImageNegativeRect(Image img, int x, int y, int w, int h) ;
+
+/// Apply threshold to the rectangle at (x,y) with size (w,h).
+/// Like ImageThreshold on a crop of img pasted back, but in place.
+/// Requires: the rectangle must be inside img.
+void ImageThresholdRect(Image img, int x, int y, int w, int h, uint8 thr) ;
+
+/// Brighten the rectangle at (x,y) with size (w,h) by a factor.
+/// Like ImageBrighten on a crop of img pasted back, but in place.
+/// Requires: the rectangle must be inside img.
+/// Accepts 16-bit images.
+void ImageBrightenRect(Image img, int x, int y, int w, int h, double factor) ;
+
+/// Apply a look-up table to image.
+/// Replace each pixel level v by lut[v].
+/// Any point transformation (or composition of point transformations)
+/// may be applied in a single pass in this way.
+void ImageApplyLUT(Image img, const uint8 lut[256]) ;
+
+/// Equalize the histogram of the image.
+/// Map each level v to round(maxval * (cdf(v)-cdf(min)) / (N-cdf(min))),
+/// where cdf(v) is the number of pixels with level <= v, N is the number
+/// of pixels and min is the minimum level, spreading levels over [0, maxval].
+/// An image with a single gray level is not modified.
+void ImageEqualize(Image img) ;
+
+/// Apply threshold to image, with an automatically chosen level.
+/// The level is chosen by Otsu's method, to maximize the between-class
+/// variance of the resulting black and white pixel classes.
+/// The threshold is applied as in ImageThreshold.
+/// Returns the threshold level used.
+/// (For an image with a single gray level, that level is returned.)
+uint8 ImageAutoThreshold(Image img) ;
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -149,6 +455,7 @@ void ImageBrighten(Image img, double factor) ;
 /// Returns a rotated version of the image.
 /// The rotation is 90 degrees anti-clockwise.
 /// Ensures: The original img is not modified.
+/// Accepts 16-bit images.
 /// 
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
@@ -158,12 +465,34 @@ Image ImageRotate(Image img) ;
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
+/// Accepts 16-bit images.
 /// 
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageMirror(Image img) ;
 
+/// Mirror an image in-place = flip left-right.
+/// This modifies img in-place: no allocation involved.
+/// Ensures: The result is the same as ImageMirror(img).
+/// Accepts 16-bit images.
+void ImageMirrorInPlace(Image img) ;
+
+/// Flip an image in-place = flip top-bottom.
+/// This modifies img in-place: no allocation involved.
+/// Accepts 16-bit images.
+void ImageFlipVertical(Image img) ;
+
+/// Flip an image = flip top-bottom.
+/// Returns a flipped version of the image.
+/// Ensures: The original img is not modified.
+/// Accepts 16-bit images.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageFlip(Image img) ;
+
 /// Crop a rectangular subimage from img.
 /// The rectangle is specified by the top left corner coords (x, y) and
 /// width w and height h.
@@ -172,18 +501,37 @@ Image ImageMirror(Image img) ;
 /// Ensures:
 ///   The original img is not modified.
 ///   The returned image has width w and height h.
+/// Accepts 16-bit images.
 /// 
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
+/// Resize an image.
+/// Returns a width x height version of the image, scaled with the
+/// given mode:
+///   IMAGE_AREA: each pixel is the mean of the source area it covers,
+///     weighted by overlap; the mean is exact when the source size is a
+///     multiple of the new size (on each axis), and computed with 14-bit
+///     fixed-point weights otherwise.  Best for shrinking.
+///   IMAGE_BILINEAR: each pixel is interpolated from the 2x2 source
+///     pixels around its center.  Best for enlarging.
+/// Requires: img is not empty; width, height > 0.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int width, int height, ImageScaling mode) ;
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
 /// This modifies img1 in-place: no allocation involved.
-/// Requires: img2 must fit inside img1 at position (x, y).
+/// Requires: img2 must fit inside img1 at position (x, y), and have the
+/// same depth (8 or 16 bits).  Accepts 16-bit images.
 void ImagePaste(Image img1, int x, int y, Image img2) ;
 
 /// Blend an image into a larger image.
@@ -201,16 +549,259 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 
 /// Locate a subimage inside another image.
 /// Searches for img2 inside img1.
-/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If a match is found, returns 1 and the position of the first one
+/// (in raster order) is set in vars (*px, *py).
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// Rows of candidate positions are scanned in parallel bands, each one
+/// for the first pixel of img2 (with memchr); only positions that match
+/// it are compared further.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2);
+
+/// Sum of absolute differences between img2 and the subimage of img1
+/// at position (x, y).
+/// Requires: img2 must fit inside img1 at position (x, y).
+uint64_t ImageMatchSAD(Image img1, int x, int y, Image img2) ;
+
+/// Normalized cross-correlation between img2 and the subimage of img1
+/// at position (x, y), in [-1.0, 1.0].
+/// If either of them has a single gray level, the result is 1.0 if both
+/// have a single level, or 0.0 otherwise.
+/// Requires: img2 must fit inside img1 at position (x, y).
+double ImageMatchNCC(Image img1, int x, int y, Image img2) ;
+
+/// Find the position where img2 best matches a subimage of img1.
+/// The search runs coarse-to-fine on the pyramids of both images:
+/// exhaustively at the coarsest level where img2 is still at least 16x16,
+/// and then in small windows around the best candidates at each finer
+/// level.  So, it is much faster than an exhaustive search, but the
+/// global optimum is not guaranteed (though an exact occurrence of a
+/// textured img2 is normally found).
+/// Sets (*px, *py) to the position found and returns its score
+/// according to metric (see ImageMatchSAD and ImageMatchNCC).
+/// Requires: img2 must fit inside img1.
+double ImageFindSubImage(Image img1, int* px, int* py, Image img2, ImageMetric metric) ;
+
+/// Image pyramid
+
+/// The pyramid of an image is a sequence of images (levels) of decreasing
+/// resolution.  Level 0 is the image itself; level k+1 is level k reduced
+/// by averaging each 2x2 block of pixels (with rounding), so level k has
+/// (width >> k) x (height >> k) pixels.
+/// Levels are built on demand and cached in the image until it is modified.
+
+/// Number of (nonempty) levels of the pyramid of img.
+/// (For an empty image, returns 1.)
+int ImagePyramidDepth(Image img) ;
+
+/// Get level k of the pyramid of img, building it if needed.
+/// The returned image belongs to img: it must not be modified or
+/// destroyed, and it is only valid until img is modified or destroyed.
+/// Requires: 0 <= k < ImagePyramidDepth(img).
+/// On failure (out of memory), returns NULL and errno/errCause are set.
+Image ImagePyramidLevel(Image img, int k) ;
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
 /// The image is changed in-place.
+/// Accepts 16-bit images.
 void ImageBlur(Image img, int dx, int dy) ;
 
+/// Blur the rectangle at (x,y) with size (w,h) with a (2dx+1)x(2dy+1)
+/// mean filter, in place.
+/// Like ImageBlur on a crop of img pasted back: pixels outside the
+/// rectangle are left out of the means, and are not changed.
+/// Only a buffer of the size of the rectangle is used.
+/// Requires: the rectangle must be inside img; an 8-bit image.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// accordingly, and the image is left unchanged.
+int ImageBlurRect(Image img, int x, int y, int w, int h, int dx, int dy) ;
+
+/// Get img blurred by a (2dx+1)x(2dy+1) mean filter, as by ImageBlur.
+/// The blurred image is cached in img and kept up to date: after
+/// modifications of small rectangles of img, only the pixels near them
+/// are blurred again.
+/// The returned image belongs to img: it must not be modified or
+/// destroyed, and it is only valid until img is modified or destroyed,
+/// or ImageBlurCached is called on img with another dx or dy.
+/// Requires: an 8-bit image; dx, dy >= 0.
+/// On failure (out of memory), returns NULL and errno/errCause are set.
+Image ImageBlurCached(Image img, int dx, int dy) ;
+
+/// Convolve an image with a separable kernel.
+/// Each pixel (x,y) is substituted by the sum of
+///   kx.weight[rx+j] * ky.weight[ry+i] * pixel(x+j, y+i)
+/// for j in [-rx, rx], i in [-ry, ry] (rx = kx.radius, ry = ky.radius),
+/// divided by the product of the sums of the weights of kx and ky
+/// (a sum that is not positive counts as 1), rounded to the nearest
+/// integer and saturated to [0, maxval].
+/// Pixels outside the image are handled according to border.
+/// With IMAGE_BORDER_SHRINK, they are left out, and so are their weights
+/// from the divisor: kernels of ones give the same result as ImageBlur.
+/// Kernels whose absolute weights add up to at most 128 (kx) and
+/// 65535 (ky) are applied with 16-bit fixed-point SIMD arithmetic.
+/// The image is changed in-place.
+/// Requires: radii >= 0; absolute weights of kx add up to less than 2^23.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// accordingly, and the image is left unchanged.
+int ImageConvolveSeparable(Image img, ImageKernel kx, ImageKernel ky, ImageBorder border) ;
+
+/// Blur an image with an approximate Gaussian filter.
+/// The filter is three successive mean filters (box passes), sized so
+/// that their combination has standard deviation close to sigma.
+/// The cost per pixel does not depend on sigma.
+/// The image is changed in-place.
+/// Requires: sigma >= 0.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// accordingly, and the image may be partially filtered.
+int ImageGaussianBlur(Image img, double sigma, ImageBorder border) ;
+
+/// Apply a median filter to an image.
+/// Each pixel is substituted by the median of the pixels in a
+/// (2dx+1)x(2dy+1) rectangle centered on it, clipped to the image, as
+/// in ImageBlur.  When the rectangle has an even number of pixels, the
+/// lower of the two middle values is used.
+/// The cost per pixel does not depend on dx and dy.
+/// The image is changed in-place.
+/// Requires: dx, dy >= 0; dy < 32768.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// accordingly, and the image is left unchanged.
+int ImageMedian(Image img, int dx, int dy) ;
+
+/// Morphology
+
+/// Erode an image with a rectangular structuring element.
+/// Each pixel is substituted by the minimum of the pixels in a
+/// (2dx+1)x(2dy+1) rectangle centered on it, clipped to the image.
+/// The cost per pixel does not depend on dx and dy.
+/// The image is changed in-place.
+/// Requires: dx, dy >= 0.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// accordingly, and the image is left unchanged.
+int ImageErode(Image img, int dx, int dy) ;
+
+/// Dilate an image with a rectangular structuring element.
+/// Like ImageErode, with the maximum instead of the minimum.
+int ImageDilate(Image img, int dx, int dy) ;
+
+/// Open an image with a rectangular structuring element:
+/// erode, then dilate, with the same rectangle (see ImageErode).
+/// Removes bright details smaller than the rectangle.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// accordingly, and the image may be eroded only.
+int ImageOpen(Image img, int dx, int dy) ;
+
+/// Close an image with a rectangular structuring element:
+/// dilate, then erode, with the same rectangle (see ImageErode).
+/// Removes dark details smaller than the rectangle.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// accordingly, and the image may be dilated only.
+int ImageClose(Image img, int dx, int dy) ;
+
+/// Binary images
+
+/// Create a new binary image, with all pixels black (0).
+///   width, height : the dimensions of the new image.
+/// Requires: width and height must be non-negative.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageCreate(int width, int height) ;
+
+/// Destroy the binary image pointed to by (*bp).
+///   bp : address of a BitImage variable.
+/// If (*bp)==NULL, no operation is performed.
+/// Ensures: (*bp)==NULL.
+/// Should never fail, and should preserve global errno/errCause.
+void BitImageDestroy(BitImage* bp) ;
+
+/// Get binary image width
+int BitImageWidth(BitImage b) ;
+
+/// Get binary image height
+int BitImageHeight(BitImage b) ;
+
+/// Get the pixel (1 or 0) at position (x,y).
+int BitImageGetPixel(BitImage b, int x, int y) ;
+
+/// Set the pixel at position (x,y) to bit (nonzero is 1).
+void BitImageSetPixel(BitImage b, int x, int y, int bit) ;
+
+/// Convert image to a binary image, as ImageThreshold does:
+/// pixels with level<thr become 0 (black), and those with level>=thr
+/// become 1 (white).  img is not changed.
+/// Requires an 8-bit image.
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageFromImage(Image img, uint8 thr) ;
+
+/// Convert a binary image to a (raster) image with the given maxval:
+/// 0 becomes black (0) and 1 becomes white (maxval).
+/// Requires: 0 < maxval <= PixMax.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image BitImageToImage(BitImage b, uint8 maxval) ;
+
+/// Logical operations on binary images.
+/// Each pixel of dst is replaced by the AND, OR or XOR of itself and the
+/// same pixel of src; NOT inverts all pixels of b.
+/// Requires: dst and src must have the same size.
+void BitImageAnd(BitImage dst, BitImage src) ;
+
+void BitImageOr(BitImage dst, BitImage src) ;
+
+void BitImageXor(BitImage dst, BitImage src) ;
+
+void BitImageNot(BitImage b) ;
+
+/// Number of white (1) pixels of b.
+/// (The mean level of the image is this count over width*height.)
+size_t BitImageCount(BitImage b) ;
+
+/// Number of white (1) pixels in the rectangle at (x,y) with size (w,h).
+/// Requires: the rectangle must be inside b.
+size_t BitImageCountRect(BitImage b, int x, int y, int w, int h) ;
+
+/// Erode a binary image with a rectangular structuring element.
+/// Each pixel becomes 1 only if all pixels in the (2dx+1)x(2dy+1)
+/// rectangle centered on it (and inside the image) are 1.
+/// Gives the same pixels as ImageErode on the thresholded image.
+/// On failure (out of memory), returns 0, errno/errCause are set
+/// accordingly, and the image may be eroded horizontally only.
+int BitImageErode(BitImage b, int dx, int dy) ;
+
+/// Dilate a binary image with a rectangular structuring element.
+/// Like BitImageErode, with any 1 pixel instead of all.
+int BitImageDilate(BitImage b, int dx, int dy) ;
+
+/// Locate a binary subimage inside another binary image.
+/// Searches for b2 inside b1, comparing 64 pixels at a time.
+/// If a match is found, returns 1 and the position of the first one
+/// (in raster order) is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int BitImageLocate(BitImage b1, int* px, int* py, BitImage b2) ;
+
+/// Load a binary image from a raw PBM file (P4).
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageLoad(const char* filename) ;
+
+/// Save a binary image to a raw PBM file (P4).
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int BitImageSave(BitImage b, const char* filename) ;
+
 void ImageFree(Image img);
 #endif
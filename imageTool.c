@@ -9,18 +9,32 @@
 // João Manuel Rodrigues <jmr@ua.pt>
 // 2023
 
+#define _GNU_SOURCE   // for file sealing (F_GET_SEALS)
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <errno.h>
 #include "error.h"
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #include "image8bit.h"
 #include "instrumentation.h"
 
 static const char* USAGE =
     "USAGE: imageTool [FILE...] [OPERATION [OPERAND...]]\n"
+    "       imageTool --batch PIPELINE [FILE...]\n"
+    "       imageTool --frames PIPELINE FILE\n"
+    "       imageTool --serve SOCKET\n"
+    "       imageTool --client SOCKET [FILE...] [OPERATION [OPERAND...]]\n"
     "  Apply pipeline of image processing operations to PGM files.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
@@ -29,33 +43,88 @@ static const char* USAGE =
     "  The last image in the buffer is called the current image CURR and its\n"
     "  predecessor is PRED.\n"
     "  Most operations apply to CURR and some also use PRED.\n"
+    "  The whole pipeline is planned before it runs: operations whose\n"
+    "  results are never used are skipped, consecutive point operations\n"
+    "  are fused, and images are freed right after their last use.\n"
+    "  mirror and flip work in place when CURR is not used afterwards.\n"
     "\n"
     "FILES:\n"
-    "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
+    "  Image files in 8-bit or 16-bit PGM format, raw or ASCII, are accepted,\n"
+    "  8-bit run-length files (see saverle) and PBM files (see savepbm).\n"
+    "  16-bit images may only be used by info, save, saveascii, append, neg,\n"
+    "  bri, rotate, mirror, flip, imirror, iflip, crop, paste, blur and raster.\n"
+    "  A file may hold several images (frames), one after the other; a FILE\n"
+    "  operand loads its first frame.\n"
+    "  The name - stands for the standard input (FILE, frame) or output\n"
+    "  (save, append): raw PGM images are read or written one after the\n"
+    "  other, so imageTool processes may be chained with pipes:\n"
+    "      imageTool - neg save - | imageTool - blur 3,3 save out.pgm\n"
+    "  The name fd:N stands for the open file descriptor N, likewise.  If N\n"
+    "  is a sealed shared memory file (memfd) with an exported image, it is\n"
+    "  mapped without copying; save to an empty memfd that allows sealing\n"
+    "  exports CURR to it, so later processes may map it in turn.\n"
     "  Input file names must be distinct from operation names.\n"
     "\n"
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
     "  save FILE       Save CURR to PGM file\n"
-    "  info            Show information on CURR (size and range)\n"
+    "  saveascii FILE  Save CURR to ASCII (plain) PGM file\n"
+    "  saverle FILE    Save CURR to run-length file (compact for thresholded\n"
+    "                  or sparse images; loaded as any FILE)\n"
+    "  savepbm FILE    Save CURR to bitmap (PBM) file: levels below half of\n"
+    "                  maxval are black, the rest white (loaded as any FILE,\n"
+    "                  with levels 0 and 255)\n"
+    "  frame N FILE    Load frame N (0 is the first) of PGM file, creating new image\n"
+    "  append FILE     Append CURR to PGM file as a new frame (the file is\n"
+    "                  truncated on the first append of each run)\n"
+    "  info            Show information on CURR (size, range, mean, variance)\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
+    "  equalize        Equalize the histogram of CURR\n"
+    "  autothr         Apply thresholding to CURR at level chosen by Otsu's method\n"
+    "  neg@X,Y,W,H, thr@X,Y,W,H LEVEL, bri@X,Y,W,H FACTOR, blur@X,Y,W,H DX,DY\n"
+    "                  Apply the operation to a rectangle of CURR only, in\n"
+    "                  place (same result as crop, operation and paste back)\n"
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
+    "  flip            Flip CURR top-to-bottom, creating new image\n"
+    "  imirror         Mirror CURR left-to-right, in place\n"
+    "  iflip           Flip CURR top-to-bottom, in place\n"
+    "  tile            Store CURR in 64x64 tiles (faster rotate, blur, locate\n"
+    "                  on wide images); images created from CURR are also tiled\n"
+    "  raster          Store CURR as a raster scan (the default)\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  resize W,H      Resize CURR to WxH pixels, creating new image (area\n"
+    "                  averaging, or bilinear if enlarging in both directions)\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  find METRIC     Search PRED in CURR coarse-to-fine, print best position\n"
+    "                  and its score (METRIC is sad or ncc)\n"
+    "\n"              
+    "  negrle FILE1 FILE2, thrrle LEVEL FILE1 FILE2\n"
+    "                  Save the negative or threshold of run-length FILE1 to\n"
+    "                  run-length FILE2, run by run, without loading FILE1\n"
+    "  locaterle FILE  Search CURR in run-length FILE, row by row, without\n"
+    "                  loading it; print first matching position, or NOTFOUND\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  gauss SIGMA     blur CURR with Gaussian filter of std. deviation SIGMA\n"
+    "                  (approximate; edges are reflected)\n"
+    "  median DX,DY    Apply (2DX+1)x(2DY+1) median filter to CURR\n"
+    "\n"
+    "  erode DX,DY     Erode CURR with (2DX+1)x(2DY+1) rectangle (minimum)\n"
+    "  dilate DX,DY    Dilate CURR with (2DX+1)x(2DY+1) rectangle (maximum)\n"
+    "  open DX,DY      Erode, then dilate CURR (removes small bright spots)\n"
+    "  close DX,DY     Dilate, then erode CURR (removes small dark spots)\n"
     "\n"              
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
@@ -63,6 +132,47 @@ static const char* USAGE =
     "  W,H             Width and height of image or rectangular region\n"
     "  alpha           Blending factor\n"
     "\n"
+    "BATCH MODE:\n"
+    "  --batch PIPELINE [FILE...]\n"
+    "                  Run PIPELINE (one argument with space-separated\n"
+    "                  operations and operands) on each FILE, in parallel.\n"
+    "                  Each FILE is loaded as I0 before the PIPELINE runs.\n"
+    "                  If no FILE is given, file names are read from stdin,\n"
+    "                  one per line.  In the PIPELINE, these are replaced:\n"
+    "                    {in}    the input FILE\n"
+    "                    {dir}   the directory of FILE (or .)\n"
+    "                    {name}  the name of FILE, without directory and .pgm\n"
+    "                    {out}   same as {dir}/{name}.out.pgm\n"
+    "                  tic and toc are ignored; counters and times for the\n"
+    "                  whole batch are printed at the end.\n"
+    "\n"
+    "FRAMES MODE:\n"
+    "  --frames PIPELINE FILE\n"
+    "                  Run PIPELINE (as in batch mode) on each frame of FILE,\n"
+    "                  in order.  Each frame is loaded as I0 before the\n"
+    "                  PIPELINE runs; use append to write frames of results.\n"
+    "                  frame and append are not available in batch and server\n"
+    "                  modes.\n"
+    "\n"
+    "SERVER MODE:\n"
+    "  --serve SOCKET  Listen on Unix socket SOCKET for pipelines sent by\n"
+    "                  clients, and run them concurrently.  FILES are\n"
+    "                  relative to the server directory.  Loaded images are\n"
+    "                  kept in a cache, so each FILE is read from disk only\n"
+    "                  once, until the server writes it.  Images may only\n"
+    "                  be loaded from and saved to relative paths without\n"
+    "                  .. components, inside the server directory\n"
+    "                  (symbolic links in it are followed; the server\n"
+    "                  directory must not have links to places clients\n"
+    "                  may not access).  Pipelines may also use these\n"
+    "                  operations:\n"
+    "                    keep NAME   Store a copy of CURR in the cache as NAME\n"
+    "                                (NAME may then be used as a FILE)\n"
+    "                    drop NAME   Remove NAME from the cache\n"
+    "  --client SOCKET ...\n"
+    "                  Send the remaining arguments as a pipeline to the\n"
+    "                  server at SOCKET, and print its output.\n"
+    "\n"
     ;
 
 static char* errors[] = {
@@ -74,6 +184,11 @@ static char* errors[] = {
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "Operation only available in server mode",
+  "Server communication failure",
+  "Operation not available for 16-bit images",
+  "Operation not available in batch or server mode",
+  "File name not allowed in server mode",
 };
 
 
@@ -85,144 +200,1795 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
-int main(int ac, char* av[]) {
-  program_name = av[0];
-  if (ac <= 1) {
-    error(5, 0, "\n%s", USAGE);
+// Capacity of the image buffer
+enum { N = 10 };
+
+// In batch mode, progress messages are suppressed, and pipelines run
+// concurrently on several files.
+static int batchMode = 0;
+
+// Print a progress message to stderr (except in batch mode).
+static void note(const char* format, ...) {
+  if (batchMode) return;
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+}
+
+// Server image cache (only in server mode)
+struct cacheEntry {
+  char* name;
+  Image img;
+  struct cacheEntry* next;
+};
+
+static struct cacheEntry* cache = NULL;
+static int serverMode = 0;
+static pthread_rwlock_t cacheLock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Return a new copy of img, or NULL on failure.
+static Image copyImage(Image img) {
+  return ImageCrop(img, 0, 0, ImageWidth(img), ImageHeight(img));
+}
+
+// Skip the empty and . components at the start of path p.
+static const char* skipDots(const char* p) {
+  while (*p == '/' || (p[0] == '.' && (p[1] == '/' || p[1] == '\0'))) p++;
+  return p;
+}
+
+// Do paths a and b name the same cache entry?  Empty and . components do
+// not count, so a.pgm and ./a.pgm are the same.
+static int samePath(const char* a, const char* b) {
+  if (*a == '/' || *b == '/') return strcmp(a, b) == 0;
+  for (a = skipDots(a), b = skipDots(b); *a != '\0' && *a == *b; ) {
+    if (*a == '/') {
+      a = skipDots(a);
+      b = skipDots(b);
+    } else {
+      a++;
+      b++;
+    }
   }
+  return *a == *b;
+}
 
-  ImageInit();
+// Return the cache entry for name, or NULL.
+// Requires: cacheLock is held.
+static struct cacheEntry* cacheFind(const char* name) {
+  struct cacheEntry* e = cache;
+  while (e != NULL && !samePath(e->name, name)) e = e->next;
+  return e;
+}
 
-  int err = 0;
-  int x, y, w, h;
+// Store img in the cache as name, replacing any previous image.
+// The cache takes ownership of img.  Returns 0 on allocation failure.
+static int cacheStore(const char* name, Image img) {
+  pthread_rwlock_wrlock(&cacheLock);
+  struct cacheEntry* e = cacheFind(name);
+  if (e == NULL && (e = malloc(sizeof(*e))) != NULL) {
+    if ((e->name = strdup(name)) == NULL) {
+      free(e);
+      e = NULL;
+    } else {
+      e->img = NULL;
+      e->next = cache;
+      cache = e;
+    }
+  }
+  if (e != NULL) {
+    ImageDestroy(&e->img);
+    e->img = img;
+  }
+  pthread_rwlock_unlock(&cacheLock);
+  return e != NULL;
+}
 
-  // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];     // the images
-  int n = 0;          // number of images created
+// Remove name from the cache.  Returns 0 if it was not there.
+static int cacheDrop(const char* name) {
+  pthread_rwlock_wrlock(&cacheLock);
+  struct cacheEntry** pe = &cache;
+  while (*pe != NULL && !samePath((*pe)->name, name)) pe = &(*pe)->next;
+  struct cacheEntry* e = *pe;
+  if (e != NULL) {
+    *pe = e->next;
+    ImageDestroy(&e->img);
+    free(e->name);
+    free(e);
+  }
+  pthread_rwlock_unlock(&cacheLock);
+  return e != NULL;
+}
+
+// Files being loaded into the cache, so that concurrent misses on the
+// same file wait for a single load (protected by loadLock).
+struct loading {
+  const char* name;
+  struct loading* next;
+};
 
-  int k = 1;
+static struct loading* loading = NULL;
+static pthread_mutex_t loadLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loadDone = PTHREAD_COND_INITIALIZER;
+
+// Get a copy of the cached image name into (*img).
+// Returns 0 if name is not in the cache.
+static int cacheCopy(const char* name, Image* img) {
+  pthread_rwlock_rdlock(&cacheLock);
+  struct cacheEntry* e = cacheFind(name);
+  if (e != NULL) *img = copyImage(e->img);
+  pthread_rwlock_unlock(&cacheLock);
+  return e != NULL;
+}
+
+// Is name being loaded?  Requires: loadLock is held.
+static int isLoading(const char* name) {
+  struct loading* l = loading;
+  while (l != NULL && !samePath(l->name, name)) l = l->next;
+  return l != NULL;
+}
+
+// Load image file (or get a copy from the cache, in server mode).
+static Image loadImage(const char* name) {
+  if (!serverMode) return ImageLoad(name);
+
+  Image img = NULL;
+  if (cacheCopy(name, &img)) return img;
+
+  // Miss: wait while another thread loads the same file
+  struct loading self = { name, NULL };
+  int hit;
+  pthread_mutex_lock(&loadLock);
+  while (!(hit = cacheCopy(name, &img)) && isLoading(name)) {
+    pthread_cond_wait(&loadDone, &loadLock);
+  }
+  if (!hit) {
+    self.next = loading;
+    loading = &self;
+  }
+  pthread_mutex_unlock(&loadLock);
+  if (hit) return img;
+
+  // Load from disk, and keep the pristine copy in the cache
+  img = ImageLoad(name);
+  if (img != NULL) {
+    Image cached = copyImage(img);
+    if (cached != NULL && !cacheStore(name, cached)) ImageDestroy(&cached);
+  }
+  pthread_mutex_lock(&loadLock);
+  struct loading** pl = &loading;
+  while (*pl != &self) pl = &(*pl)->next;
+  *pl = self.next;
+  pthread_cond_broadcast(&loadDone);
+  pthread_mutex_unlock(&loadLock);
+  return img;
+}
+
+// File name was written: drop its old image from the cache (in server mode).
+static void fileWritten(const char* name) {
+  if (serverMode) cacheDrop(name);
+}
+
+// Multi-image streams (not in batch or server mode)
+//
+// frame and append keep their files open until the program ends, so that
+// frames read in order, or appended to the same file, go through a single
+// buffered stream.
+// The name - is the standard input (for reading) or output (for writing),
+// and fd:N is the open descriptor N.
+// Images on stdin are read in sequence: it cannot be reopened to go back.
+
+struct stream {
+  char* name;
+  ImageReader r;    // for frame (or NULL)
+  int pos;          // number of the next frame of r
+  ImageWriter w;    // for append (or NULL)
+  struct stream* next;
+};
+
+static struct stream* streams = NULL;
+
+// Return the stream entry for name, adding it if needed (NULL on failure).
+static struct stream* streamFor(const char* name) {
+  struct stream* s = streams;
+  while (s != NULL && strcmp(s->name, name) != 0) s = s->next;
+  if (s == NULL && (s = calloc(1, sizeof(*s))) != NULL) {
+    if ((s->name = strdup(name)) == NULL) {
+      free(s);
+      return NULL;
+    }
+    s->next = streams;
+    streams = s;
+  }
+  return s;
+}
+
+// Is name the standard input/output?
+static int isStd(const char* name) {
+  return strcmp(name, "-") == 0;
+}
+
+// The descriptor N, if name is fd:N; otherwise, -1.
+static int fdNumber(const char* name) {
+  int fd, len = 0;
+  if (sscanf(name, "fd:%d%n", &fd, &len) != 1 || name[len] != '\0' || fd < 0) return -1;
+  return fd;
+}
+
+// Is name a stream (stdin/stdout or a descriptor), which cannot be reopened?
+static int isStream(const char* name) {
+  return isStd(name) || fdNumber(name) >= 0;
+}
+
+// Open a reader for file or stream name.
+static ImageReader openReader(const char* name) {
+  if (!isStream(name)) return ImageReaderOpen(name);
+  FILE* f = isStd(name) ? stdin : fdopen(fdNumber(name), "rb");
+  if (f == NULL) return NULL;
+  setvbuf(f, NULL, _IONBF, 0);   // (the reader buffers; pixels are read in place)
+  return ImageReaderFromFile(f);
+}
+
+// Load frame k of file name (or the next frame, if k < 0).
+// The reader is reused if it has not gone past frame k; otherwise, the
+// file is opened again.
+// A descriptor with a sealed shared memory file holds one exported image
+// (see ImageExport), which is imported without copying.
+static Image loadFrame(const char* name, int k) {
+  int fd = fdNumber(name);
+  int seals = (fd >= 0) ? fcntl(fd, F_GET_SEALS) : -1;
+  if (seals >= 0 && (seals & F_SEAL_WRITE)) {
+    if (k > 0) { errno = ESPIPE; return NULL; }
+    return ImageImport(fd);
+  }
+  struct stream* s = streamFor(name);
+  if (s == NULL) return NULL;
+  if (k < 0) k = s->pos;
+  if (s->r != NULL && s->pos > k) {
+    if (isStream(name)) { errno = ESPIPE; return NULL; }
+    ImageReaderClose(&s->r);
+  }
+  if (s->r == NULL) {
+    if ((s->r = openReader(name)) == NULL) return NULL;
+    s->pos = 0;
+  }
+  while (s->pos < k && ImageReaderSkip(s->r)) s->pos++;
+  Image img = (s->pos == k) ? ImageReaderNext(s->r) : NULL;
+  if (img == NULL && isStream(name)) {
+    s->pos = INT_MAX;   // (position unknown)
+  } else if (img == NULL) {
+    int errnum = errno;
+    ImageReaderClose(&s->r);   // (position unknown)
+    errno = errnum;
+  } else {
+    s->pos++;
+  }
+  return img;
+}
+
+// Does file name have a frame k, following the frames read so far?
+static int moreFrames(const char* name, int k) {
+  struct stream* s = streamFor(name);
+  return s != NULL && s->r != NULL && s->pos == k && !ImageReaderDone(s->r);
+}
+
+// Append img to file name (truncated on the first append).
+static int appendFrame(const char* name, Image img) {
+  struct stream* s = streamFor(name);
+  if (s == NULL) return 0;
+  if (s->w == NULL) {
+    if (isStd(name)) {
+      s->w = ImageWriterFromFile(stdout);
+    } else if (isStream(name)) {
+      FILE* f = fdopen(fdNumber(name), "wb");
+      if (f == NULL) return 0;
+      s->w = ImageWriterFromFile(f);
+    } else {
+      s->w = ImageWriterOpen(name);
+    }
+    if (s->w == NULL) return 0;
+  }
+  return ImageWriterPut(s->w, img);
+}
+
+// Save img to file or stream name.
+// A descriptor with an empty shared memory file that can be sealed gets
+// img exported (see ImageExport); other streams get a PGM image appended.
+static int saveImage(const char* name, Image img) {
+  if (!isStream(name)) return ImageSave(img, name);
+  int fd = fdNumber(name);
+  int seals = (fd >= 0) ? fcntl(fd, F_GET_SEALS) : -1;
+  struct stat st;
+  if (seals >= 0 && !(seals & F_SEAL_SEAL) && fstat(fd, &st) == 0 && st.st_size == 0) {
+    return ImageExportTo(img, fd);
+  }
+  return appendFrame(name, img);
+}
+
+// Close all streams.  Returns 0 if writing buffered frames failed.
+static int closeStreams(void) {
+  int success = 1;
+  while (streams != NULL) {
+    struct stream* s = streams;
+    streams = s->next;
+    ImageReaderClose(&s->r);
+    success = ImageWriterClose(&s->w) && success;
+    free(s->name);
+    free(s);
+  }
+  return success;
+}
+
+// Deferred execution
+//
+// runPipeline does not run operations as it reads them.  First, it parses
+// the arguments into a plan: a list of operations, where each operation
+// refers to the images it reads, modifies or creates by their position in
+// the buffer.  Each image is created by one operation and used by later
+// ones, so the plan is a DAG.  Then, the plan is optimized:
+//  - Operations whose result is never used (by save, info, locate, keep,
+//    or another operation that is run) are skipped.
+//    Files are always loaded, so that load errors are still reported.
+//  - Consecutive point operations (neg, thr, bri) on the same image are
+//    fused into a single look-up table pass.  Point operations right after
+//    a crop, or right before a crop that is the last use of their image,
+//    are applied to the cropped image only.
+//  - Each image is destroyed right after its last use.
+// Errors are reported as before: operations before an invalid argument
+// still run, and rectangle checks are done (on image sizes) even for
+// operations that are skipped.
+
+enum opKind {
+  OP_LOAD, OP_FRAME, OP_SAVE, OP_SAVEA, OP_SAVER, OP_SAVEP, OP_APPEND, OP_INFO, OP_TIC, OP_TOC,
+  OP_NEG, OP_THR, OP_BRI, OP_EQUALIZE, OP_AUTOTHR,
+  OP_CREATE, OP_ROTATE, OP_MIRROR, OP_FLIP, OP_CROP, OP_RESIZE, OP_IMIRROR, OP_IFLIP,
+  OP_TILE, OP_RASTER, OP_NEGRLE, OP_THRRLE, OP_LOCRLE,
+  OP_PASTE, OP_BLEND, OP_LOCATE, OP_FIND, OP_BLUR, OP_GAUSS, OP_MEDIAN,
+  OP_ERODE, OP_DILATE, OP_OPEN, OP_CLOSE, OP_KEEP, OP_DROP
+};
+
+struct op {
+  enum opKind kind;
+  int k;              // index of the operation in av[]
+  const char* name;   // file or cache name operand (or NULL)
+  const char* from;   // file read by negrle and thrrle (or NULL)
+  int in1, in2;       // images read (or -1)
+  int out;            // image created or modified (or -1)
+  int x, y, w, h;     // operands
+  double value;       // factor, alpha or sigma operand
+  uint8 level;        // threshold operand
+  ImageMetric metric; // find operand
+  int roi;            // restricted to rect (op@X,Y,W,H)?
+  struct { int x, y, w, h; } rect;
+  int needed;         // is the result used?
+  int deferTo;        // op that runs this one (for fused ops), or -1
+};
+
+// Does this operation create its out image (rather than modify it)?
+static int creates(const struct op* op) {
+  return op->kind == OP_LOAD || op->kind == OP_FRAME || op->kind == OP_CREATE || op->kind == OP_ROTATE ||
+         op->kind == OP_MIRROR || op->kind == OP_FLIP || op->kind == OP_CROP ||
+         op->kind == OP_RESIZE;
+}
+
+// Does this operation write a file?
+static int writes(const struct op* op) {
+  return op->kind == OP_SAVE || op->kind == OP_SAVEA || op->kind == OP_SAVER ||
+         op->kind == OP_SAVEP || op->kind == OP_APPEND || op->kind == OP_NEGRLE ||
+         op->kind == OP_THRRLE;
+}
+
+// Does this operation read the file op->name?  (negrle and thrrle also
+// read op->from.)
+static int reads(const struct op* op) {
+  return op->kind == OP_LOAD || op->kind == OP_LOCRLE;
+}
+
+// May the server read or write file name?  Only relative paths without ..
+// components are allowed, so that files stay in the server directory.
+static int serverPath(const char* name) {
+  if (name[0] == '/') return 0;
+  for (const char* p = name; p != NULL; p = strchr(p, '/')) {
+    if (*p == '/') p++;
+    if (strncmp(p, "..", 2) == 0 && (p[2] == '/' || p[2] == '\0')) return 0;
+  }
+  return 1;
+}
+
+// Is this operation a fusable point operation (on the whole image)?
+static int isPoint(const struct op* op) {
+  return (op->kind == OP_NEG || op->kind == OP_THR || op->kind == OP_BRI) && !op->roi;
+}
+
+// Same test as ImageValidRect, on an image of size W x H.
+static int validRect(int W, int H, int x, int y, int w, int h) {
+  return (0 <= x && x <= W && 0 <= w && w <= W - x) && (0 <= y && y <= H && 0 <= h && h <= H - y);
+}
+
+// Operations that may be restricted to a rectangle (op@X,Y,W,H)
+static const char* rectOps[] = { "neg", "thr", "bri", "blur" };
+
+// If arg is op@RECT, for one of rectOps, return op and set *rect to RECT.
+// Otherwise, return arg and set *rect to NULL.
+static const char* splitRect(const char* arg, const char** rect) {
+  *rect = NULL;
+  const char* at = strchr(arg, '@');
+  if (at == NULL) return arg;
+  for (size_t i = 0; i < sizeof(rectOps) / sizeof(rectOps[0]); i++) {
+    size_t n = strlen(rectOps[i]);
+    if ((size_t)(at - arg) == n && strncmp(arg, rectOps[i], n) == 0) {
+      *rect = at + 1;
+      return rectOps[i];
+    }
+  }
+  return arg;
+}
+
+// Parse av[k..ac-1] into ops[], simulating the buffer size n.
+// Stops at the first invalid argument.
+// Returns 0 or the errors[] code for that argument; *pnops is set to the
+// number of (valid) operations parsed.
+static int parsePipeline(int ac, char* av[], int k, struct op ops[], int* pnops) {
+  int err = 0;
+  int n = 0;
+  int nops = 0;
   while (k < ac) {
+    struct op* op = &ops[nops];
+    memset(op, 0, sizeof(*op));
+    op->k = k;
+    op->in1 = op->in2 = op->out = -1;
+    op->deferTo = -1;
+    const char* rect;
+    const char* word = splitRect(av[k], &rect);
+    if (rect != NULL) {
+      if (sscanf(rect, "%d,%d,%d,%d", &op->rect.x, &op->rect.y, &op->rect.w, &op->rect.h) != 4) { err = 5; break; }
+      if (op->rect.w < 0 || op->rect.h < 0) { err = 5; break; }   // precondition check!
+      op->roi = 1;
+    }
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Info on I%d\n", n-1);
-      uint8 min, max;
-      w = ImageWidth(img[n-1]);
-      h = ImageHeight(img[n-1]);
-      uint8 maxval = ImageMaxval(img[n-1]);
-      ImageStats(img[n-1], &min, &max);
-      printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
-      printf("# Gray level range: [%hhu, %hhu]\n", min, max);
+      op->kind = OP_INFO; op->in1 = n-1;
     } else if (strcmp(av[k], "tic") == 0) {
-      InstrReset();
+      op->kind = OP_TIC;
     } else if (strcmp(av[k], "toc") == 0) {
-      InstrPrint();
-    } else if (strcmp(av[k], "neg") == 0) {
+      op->kind = OP_TOC;
+    } else if (strcmp(word, "neg") == 0) {
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
-    } else if (strcmp(av[k], "thr") == 0) {
+      op->kind = OP_NEG; op->out = n-1;
+    } else if (strcmp(word, "thr") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      uint8 thr;
-      if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
-      fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
-    } else if (strcmp(av[k], "bri") == 0) {
+      if (sscanf(av[k], "%hhu", &op->level) != 1) { err = 5; break; }
+      op->kind = OP_THR; op->out = n-1;
+    } else if (strcmp(word, "bri") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      double factor;
-      if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
-      fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
+      if (sscanf(av[k], "%lf", &op->value) != 1) { err = 5; break; }
+      if (op->value < 0.0) { err = 5; break; }   // precondition check!
+      op->kind = OP_BRI; op->out = n-1;
+    } else if (strcmp(av[k], "equalize") == 0) {
+      if (n < 1) { err = 2; break; }
+      op->kind = OP_EQUALIZE; op->out = n-1;
+    } else if (strcmp(av[k], "autothr") == 0) {
+      if (n < 1) { err = 2; break; }
+      op->kind = OP_AUTOTHR; op->out = n-1;
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n >= N) { err = 3; break; }
-      if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
-      if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
-      img[n] = ImageCreate(w, h, PixMax);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "rotate") == 0) {
+      if (sscanf(av[k], "%d,%d", &op->w, &op->h) != 2) { err = 5; break; }
+      if (op->w < 0 || op->h < 0) { err = 5; break; }   // precondition check!
+      op->kind = OP_CREATE; op->out = n++;
+    } else if (strcmp(av[k], "rotate") == 0 || strcmp(av[k], "mirror") == 0 ||
+               strcmp(av[k], "flip") == 0) {
       if (n < 1) { err = 2; break; }
       if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Rotating I%d -> I%d\n", n-1, n);
-      img[n] = ImageRotate(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "mirror") == 0) {
+      op->kind = (av[k][0] == 'r') ? OP_ROTATE : (av[k][0] == 'm') ? OP_MIRROR : OP_FLIP;
+      op->in1 = n-1; op->out = n++;
+    } else if (strcmp(av[k], "imirror") == 0 || strcmp(av[k], "iflip") == 0) {
       if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Mirroring I%d -> I%d\n", n-1, n);
-      img[n] = ImageMirror(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+      op->kind = (av[k][1] == 'm') ? OP_IMIRROR : OP_IFLIP;
+      op->out = n-1;
+    } else if (strcmp(av[k], "tile") == 0 || strcmp(av[k], "raster") == 0) {
+      if (n < 1) { err = 2; break; }
+      op->kind = (av[k][0] == 't') ? OP_TILE : OP_RASTER;
+      op->out = n-1;
     } else if (strcmp(av[k], "crop") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       if (n >= N) { err = 3; break; }
-      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
-      img[n] = ImageCrop(img[n-1], x, y, w, h);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+      if (sscanf(av[k], "%d,%d,%d,%d", &op->x, &op->y, &op->w, &op->h) != 4) { err = 5; break; }
+      if (op->w < 0 || op->h < 0) { err = 5; break; }   // precondition check!
+      op->kind = OP_CROP; op->in1 = n-1; op->out = n++;
+    } else if (strcmp(av[k], "resize") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      if (sscanf(av[k], "%d,%d", &op->w, &op->h) != 2) { err = 5; break; }
+      if (op->w <= 0 || op->h <= 0) { err = 5; break; }   // precondition check!
+      op->kind = OP_RESIZE; op->in1 = n-1; op->out = n++;
     } else if (strcmp(av[k], "paste") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
-      if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
-      ImagePaste(img[n-1], x, y, img[n-2]);
+      if (sscanf(av[k], "%d,%d", &op->x, &op->y) != 2) { err = 5; break; }
+      op->kind = OP_PASTE; op->in1 = n-2; op->out = n-1;
     } else if (strcmp(av[k], "blend") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
-      double alpha;
-      if (sscanf(av[k], "%d,%d,%lf", &x, &y, &alpha) != 3) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
-      ImageBlend(img[n-1], x, y, img[n-2], alpha);
+      if (sscanf(av[k], "%d,%d,%lf", &op->x, &op->y, &op->value) != 3) { err = 5; break; }
+      op->kind = OP_BLEND; op->in1 = n-2; op->out = n-1;
     } else if (strcmp(av[k], "locate") == 0) {
       if (n < 2) { err = 2; break; }
-      fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
-      if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
-        printf("# FOUND (%d,%d)\n", x, y);
-      } else {
-        printf("# NOTFOUND\n");
-      }
-    } else if (strcmp(av[k], "blur") == 0) {
+      op->kind = OP_LOCATE; op->in1 = n-2; op->in2 = n-1;
+    } else if (strcmp(av[k], "find") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      if (strcmp(av[k], "sad") == 0) op->metric = IMAGE_SAD;
+      else if (strcmp(av[k], "ncc") == 0) op->metric = IMAGE_NCC;
+      else { err = 5; break; }
+      op->kind = OP_FIND; op->in1 = n-2; op->in2 = n-1;
+    } else if (strcmp(word, "blur") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (sscanf(av[k], "%d,%d", &op->x, &op->y) != 2) { err = 5; break; }
+      if (op->x < 0 || op->y < 0) { err = 5; break; }   // precondition check!
+      op->kind = OP_BLUR; op->out = n-1;
+    } else if (strcmp(av[k], "gauss") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (sscanf(av[k], "%lf", &op->value) != 1 || !(op->value >= 0.0)) { err = 5; break; }
+      op->kind = OP_GAUSS; op->out = n-1;
+    } else if (strcmp(av[k], "median") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (sscanf(av[k], "%d,%d", &op->x, &op->y) != 2) { err = 5; break; }
+      if (op->x < 0 || op->y < 0 || op->y >= 32768) { err = 5; break; }
+      op->kind = OP_MEDIAN; op->out = n-1;
+    } else if (strcmp(av[k], "erode") == 0 || strcmp(av[k], "dilate") == 0 ||
+               strcmp(av[k], "open") == 0 || strcmp(av[k], "close") == 0) {
+      const char* name = av[k];
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      int dx; int dy;
-      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
-      fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
-      ImageBlur(img[n-1], dx, dy);
+      if (sscanf(av[k], "%d,%d", &op->x, &op->y) != 2) { err = 5; break; }
+      if (op->x < 0 || op->y < 0) { err = 5; break; }
+      op->kind = (name[0] == 'e') ? OP_ERODE : (name[0] == 'd') ? OP_DILATE :
+                 (name[0] == 'o') ? OP_OPEN : OP_CLOSE;
+      op->out = n-1;
+    } else if (strcmp(av[k], "keep") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (!serverMode) { err = 8; break; }
+      op->kind = OP_KEEP; op->in1 = n-1; op->name = av[k];
+    } else if (strcmp(av[k], "drop") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (!serverMode) { err = 8; break; }
+      op->kind = OP_DROP; op->name = av[k];
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
-      if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
+      if (batchMode && isStream(av[k])) { err = 11; break; }
+      op->kind = OP_SAVE; op->in1 = n-1; op->name = av[k];
+    } else if (strcmp(av[k], "saveascii") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      op->kind = OP_SAVEA; op->in1 = n-1; op->name = av[k];
+    } else if (strcmp(av[k], "saverle") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      op->kind = OP_SAVER; op->in1 = n-1; op->name = av[k];
+    } else if (strcmp(av[k], "savepbm") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      op->kind = OP_SAVEP; op->in1 = n-1; op->name = av[k];
+    } else if (strcmp(av[k], "negrle") == 0) {
+      if (k + 2 >= ac) { err = 1; break; }
+      op->kind = OP_NEGRLE; op->from = av[++k]; op->name = av[++k];
+    } else if (strcmp(av[k], "thrrle") == 0) {
+      if (k + 3 >= ac) { err = 1; break; }
+      if (sscanf(av[++k], "%hhu", &op->level) != 1) { err = 5; break; }
+      op->kind = OP_THRRLE; op->from = av[++k]; op->name = av[++k];
+    } else if (strcmp(av[k], "locaterle") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      op->kind = OP_LOCRLE; op->in1 = n-1; op->name = av[k];
+    } else if (strcmp(av[k], "frame") == 0) {
+      if (k + 2 >= ac) { err = 1; break; }
+      if (n >= N) { err = 3; break; }
+      if (sscanf(av[++k], "%d", &op->x) != 1 || op->x < 0) { err = 5; break; }
+      if (batchMode) { err = 11; break; }
+      op->kind = OP_FRAME; op->out = n++; op->name = av[++k];
+    } else if (strcmp(av[k], "append") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (batchMode) { err = 11; break; }
+      op->kind = OP_APPEND; op->in1 = n-1; op->name = av[k];
+    } else if (isStream(av[k])) {  // next image on stdin or descriptor
+      if (n >= N) { err = 3; break; }
+      if (batchMode) { err = 11; break; }
+      op->kind = OP_FRAME; op->x = -1; op->out = n++; op->name = av[k];
     } else {  // image file
       if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+      op->kind = OP_LOAD; op->out = n++; op->name = av[k];
+    }
+    if (serverMode && (((writes(op) || reads(op)) && !serverPath(op->name)) ||
+                       ((op->kind == OP_NEGRLE || op->kind == OP_THRRLE) && !serverPath(op->from)))) {
+      err = 12; break;
     }
+    nops++;
     k++;
   }
-  
-  // Destroy remaining images
+  *pnops = nops;
+  return err;
+}
+
+// Decide which operations are needed, which are fused, and the last use
+// of each image (lastUse[i] is the index of the last op using image i).
+static void optimizePipeline(struct op ops[], int nops, int lastUse[N]) {
+  // Backward pass: an image is live if a later needed op reads it
+  int live[N] = {0};
+  for (int i = nops-1; i >= 0; i--) {
+    struct op* op = &ops[i];
+    if (creates(op)) {
+      op->needed = live[op->out] || op->kind == OP_LOAD || op->kind == OP_FRAME;
+      live[op->out] = 0;
+    } else if (op->out >= 0) {
+      op->needed = live[op->out];   // modified image still live before
+    } else {
+      op->needed = 1;   // output or other side effects
+    }
+    if (op->needed) {
+      if (op->in1 >= 0) live[op->in1] = 1;
+      if (op->in2 >= 0) live[op->in2] = 1;
+    }
+  }
+
+  // Forward pass: last uses
+  for (int i = 0; i < N; i++) lastUse[i] = -1;
+  for (int i = 0; i < nops; i++) {
+    struct op* op = &ops[i];
+    if (!op->needed) continue;
+    if (op->in1 >= 0) lastUse[op->in1] = i;
+    if (op->in2 >= 0) lastUse[op->in2] = i;
+    if (op->out >= 0) lastUse[op->out] = i;
+  }
+
+  // Fusion of point operations (considering needed ops only)
+  int idx[nops > 0 ? nops : 1];
+  int m = 0;
+  for (int i = 0; i < nops; i++) {
+    if (ops[i].needed) idx[m++] = i;
+  }
+  for (int j = 0; j < m; j++) {
+    struct op* op = &ops[idx[j]];
+    if (isPoint(op) && op->deferTo < 0) {
+      // Group consecutive point operations on the same image
+      int jj = j + 1;
+      while (jj < m && isPoint(&ops[idx[jj]]) && ops[idx[jj]].out == op->out) {
+        ops[idx[jj++]].deferTo = idx[j];
+      }
+      // Followed by a crop that is the last use of the image?
+      if (jj < m && ops[idx[jj]].kind == OP_CROP && ops[idx[jj]].in1 == op->out &&
+          lastUse[op->out] == idx[jj]) {
+        for (int g = j; g < jj; g++) ops[idx[g]].deferTo = idx[jj];
+      }
+    } else if (op->kind == OP_CROP) {
+      // Point operations on the cropped image
+      for (int jj = j + 1; jj < m && isPoint(&ops[idx[jj]]) && ops[idx[jj]].out == op->out; jj++) {
+        ops[idx[jj]].deferTo = idx[j];
+      }
+    }
+  }
+}
+
+// Apply point operation op to img (or to its rectangle).
+static void applyPoint(const struct op* op, Image img) {
+  int x = op->rect.x, y = op->rect.y, w = op->rect.w, h = op->rect.h;
+  switch (op->kind) {
+  case OP_NEG:
+    if (op->roi) ImageNegativeRect(img, x, y, w, h);
+    else ImageNegative(img);
+    break;
+  case OP_THR:
+    if (op->roi) ImageThresholdRect(img, x, y, w, h, op->level);
+    else ImageThreshold(img, op->level);
+    break;
+  case OP_BRI:
+    if (op->roi) ImageBrightenRect(img, x, y, w, h, op->value);
+    else ImageBrighten(img, op->value);
+    break;
+  default: assert(0);
+  }
+}
+
+// Apply to img the point operations that are run by op number i,
+// (op i itself, if it is a point operation, and those deferred to it).
+// The operations are composed into a single table, by applying them to a
+// ramp with all 256 levels, and the table is applied to img in one pass.
+// (16-bit images get the operations one at a time.)
+// Returns 0 on success, or an errors[] code.
+static int runPointOps(struct op ops[], int nops, int i, Image img) {
+  int count = 0;
+  for (int j = 0; j < nops; j++) {
+    if (j == i ? isPoint(&ops[j]) : ops[j].deferTo == i) {
+      if (ImageDepth(img) == 16 && ops[j].kind == OP_THR) return 10;
+      count++;
+    }
+  }
+  if (count == 0) return 0;
+  if (ImageDepth(img) == 16 || (count == 1 && isPoint(&ops[i]))) {   // nothing to fuse
+    for (int j = 0; j < nops; j++) {
+      if (j == i ? isPoint(&ops[j]) : ops[j].deferTo == i) applyPoint(&ops[j], img);
+    }
+    return 0;
+  }
+  Image ramp = ImageCreate(256, 1, (uint8)ImageMaxval(img));
+  if (ramp == NULL) return 4;
+  for (int v = 0; v < 256; v++) ImageSetPixel(ramp, v, 0, (uint8)v);
+  for (int j = 0; j < nops; j++) {
+    if (j == i ? isPoint(&ops[j]) : ops[j].deferTo == i) applyPoint(&ops[j], ramp);
+  }
+  uint8 lut[256];
+  for (int v = 0; v < 256; v++) lut[v] = ImageGetPixel(ramp, v, 0);
+  ImageDestroy(&ramp);
+  ImageApplyLUT(img, lut);
+  return 0;
+}
+
+// Can op be applied to 16-bit images?
+static int accepts16(const struct op* op) {
+  switch (op->kind) {
+  case OP_LOAD: case OP_FRAME: case OP_SAVE: case OP_SAVEA: case OP_APPEND:
+  case OP_INFO: case OP_TIC: case OP_TOC: case OP_NEG: case OP_BRI: case OP_CREATE:
+  case OP_ROTATE: case OP_MIRROR: case OP_FLIP: case OP_IMIRROR: case OP_IFLIP:
+  case OP_CROP: case OP_PASTE: case OP_RASTER: case OP_KEEP: case OP_DROP:
+    return 1;
+  case OP_BLUR:
+    return !op->roi;
+  default:
+    return 0;
+  }
+}
+
+// Is image number i of img[] a 16-bit image?
+static int is16(Image img[], int i) {
+  return i >= 0 && img[i] != NULL && ImageDepth(img[i]) == 16;
+}
+
+// Print a progress message for op.
+static void noteOp(const struct op* op) {
+  char rect[64] = "";
+  if (op->roi) snprintf(rect, sizeof(rect), " (%d,%d,%d,%d)", op->rect.x, op->rect.y, op->rect.w, op->rect.h);
+  switch (op->kind) {
+  case OP_LOAD: note("Loading %s -> I%d\n", op->name, op->out); break;
+  case OP_SAVE: note("Saving %s <- I%d\n", op->name, op->in1); break;
+  case OP_SAVEA: note("Saving %s (ASCII) <- I%d\n", op->name, op->in1); break;
+  case OP_SAVER: note("Saving %s (run-length) <- I%d\n", op->name, op->in1); break;
+  case OP_SAVEP: note("Saving %s (bitmap) <- I%d\n", op->name, op->in1); break;
+  case OP_FRAME:
+    if (op->x < 0) note("Loading %s -> I%d\n", isStd(op->name) ? "stdin" : op->name, op->out);
+    else note("Loading %s frame %d -> I%d\n", op->name, op->x, op->out);
+    break;
+  case OP_APPEND: note("Appending I%d to %s\n", op->in1, op->name); break;
+  case OP_INFO: note("Info on I%d\n", op->in1); break;
+  case OP_NEG: note("Negating I%d%s\n", op->out, rect); break;
+  case OP_THR: note("Thresholding I%d%s at %d\n", op->out, rect, op->level); break;
+  case OP_BRI: note("Brightening I%d%s by %lf\n", op->out, rect, op->value); break;
+  case OP_EQUALIZE: note("Equalizing I%d\n", op->out); break;
+  case OP_CREATE: note("Creating black image (%d,%d) -> I%d\n", op->w, op->h, op->out); break;
+  case OP_ROTATE: note("Rotating I%d -> I%d\n", op->in1, op->out); break;
+  case OP_MIRROR: note("Mirroring I%d -> I%d\n", op->in1, op->out); break;
+  case OP_FLIP: note("Flipping I%d -> I%d\n", op->in1, op->out); break;
+  case OP_IMIRROR: note("Mirroring I%d in place\n", op->out); break;
+  case OP_IFLIP: note("Flipping I%d in place\n", op->out); break;
+  case OP_TILE: note("Tiling I%d\n", op->out); break;
+  case OP_RASTER: note("Converting I%d to raster\n", op->out); break;
+  case OP_RESIZE: note("Resizing I%d to %dx%d -> I%d\n", op->in1, op->w, op->h, op->out); break;
+  case OP_CROP: note("Cropping I%d (%d,%d,%d,%d) -> I%d\n", op->in1, op->x, op->y, op->w, op->h, op->out); break;
+  case OP_PASTE: note("Pasting I%d at I%d (%d,%d)\n", op->in1, op->out, op->x, op->y); break;
+  case OP_BLEND: note("Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", op->in1, op->out, op->x, op->y, op->value); break;
+  case OP_LOCATE: note("Locating I%d in I%d\n", op->in1, op->in2); break;
+  case OP_NEGRLE: note("Negating %s -> %s\n", op->from, op->name); break;
+  case OP_THRRLE: note("Thresholding %s at %d -> %s\n", op->from, op->level, op->name); break;
+  case OP_LOCRLE: note("Locating I%d in %s\n", op->in1, op->name); break;
+  case OP_FIND: note("Finding I%d in I%d\n", op->in1, op->in2); break;
+  case OP_BLUR: note("Blur I%d%s with %dx%d mean filter\n", op->out, rect, 2*op->x+1, 2*op->y+1); break;
+  case OP_MEDIAN: note("Median filter I%d with %dx%d window\n", op->out, 2*op->x+1, 2*op->y+1); break;
+  case OP_ERODE: note("Erode I%d with %dx%d rectangle\n", op->out, 2*op->x+1, 2*op->y+1); break;
+  case OP_DILATE: note("Dilate I%d with %dx%d rectangle\n", op->out, 2*op->x+1, 2*op->y+1); break;
+  case OP_OPEN: note("Open I%d with %dx%d rectangle\n", op->out, 2*op->x+1, 2*op->y+1); break;
+  case OP_CLOSE: note("Close I%d with %dx%d rectangle\n", op->out, 2*op->x+1, 2*op->y+1); break;
+  case OP_GAUSS: note("Blur I%d with Gaussian filter, sigma %lf\n", op->out, op->value); break;
+  case OP_KEEP: note("Keeping I%d as %s\n", op->in1, op->name); break;
+  case OP_DROP: note("Dropping %s\n", op->name); break;
+  default: break;
+  }
+}
+
+// Background I/O (not in batch or server mode)
+//
+// Once a pipeline is planned, the next file to load is loaded while the
+// operations before it run, and saves are done while later operations
+// run, by an I/O thread that takes jobs in order.  Only one file is loaded
+// ahead at a time, so that images are not held before they are needed.  The results are observed as if each op ran in its turn:
+//  - A load op waits for its own job.
+//  - Pending saves of an image complete before it is modified or freed
+//    (an image saved on its last use is freed by the I/O thread).
+//  - Pending saves complete before any op with effects outside the
+//    pipeline (output, saves, ...), before files are loaded in their
+//    turn, and at the end; if one failed, it is
+//    reported as the error of that save, and later ops with effects are
+//    not run.
+// A file is not loaded ahead if an earlier op saves to it, or if it is
+// loaded after a tic (so that toc counts its loading).
+
+// Save img to a PBM file: levels below half of maxval become black.
+static int savePBM(Image img, const char* name) {
+  BitImage b = BitImageFromImage(img, (uint8)((ImageMaxval(img) + 1) / 2));
+  int success = b != NULL && BitImageSave(b, name);
+  BitImageDestroy(&b);
+  return success;
+}
+
+struct ioJob {
+  enum opKind kind;   // OP_LOAD or a save op (OP_SAVE, ..., OP_SAVEP)
+  const char* name;
+  Image img;          // image loaded, or to save
+  int own;            // destroy img after saving?
+  int ok;             // did it succeed?
+  int errnum;         // errno and error cause, on failure
+  const char* cause;
+};
+
+struct ioQueue {
+  int active;               // is background I/O in use?
+  pthread_t tid;
+  int started;              // is the thread running?
+  pthread_mutex_t lock;
+  pthread_cond_t cond;      // signals submitted and completed jobs
+  struct ioJob* job;        // jobs, by op index
+  int* order;               // op indices of the jobs, in submission order
+  int* pos;                 // position of each op's job in order[] (or -1)
+  int submitted, completed;
+  int quit;
+};
+
+// Error cause of a failed background job, reported instead of ImageErrMsg
+// (the cause is kept per thread).
+static _Thread_local const char* ioCause = NULL;
+
+// Error cause of the last failure in this thread.
+static const char* errMsg(void) {
+  return ioCause != NULL ? ioCause : ImageErrMsg();
+}
+
+static void* ioThread(void* arg) {
+  struct ioQueue* q = (struct ioQueue*)arg;
+  pthread_mutex_lock(&q->lock);
+  for (;;) {
+    while (q->completed == q->submitted && !q->quit) pthread_cond_wait(&q->cond, &q->lock);
+    if (q->completed == q->submitted) break;
+    struct ioJob* j = &q->job[q->order[q->completed]];
+    pthread_mutex_unlock(&q->lock);
+    errno = 0;
+    switch (j->kind) {
+    case OP_LOAD: j->img = ImageLoad(j->name); j->ok = j->img != NULL; break;
+    case OP_SAVE: j->ok = ImageSave(j->img, j->name); break;
+    case OP_SAVEA: j->ok = ImageSaveAscii(j->img, j->name); break;
+    case OP_SAVER: j->ok = ImageSaveRLE(j->img, j->name); break;
+    default: j->ok = savePBM(j->img, j->name); break;
+    }
+    if (j->kind != OP_LOAD && j->ok) fileWritten(j->name);
+    j->errnum = errno;
+    j->cause = ImageErrMsg();
+    if (j->own) ImageDestroy(&j->img);
+    pthread_mutex_lock(&q->lock);
+    q->completed++;
+    pthread_cond_broadcast(&q->cond);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+// Submit the job of op i.  Returns 0 if the I/O thread cannot be started
+// (and then the job must be done in place).
+static int ioSubmit(struct ioQueue* q, int i) {
+  if (!q->started) {
+    if (pthread_create(&q->tid, NULL, ioThread, q) != 0) return 0;
+    q->started = 1;
+  }
+  pthread_mutex_lock(&q->lock);
+  q->pos[i] = q->submitted;
+  q->order[q->submitted++] = i;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+  return 1;
+}
+
+// Wait for the job of op i (if any).
+static void ioWait(struct ioQueue* q, int i) {
+  if (i < 0 || q->pos[i] < 0) return;
+  pthread_mutex_lock(&q->lock);
+  while (q->completed <= q->pos[i]) pthread_cond_wait(&q->cond, &q->lock);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// Wait for all jobs; returns the op index of the first failed save, or -1.
+static int ioSync(struct ioQueue* q) {
+  if (!q->started) return -1;
+  pthread_mutex_lock(&q->lock);
+  while (q->completed < q->submitted) pthread_cond_wait(&q->cond, &q->lock);
+  pthread_mutex_unlock(&q->lock);
+  for (int p = 0; p < q->submitted; p++) {
+    struct ioJob* j = &q->job[q->order[p]];
+    if (j->kind != OP_LOAD && !j->ok) return q->order[p];
+  }
+  return -1;
+}
+
+// Adopt the errno and error cause of the job of op i.
+static void ioFailure(struct ioQueue* q, int i) {
+  ioCause = q->job[i].cause;
+  errno = q->job[i].errnum;
+}
+
+// May name and other refer to the same file?  (If either does not exist
+// yet, it may be created by the write, under another name.)
+static int sameFile(const char* name, const char* other) {
+  struct stat a, b;
+  if (strcmp(name, other) == 0) return 1;
+  int saved = errno;   // (the final report shows errno)
+  int same = stat(name, &a) != 0 || stat(other, &b) != 0 || (a.st_dev == b.st_dev && a.st_ino == b.st_ino);
+  errno = saved;
+  return same;
+}
+
+// Can the file of load op i be loaded ahead (is it not written before,
+// nor loaded after a tic)?
+static int canPrefetch(const struct op ops[], int i) {
+  if (!ops[i].needed) return 0;
+  for (int j = 0; j < i; j++) {
+    if (ops[j].kind == OP_TIC) return 0;
+    if (writes(&ops[j]) && sameFile(ops[i].name, ops[j].name)) return 0;
+  }
+  return 1;
+}
+
+// Process arguments av[k], ..., av[ac-1] from left to right,
+// creating images in the buffer img[], which must be empty (*pn == 0).
+// Results of info and locate are printed to out, preceded by label,
+// if label is not NULL.
+// Returns 0 on success, or the (errors[]) code of the first failure.
+// On return, (*pn) is the number of buffer positions used; the caller must
+// destroy img[0..(*pn)-1] (some may already be NULL), even on failure.
+static int runPipeline(int ac, char* av[], int k, Image img[], int* pn,
+                       FILE* out, const char* label) {
+  assert (*pn == 0);
+  // (on the heap: pipelines may be long, and run in threads with small stacks)
+  size_t maxops = (size_t)(ac - k + 1);
+  struct op* ops = malloc(maxops * sizeof(struct op));
+  struct ioJob* jobs = malloc(maxops * sizeof(struct ioJob));
+  int* order = malloc(maxops * sizeof(int));
+  int* pos = malloc(maxops * sizeof(int));
+  if (ops == NULL || jobs == NULL || order == NULL || pos == NULL) {
+    free(ops); free(jobs); free(order); free(pos);
+    ioCause = "Memory allocation failed";
+    errno = ENOMEM;
+    return 4;
+  }
+  int nops;
+  int parseErr = parsePipeline(ac, av, k, ops, &nops);
+  // Images saved to stdout must not be mixed with text: send it to stderr
+  for (int i = 0; i < nops && out == stdout; i++) {
+    if (writes(&ops[i]) && (isStd(ops[i].name) || fdNumber(ops[i].name) == STDOUT_FILENO)) out = stderr;
+  }
+  int lastUse[N];
+  optimizePipeline(ops, nops, lastUse);
+
+  int err = 0;
+  int x, y, w, h;
+  int n = 0;          // number of images created (or skipped)
+  int W[N], H[N];     // image sizes (known even for skipped images)
+
+  // Background I/O
+  struct ioQueue q = { .active = !batchMode, .job = jobs, .order = order, .pos = pos };
+  int saveOp[N];      // pending background save of each image (op index), or -1
+  pthread_mutex_init(&q.lock, NULL);
+  pthread_cond_init(&q.cond, NULL);
+  ioCause = NULL;
+  for (int j = 0; j < N; j++) saveOp[j] = -1;
+  for (int i = 0; i < nops; i++) {
+    pos[i] = -1;
+    memset(&jobs[i], 0, sizeof(jobs[i]));
+  }
+
+  for (int i = 0; i < nops && err == 0; i++) {
+    struct op* op = &ops[i];
+    // Load the next file while this op runs
+    if (q.active && !serverMode) {
+      int j = i;
+      while (j < nops && ops[j].kind != OP_LOAD) j++;
+      if (j < nops && pos[j] < 0 && canPrefetch(ops, j)) {
+        jobs[j].kind = OP_LOAD;
+        jobs[j].name = ops[j].name;
+        if (!ioSubmit(&q, j)) q.active = 0;
+      }
+    }
+    // Rectangle checks (on sizes, as the images may have been skipped)
+    if (op->kind == OP_CROP &&
+        !validRect(W[op->in1], H[op->in1], op->x, op->y, op->w, op->h)) {   // precondition check!
+      err = 5; break;
+    }
+    if (op->roi &&
+        !validRect(W[op->out], H[op->out], op->rect.x, op->rect.y, op->rect.w, op->rect.h)) {   // precondition check!
+      err = 5; break;
+    }
+    if (op->kind == OP_RESIZE && (W[op->in1] == 0 || H[op->in1] == 0)) {   // precondition check!
+      err = 5; break;
+    }
+    if ((op->kind == OP_PASTE || op->kind == OP_BLEND) &&
+        !validRect(W[op->out], H[op->out], op->x, op->y, W[op->in1], H[op->in1])) {
+      err = 6; break;
+    }
+    if (creates(op)) {
+      n = op->out + 1;
+      img[op->out] = NULL;
+    }
+
+    if (!op->needed) {
+      note("Skipping %s (result unused)\n", av[op->k]);
+      switch (op->kind) {
+      case OP_CREATE: case OP_CROP: case OP_RESIZE: W[op->out] = op->w; H[op->out] = op->h; break;
+      case OP_ROTATE: W[op->out] = H[op->in1]; H[op->out] = W[op->in1]; break;
+      case OP_MIRROR: case OP_FLIP: W[op->out] = W[op->in1]; H[op->out] = H[op->in1]; break;
+      default: break;
+      }
+    } else if (op->deferTo >= 0) {
+      noteOp(op);   // run by op->deferTo
+    } else if ((!accepts16(op) && (is16(img, op->in1) || is16(img, op->in2) ||
+                                   (!creates(op) && is16(img, op->out)))) ||
+               (op->kind == OP_PASTE && is16(img, op->in1) != is16(img, op->out))) {
+      err = 10;
+    } else if ((op->out < 0 || ((op->kind == OP_LOAD || op->kind == OP_FRAME) && pos[i] < 0)) &&
+               ioSync(&q) >= 0) {
+      break;   // an earlier save failed (reported below)
+    } else {
+      // Pending saves of images modified here must complete first
+      if (!creates(op) && op->out >= 0) ioWait(&q, saveOp[op->out]);
+      if ((op->kind == OP_MIRROR || op->kind == OP_FLIP) && lastUse[op->in1] == i) ioWait(&q, saveOp[op->in1]);
+      noteOp(op);
+      switch (op->kind) {
+      case OP_INFO: {
+        ImageStatistics st;
+        w = ImageWidth(img[op->in1]);
+        h = ImageHeight(img[op->in1]);
+        int maxval = ImageMaxval(img[op->in1]);
+        int deep = ImageDepth(img[op->in1]) == 16;
+        uint16_t min, max;
+        if (deep) ImageStats16(img[op->in1], &min, &max);
+        else ImageStatsEx(img[op->in1], &st);  // cached until modified
+        flockfile(out);  // keep lines together in batch mode
+        if (label != NULL) fprintf(out, "# File: %s\n", label);
+        fprintf(out, "# Size: %dx%d\n# Maxval: %d\n", w, h, maxval);
+        if (deep) {
+          fprintf(out, "# Depth: 16 bits\n");
+          fprintf(out, "# Gray level range: [%u, %u]\n", min, max);
+        } else {
+          fprintf(out, "# Gray level range: [%hhu, %hhu]\n", st.min, st.max);
+          fprintf(out, "# Mean: %.3f  Variance: %.3f\n", st.mean, st.variance);
+        }
+        funlockfile(out);
+        break;
+      }
+      case OP_TIC:
+        // (pending I/O was completed above, as before any op without output)
+        if (!batchMode) InstrReset();
+        break;
+      case OP_TOC:
+        if (!batchMode) InstrFPrint(out);
+        break;
+      case OP_NEG: case OP_THR: case OP_BRI:
+        if (op->roi) applyPoint(op, img[op->out]);
+        else err = runPointOps(ops, nops, i, img[op->out]);
+        break;
+      case OP_EQUALIZE:
+        ImageEqualize(img[op->out]);
+        break;
+      case OP_AUTOTHR: {
+        note("Thresholding I%d", op->out);
+        uint8 thr = ImageAutoThreshold(img[op->out]);
+        note(" at %d\n", thr);
+        break;
+      }
+      case OP_CREATE:
+        img[op->out] = ImageCreate(op->w, op->h, PixMax);
+        break;
+      case OP_ROTATE:
+        img[op->out] = ImageRotate(img[op->in1]);
+        break;
+      case OP_MIRROR: case OP_FLIP:
+        if (lastUse[op->in1] == i) {
+          // Source not used afterwards: skip the copy, work in place
+          img[op->out] = img[op->in1];
+          img[op->in1] = NULL;
+          if (op->kind == OP_MIRROR) ImageMirrorInPlace(img[op->out]);
+          else ImageFlipVertical(img[op->out]);
+        } else {
+          img[op->out] = (op->kind == OP_MIRROR) ? ImageMirror(img[op->in1]) : ImageFlip(img[op->in1]);
+        }
+        break;
+      case OP_IMIRROR:
+        ImageMirrorInPlace(img[op->out]);
+        break;
+      case OP_IFLIP:
+        ImageFlipVertical(img[op->out]);
+        break;
+      case OP_TILE: case OP_RASTER:
+        if (!ImageSetLayout(img[op->out], op->kind == OP_TILE ? IMAGE_TILED : IMAGE_RASTER)) err = 4;
+        break;
+      case OP_CROP:
+        img[op->out] = ImageCrop(img[op->in1], op->x, op->y, op->w, op->h);
+        if (img[op->out] != NULL) err = runPointOps(ops, nops, i, img[op->out]);
+        break;
+      case OP_RESIZE: {
+        // Area averaging unless enlarging on both axes
+        int enlarge = op->w > ImageWidth(img[op->in1]) && op->h > ImageHeight(img[op->in1]);
+        img[op->out] = ImageResize(img[op->in1], op->w, op->h, enlarge ? IMAGE_BILINEAR : IMAGE_AREA);
+        break;
+      }
+      case OP_PASTE:
+        ImagePaste(img[op->out], op->x, op->y, img[op->in1]);
+        break;
+      case OP_BLEND:
+        ImageBlend(img[op->out], op->x, op->y, img[op->in1], op->value);
+        break;
+      case OP_LOCATE: {
+        int found = ImageLocateSubImage(img[op->in2], &x, &y, img[op->in1]);
+        flockfile(out);
+        if (label != NULL) fprintf(out, "# File: %s\n", label);
+        if (found) {
+          fprintf(out, "# FOUND (%d,%d)\n", x, y);
+        } else {
+          fprintf(out, "# NOTFOUND\n");
+        }
+        funlockfile(out);
+        break;
+      }
+      case OP_LOCRLE: {
+        int found = ImageLocateRLE(op->name, &x, &y, img[op->in1]);
+        if (found < 0) { err = 4; break; }
+        flockfile(out);
+        if (label != NULL) fprintf(out, "# File: %s\n", label);
+        if (found) {
+          fprintf(out, "# FOUND (%d,%d)\n", x, y);
+        } else {
+          fprintf(out, "# NOTFOUND\n");
+        }
+        funlockfile(out);
+        break;
+      }
+      case OP_NEGRLE:
+        if (!ImageNegativeRLE(op->from, op->name)) err = 4;
+        else fileWritten(op->name);
+        break;
+      case OP_THRRLE:
+        if (!ImageThresholdRLE(op->from, op->name, op->level)) err = 4;
+        else fileWritten(op->name);
+        break;
+      case OP_FIND: {
+        if (W[op->in1] > W[op->in2] || H[op->in1] > H[op->in2]) {   // precondition check!
+          err = 6; break;
+        }
+        double score = ImageFindSubImage(img[op->in2], &x, &y, img[op->in1], op->metric);
+        flockfile(out);
+        if (label != NULL) fprintf(out, "# File: %s\n", label);
+        if (op->metric == IMAGE_SAD) {
+          fprintf(out, "# BEST (%d,%d) SAD %.0f\n", x, y, score);
+        } else {
+          fprintf(out, "# BEST (%d,%d) NCC %.6f\n", x, y, score);
+        }
+        funlockfile(out);
+        break;
+      }
+      case OP_BLUR:
+        if (!op->roi) ImageBlur(img[op->out], op->x, op->y);
+        else if (!ImageBlurRect(img[op->out], op->rect.x, op->rect.y, op->rect.w, op->rect.h, op->x, op->y)) err = 4;
+        break;
+      case OP_MEDIAN:
+        if (!ImageMedian(img[op->out], op->x, op->y)) err = 4;
+        break;
+      case OP_ERODE:
+        if (!ImageErode(img[op->out], op->x, op->y)) err = 4;
+        break;
+      case OP_DILATE:
+        if (!ImageDilate(img[op->out], op->x, op->y)) err = 4;
+        break;
+      case OP_OPEN:
+        if (!ImageOpen(img[op->out], op->x, op->y)) err = 4;
+        break;
+      case OP_CLOSE:
+        if (!ImageClose(img[op->out], op->x, op->y)) err = 4;
+        break;
+      case OP_GAUSS:
+        if (!ImageGaussianBlur(img[op->out], op->value, IMAGE_BORDER_REFLECT)) err = 4;
+        break;
+      case OP_KEEP: {
+        Image copy = copyImage(img[op->in1]);
+        if (copy == NULL) { err = 4; break; }
+        if (!cacheStore(op->name, copy)) { ImageDestroy(&copy); err = 4; }
+        break;
+      }
+      case OP_DROP:
+        if (!cacheDrop(op->name)) err = 5;
+        break;
+      case OP_SAVE: case OP_SAVEA: case OP_SAVER: case OP_SAVEP:
+        if (q.active && !isStream(op->name)) {
+          // Write behind; the I/O thread frees the image after its last use
+          jobs[i].kind = op->kind;
+          jobs[i].name = op->name;
+          jobs[i].img = img[op->in1];
+          jobs[i].own = lastUse[op->in1] == i;
+          if (ioSubmit(&q, i)) {
+            if (jobs[i].own) img[op->in1] = NULL;
+            else saveOp[op->in1] = i;
+            break;
+          }
+          q.active = 0;
+        }
+        if (op->kind == OP_SAVE ? !saveImage(op->name, img[op->in1]) :
+            op->kind == OP_SAVEA ? !ImageSaveAscii(img[op->in1], op->name) :
+            op->kind == OP_SAVER ? !ImageSaveRLE(img[op->in1], op->name) :
+            !savePBM(img[op->in1], op->name)) err = 4;
+        else fileWritten(op->name);
+        break;
+      case OP_APPEND:
+        if (!appendFrame(op->name, img[op->in1])) err = 4;
+        else fileWritten(op->name);
+        break;
+      case OP_LOAD:
+        if (pos[i] >= 0) {   // loaded ahead
+          ioWait(&q, i);
+          img[op->out] = jobs[i].img;
+          jobs[i].img = NULL;
+          if (img[op->out] == NULL) ioFailure(&q, i);
+        } else {
+          img[op->out] = loadImage(op->name);
+        }
+        break;
+      case OP_FRAME:
+        img[op->out] = loadFrame(op->name, op->x);
+        break;
+      }
+      if (creates(op)) {
+        if (img[op->out] == NULL) { err = 4; break; }
+        W[op->out] = ImageWidth(img[op->out]);
+        H[op->out] = ImageHeight(img[op->out]);
+      }
+    }
+
+    // Free images that are no longer needed
+    for (int j = 0; j < n; j++) {
+      if (lastUse[j] == i) {
+        ioWait(&q, saveOp[j]);
+        ImageDestroy(&img[j]);
+      }
+    }
+  }
+
+  // Complete background I/O; a failed save precedes any later error
+  int failed = ioSync(&q);
+  if (q.started) {
+    pthread_mutex_lock(&q.lock);
+    q.quit = 1;
+    pthread_cond_broadcast(&q.cond);
+    pthread_mutex_unlock(&q.lock);
+    pthread_join(q.tid, NULL);
+  }
+  for (int i = 0; i < nops; i++) {
+    if (pos[i] >= 0 && jobs[i].kind == OP_LOAD) ImageDestroy(&jobs[i].img);  // not used
+  }
+  pthread_mutex_destroy(&q.lock);
+  pthread_cond_destroy(&q.cond);
+  if (failed >= 0) {
+    err = 4;
+    ioFailure(&q, failed);
+  }
+
+  free(ops);
+  free(jobs);
+  free(order);
+  free(pos);
+  *pn = n;
+  return err != 0 ? err : parseErr;
+}
+
+
+// Batch mode
+//
+// Files are distributed among a pool of worker threads.  Each worker
+// runs the whole pipeline (load, operations, save) on one file at a time,
+// so loads, computations and saves of different files overlap.
+// Each worker owns a deque with a contiguous range of file indices:
+// it takes work from the front of its own deque and, when that is empty,
+// steals from the back of the other workers' deques.
+
+// Maximum number of worker threads
+#define MAX_WORKERS 64
+
+struct deque {
+  pthread_mutex_t lock;
+  int lo, hi;    // file indices [lo, hi) still to process
+};
+
+struct batch {
+  char** pipeline;    // pipeline tokens (with placeholders)
+  int ntokens;
+  char** files;       // input files
+  int nfiles;
+  int nworkers;
+  struct deque queue[MAX_WORKERS];
+  pthread_mutex_t lock;   // protects failed and error reporting
+  int failed;             // number of failed files
+};
+
+// Take a file index from the front of worker w's own deque, or
+// steal one from the back of another deque.  Returns -1 if none is left.
+static int nextFile(struct batch* b, int w) {
+  for (int i = 0; i < b->nworkers; i++) {
+    struct deque* q = &b->queue[(w + i) % b->nworkers];
+    int idx = -1;
+    pthread_mutex_lock(&q->lock);
+    if (q->lo < q->hi) idx = (i == 0) ? q->lo++ : --q->hi;
+    pthread_mutex_unlock(&q->lock);
+    if (idx >= 0) return idx;
+  }
+  return -1;
+}
+
+// Return a new string with the placeholders in tmpl replaced for file in.
+static char* expand(const char* tmpl, const char* in) {
+  const char* slash = strrchr(in, '/');
+  int dirlen = slash ? (int)(slash - in) : 1;
+  const char* dir = slash ? in : ".";
+  const char* name = slash ? slash + 1 : in;
+  int namelen = (int)strlen(name);
+  if (namelen > 4 && strcmp(name + namelen - 4, ".pgm") == 0) namelen -= 4;
+
+  size_t cap = strlen(tmpl) + 1;
+  for (const char* t = strchr(tmpl, '{'); t != NULL; t = strchr(t + 1, '{')) {
+    cap += strlen(in) + 8;  // enough for any placeholder
+  }
+  char* res = malloc(cap);
+  if (res == NULL) return NULL;
+  char* r = res;
+  while (*tmpl != '\0') {
+    if (strncmp(tmpl, "{in}", 4) == 0) {
+      r += sprintf(r, "%s", in); tmpl += 4;
+    } else if (strncmp(tmpl, "{dir}", 5) == 0) {
+      r += sprintf(r, "%.*s", dirlen, dir); tmpl += 5;
+    } else if (strncmp(tmpl, "{name}", 6) == 0) {
+      r += sprintf(r, "%.*s", namelen, name); tmpl += 6;
+    } else if (strncmp(tmpl, "{out}", 5) == 0) {
+      r += sprintf(r, "%.*s/%.*s.out.pgm", dirlen, dir, namelen, name); tmpl += 5;
+    } else {
+      *r++ = *tmpl++;
+    }
+  }
+  *r = '\0';
+  return res;
+}
+
+// Run the pipeline on one file.  Returns an errors[] code.
+static int batchFile(struct batch* b, const char* file) {
+  char** args = malloc((b->ntokens + 1) * sizeof(char*));
+  if (args == NULL) {
+    pthread_mutex_lock(&b->lock);
+    b->failed++;
+    error(0, errno, "%s", file);
+    pthread_mutex_unlock(&b->lock);
+    return 4;
+  }
+  int ac = 0;
+  int err = 0;
+  args[ac++] = (char*)file;   // load file as I0
+  for (int i = 0; i < b->ntokens; i++) {
+    if ((args[ac] = expand(b->pipeline[i], file)) == NULL) {
+      err = 4;
+      break;
+    }
+    ac++;
+  }
+
+  Image img[N];
+  int n = 0;
+  if (err == 0) err = runPipeline(ac, args, 0, img, &n, stdout, file);
+  int errnum = errno;
+  const char* cause = errMsg();
+  while (n > 0) {
+    ImageDestroy(&img[--n]);
+  }
+  for (int i = 1; i < ac; i++) free(args[i]);
+  free(args);
+
+  if (err != 0) {
+    char msg[256];
+    snprintf(msg, sizeof(msg), errors[err], cause);
+    pthread_mutex_lock(&b->lock);
+    b->failed++;
+    error(0, errnum, "%s: %s", file, msg);
+    pthread_mutex_unlock(&b->lock);
+  }
+  return err;
+}
+
+struct worker {
+  struct batch* b;
+  int w;        // worker number
+  int threads;  // threads for each library operation
+};
+
+static void* batchWorker(void* arg) {
+  struct worker* wk = (struct worker*)arg;
+  ImageSetThreads(wk->threads);
+  int idx;
+  while ((idx = nextFile(wk->b, wk->w)) >= 0) {
+    batchFile(wk->b, wk->b->files[idx]);
+  }
+  return NULL;
+}
+
+// Read lines from f into a new array of strings.
+// Returns the number of (nonempty) lines, or -1 on allocation failure.
+static int readLines(FILE* f, char*** plines) {
+  char** lines = NULL;
+  int n = 0, cap = 0;
+  char* line = NULL;
+  size_t len = 0;
+  ssize_t r;
+  while ((r = getline(&line, &len, f)) != -1) {
+    while (r > 0 && (line[r-1] == '\n' || line[r-1] == '\r')) line[--r] = '\0';
+    if (r == 0) continue;
+    if (n == cap) {
+      cap = cap ? 2*cap : 1024;
+      char** tmp = realloc(lines, cap * sizeof(char*));
+      if (tmp == NULL) { n = -1; break; }
+      lines = tmp;
+    }
+    if ((lines[n] = strdup(line)) == NULL) { n = -1; break; }
+    n++;
+  }
+  free(line);
+  *plines = lines;
+  return n;
+}
+
+// imageTool --batch PIPELINE [FILE...]
+static int batchMain(int ac, char* av[]) {
+  if (ac < 3) {
+    error(5, 0, "\n%s", USAGE);
+  }
+  batchMode = 1;
+
+  struct batch b;
+  // Split the pipeline into tokens (modifies av[2])
+  char** tokens = malloc((strlen(av[2]) / 2 + 1) * sizeof(char*));
+  if (tokens == NULL) error(4, errno, "Memory allocation failed");
+  b.ntokens = 0;
+  for (char* t = strtok(av[2], " \t\n"); t != NULL; t = strtok(NULL, " \t\n")) {
+    tokens[b.ntokens++] = t;
+  }
+  b.pipeline = tokens;
+
+  char** lines = NULL;
+  if (ac > 3) {
+    b.files = av + 3;
+    b.nfiles = ac - 3;
+  } else {
+    b.nfiles = readLines(stdin, &lines);
+    if (b.nfiles < 0) error(4, errno, "Reading file names from stdin");
+    b.files = lines;
+  }
+
+  // One worker per CPU; the CPUs left over when there are fewer files
+  // are shared by the library operations of the workers
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpu < 1) ncpu = 1;
+  b.nworkers = (int)(ncpu < MAX_WORKERS ? ncpu : MAX_WORKERS);
+  if (b.nworkers > b.nfiles) b.nworkers = b.nfiles;
+  if (b.nworkers < 1) b.nworkers = 1;
+  int threads = (int)(ncpu / b.nworkers);
+
+  pthread_mutex_init(&b.lock, NULL);
+  b.failed = 0;
+  for (int w = 0; w < b.nworkers; w++) {
+    pthread_mutex_init(&b.queue[w].lock, NULL);
+    b.queue[w].lo = (int)((long long)b.nfiles * w / b.nworkers);
+    b.queue[w].hi = (int)((long long)b.nfiles * (w+1) / b.nworkers);
+  }
+
+  ImageInit();
+  InstrReset();
+
+  struct worker wk[MAX_WORKERS];
+  pthread_t tid[MAX_WORKERS];
+  int started[MAX_WORKERS];
+  for (int w = 1; w < b.nworkers; w++) {
+    wk[w].b = &b;
+    wk[w].w = w;
+    wk[w].threads = threads;
+    started[w] = pthread_create(&tid[w], NULL, batchWorker, &wk[w]) == 0;
+  }
+  // Worker 0 is this thread; it also steals work of workers not started
+  wk[0].b = &b;
+  wk[0].w = 0;
+  wk[0].threads = threads;
+  batchWorker(&wk[0]);
+  for (int w = 1; w < b.nworkers; w++) {
+    if (started[w]) pthread_join(tid[w], NULL);
+  }
+
+  printf("# Batch: %d files, %d failed, %d workers\n", b.nfiles, b.failed, b.nworkers);
+  InstrPrint();
+
+  for (int w = 0; w < b.nworkers; w++) {
+    pthread_mutex_destroy(&b.queue[w].lock);
+  }
+  pthread_mutex_destroy(&b.lock);
+  if (lines != NULL) {
+    for (int i = 0; i < b.nfiles; i++) free(lines[i]);
+    free(lines);
+  }
+  free(tokens);
+  return b.failed > 0 ? 4 : 0;
+}
+
+// Frames mode
+//
+// The pipeline runs once per frame of the input file, with the tokens
+//   frame K FILE PIPELINE...
+// so each run loads the next frame through the same open reader, and
+// appends (if any) go to the same open writers.
+
+// imageTool --frames PIPELINE FILE
+static int framesMain(int ac, char* av[]) {
+  if (ac != 4) {
+    error(5, 0, "\n%s", USAGE);
+  }
+  // Split the pipeline into tokens (modifies av[2])
+  char** args = malloc((3 + strlen(av[2]) / 2 + 1) * sizeof(char*));
+  if (args == NULL) error(4, errno, "Memory allocation failed");
+  int na = 3;
+  for (char* t = strtok(av[2], " \t\n"); t != NULL; t = strtok(NULL, " \t\n")) {
+    args[na++] = t;
+  }
+  char num[16];
+  args[0] = "frame";
+  args[1] = num;
+  args[2] = av[3];
+
+  ImageInit();
+  int err = 0;
+  int k;
+  for (k = 0; err == 0 && (k == 0 || moreFrames(av[3], k)); k++) {
+    snprintf(num, sizeof(num), "%d", k);
+    Image img[N];
+    int n = 0;
+    err = runPipeline(na, args, 0, img, &n, stdout, NULL);
+    while (n > 0) {
+      ImageDestroy(&img[--n]);
+    }
+  }
+  int errnum = errno;
+  if (!closeStreams() && err == 0) {
+    err = 4;
+    errnum = errno;
+  }
+  free(args);
+  note("%d frames processed\n", err == 0 ? k : k - 1);
+  error(err, errnum, errors[err], errMsg());
+  return 0;
+}
+
+// Server mode
+//
+// Protocol: a client connects and sends the pipeline arguments, each one
+// terminated by a newline, followed by an empty line.
+// The server runs the pipeline in a new thread, and replies with the
+// output of the pipeline (from info, locate), followed by a status line:
+//   "# OK" or "# ERROR CODE MESSAGE"
+// and closes the connection.
+// A request has at most MAX_REQUEST bytes and MAX_ARGS arguments.
+
+// Maximum size of a request, and number of arguments
+#define MAX_REQUEST (64*1024)
+#define MAX_ARGS 4096
+
+// Read a request from fd into buf, and split it into args.
+// Returns the number of arguments, or -1 on failure.
+static int readRequest(int fd, char* buf, size_t size, char* args[], int maxargs) {
+  size_t len = 0;
+  // Read until an empty line (or EOF)
+  while (len < size - 1) {
+    ssize_t r = read(fd, buf + len, size - 1 - len);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) break;
+    len += r;
+    buf[len] = '\0';
+    if ((len == 1 && buf[0] == '\n') || strstr(buf, "\n\n") != NULL) break;
+  }
+  buf[len] = '\0';
+  int na = 0;
+  char* p = buf;
+  char* nl;
+  while ((nl = strchr(p, '\n')) != NULL && nl != p) {
+    if (na == maxargs) return -1;
+    *nl = '\0';
+    args[na++] = p;
+    p = nl + 1;
+  }
+  return (nl == p) ? na : -1;  // must end with an empty line
+}
+
+static void* serveClient(void* arg) {
+  int fd = (int)(intptr_t)arg;
+  char* buf = malloc(MAX_REQUEST);
+  char** args = malloc(MAX_ARGS * sizeof(char*));
+  FILE* out = fdopen(fd, "w");
+  if (buf == NULL || args == NULL || out == NULL) {
+    if (out != NULL) fclose(out); else close(fd);
+    free(buf);
+    free(args);
+    return NULL;
+  }
+
+  int ac = readRequest(fd, buf, MAX_REQUEST, args, MAX_ARGS);
+  Image img[N];
+  int n = 0;
+  int err = (ac < 0) ? 9 : runPipeline(ac, args, 0, img, &n, out, NULL);
+  int errnum = errno;
+  const char* cause = errMsg();
   while (n > 0) {
     ImageDestroy(&img[--n]);
   }
 
-  error(err, errno, errors[err], ImageErrMsg());
+  if (err == 0) {
+    fprintf(out, "# OK\n");
+  } else {
+    fprintf(out, "# ERROR %d ", err);
+    fprintf(out, errors[err], cause);
+    if (errnum != 0 && err == 4) fprintf(out, ": %s", strerror(errnum));
+    fprintf(out, "\n");
+  }
+  fclose(out);
+  free(buf);
+  free(args);
+  return NULL;
+}
+
+// Return a socket address for the given path.
+static int socketAddress(const char* path, struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) return 0;
+  strcpy(addr->sun_path, path);
+  return 1;
+}
+
+// imageTool --serve SOCKET
+static int serveMain(int ac, char* av[]) {
+  if (ac != 3) {
+    error(5, 0, "\n%s", USAGE);
+  }
+  struct sockaddr_un addr;
+  if (!socketAddress(av[2], &addr)) error(5, 0, "Socket path too long: %s", av[2]);
+
+  int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sfd < 0) error(9, errno, "socket");
+  unlink(av[2]);  // remove stale socket
+  if (bind(sfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) error(9, errno, "%s", av[2]);
+  if (listen(sfd, 64) < 0) error(9, errno, "%s", av[2]);
+  signal(SIGPIPE, SIG_IGN);   // clients may go away
+
+  serverMode = 1;
+  batchMode = 1;  // no progress messages
+  ImageInit();
+  fprintf(stderr, "Serving on %s\n", av[2]);
+
+  for (;;) {
+    int cfd = accept(sfd, NULL, NULL);
+    if (cfd < 0) {
+      if (errno == EINTR) continue;
+      error(9, errno, "accept");
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, serveClient, (void*)(intptr_t)cfd) != 0) {
+      serveClient((void*)(intptr_t)cfd);
+    } else {
+      pthread_detach(tid);
+    }
+  }
   return 0;
 }
 
+// imageTool --client SOCKET [ARG...]
+static int clientMain(int ac, char* av[]) {
+  if (ac < 3) {
+    error(5, 0, "\n%s", USAGE);
+  }
+  struct sockaddr_un addr;
+  if (!socketAddress(av[2], &addr)) error(5, 0, "Socket path too long: %s", av[2]);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    error(9, errno, "%s", av[2]);
+  }
+
+  FILE* f = fdopen(fd, "r+");
+  if (f == NULL) error(9, errno, "%s", av[2]);
+  for (int k = 3; k < ac; k++) {
+    if (strchr(av[k], '\n') != NULL || av[k][0] == '\0') error(5, 0, "Invalid argument");
+    fprintf(f, "%s\n", av[k]);
+  }
+  fprintf(f, "\n");
+  fflush(f);
+
+  // Print the reply, except the status line
+  int err = 9;
+  char* line = NULL;
+  size_t len = 0;
+  while (getline(&line, &len, f) != -1) {
+    if (strcmp(line, "# OK\n") == 0) {
+      err = 0;
+    } else if (strncmp(line, "# ERROR ", 8) == 0) {
+      err = atoi(line + 8);
+      if (err <= 0) err = 9;
+      line[strcspn(line, "\n")] = '\0';
+      error(0, 0, "%s", strchr(line + 8, ' ') + 1);
+    } else {
+      fputs(line, stdout);
+    }
+  }
+  free(line);
+  fclose(f);
+  if (err == 9) error(0, 0, "%s", errors[9]);
+  return err;
+}
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  if (ac <= 1) {
+    error(5, 0, "\n%s", USAGE);
+  }
+  if (strcmp(av[1], "--batch") == 0) {
+    return batchMain(ac, av);
+  }
+  if (strcmp(av[1], "--frames") == 0) {
+    return framesMain(ac, av);
+  }
+  if (strcmp(av[1], "--serve") == 0) {
+    return serveMain(ac, av);
+  }
+  if (strcmp(av[1], "--client") == 0) {
+    return clientMain(ac, av);
+  }
+
+  ImageInit();
+
+  // The image buffer
+  Image img[N];       // the images
+  int n = 0;          // number of images created
+
+  int err = runPipeline(ac, av, 1, img, &n, stdout, NULL);
+
+  // Destroy remaining images
+  while (n > 0) {
+    ImageDestroy(&img[--n]);
+  }
+  int errnum = errno;
+  if (!closeStreams() && err == 0) {
+    err = 4;
+    errnum = errno;
+  }
+  errno = errnum;
+
+  error(err, errno, errors[err], errMsg());
+  return 0;
+}
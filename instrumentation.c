@@ -22,6 +22,7 @@
 #include "instrumentation.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
@@ -68,8 +69,65 @@ double cpu_time(void) {
 
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+// Per-thread counter shards
+//
+// Each thread gets a shard on its first counter update.  When the thread
+// terminates, its counts are added to the retired counts and the shard
+// is recycled for another thread.
+
+struct shard {
+  unsigned long count[NUMCOUNTERS];
+  int inUse;             // owned by a live thread?
+  struct shard* next;    // list of all shards
+};
+
+static struct shard* shards = NULL;                 // all shards
+static unsigned long retired[NUMCOUNTERS];          // counts of dead threads
+static struct shard fallback;                       // if malloc fails
+static pthread_mutex_t shardLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t shardKey;
+static pthread_once_t shardOnce = PTHREAD_ONCE_INIT;
+
+/// This thread's array of operation counters (NULL until first use):
+_Thread_local unsigned long* InstrLocalCount = NULL;  ///extern
+
+// Called when a thread with a shard terminates.
+static void shardRelease(void* p) {
+  struct shard* s = (struct shard*)p;
+  pthread_mutex_lock(&shardLock);
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    retired[i] += s->count[i];
+    s->count[i] = 0ul;
+  }
+  s->inUse = 0;
+  pthread_mutex_unlock(&shardLock);
+}
+
+static void shardInit(void) {
+  pthread_key_create(&shardKey, shardRelease);
+}
+
+/// Allocate this thread's counter shard and return it. (Internal use.)
+unsigned long* InstrRegister(void) { ///
+  pthread_once(&shardOnce, shardInit);
+  pthread_mutex_lock(&shardLock);
+  struct shard* s = shards;
+  while (s != NULL && s->inUse) s = s->next;
+  if (s == NULL && (s = calloc(1, sizeof(*s))) != NULL) {
+    s->next = shards;
+    shards = s;
+  }
+  if (s != NULL) s->inUse = 1;
+  pthread_mutex_unlock(&shardLock);
+  if (s == NULL) {
+    // Out of memory: share the fallback shard (counts may be lost)
+    InstrLocalCount = fallback.count;
+  } else {
+    pthread_setspecific(shardKey, s);
+    InstrLocalCount = s->count;
+  }
+  return InstrLocalCount;
+}
 
 /// Array of names for the counters:
 char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
@@ -101,29 +159,52 @@ void InstrCalibrate(void) { ///
   InstrCTU = cpu_time() - time;
 }
 
-/// Reset counters to zero and store cpu_time.
+/// Reset counters (of all threads) to zero and store cpu_time.
 void InstrReset(void) { ///
-  for (int i = 0; i < NUMCOUNTERS; i++)
-    InstrCount[i] = 0ul;
+  pthread_mutex_lock(&shardLock);
+  for (struct shard* s = shards; s != NULL; s = s->next)
+    for (int i = 0; i < NUMCOUNTERS; i++)
+      s->count[i] = 0ul;
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    retired[i] = 0ul;
+    fallback.count[i] = 0ul;
+  }
+  pthread_mutex_unlock(&shardLock);
   InstrTime = cpu_time();
 }
 
-// Print times and all named counter values
+/// Sum of counter i over all threads.
+unsigned long InstrSum(int i) { ///
+  unsigned long sum;
+  pthread_mutex_lock(&shardLock);
+  sum = retired[i] + fallback.count[i];
+  for (struct shard* s = shards; s != NULL; s = s->next)
+    sum += s->count[i];
+  pthread_mutex_unlock(&shardLock);
+  return sum;
+}
+
+/// Print times and all named counter values (summed over all threads).
 void InstrPrint(void) { ///
+  InstrFPrint(stdout);
+}
+
+/// Like InstrPrint, to stream f.
+void InstrFPrint(FILE* f) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
   // compute time in calibrated time units:
   double caltime = time / InstrCTU;
 
-  printf("#%14.15s\t%15.15s", "time", "caltime");
+  fprintf(f, "#%14.15s\t%15.15s", "time", "caltime");
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15.15s", InstrName[i]);
-  puts("");
-  printf("%15.6f\t%15.6f", time, caltime);
+      fprintf(f, "\t%15.15s", InstrName[i]);
+  fputs("\n", f);
+  fprintf(f, "%15.6f\t%15.6f", time, caltime);
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
-  puts("");
+      fprintf(f, "\t%15lu", InstrSum(i));
+  fputs("\n", f);
 }
 
@@ -22,14 +22,30 @@
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
 
+#include <stdio.h>
+
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
-/// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Counters are sharded per thread, so that threads never update the
+/// same counter concurrently.  InstrCount is this thread's array of
+/// operation counters.  It is used exactly like a global array:
+///   InstrCount[0] += 3;
+/// InstrReset and InstrPrint act on the counters of all threads,
+/// including threads that have terminated.  Their results are exact
+/// if no other thread is updating its counters at the time.
+
+/// This thread's array of operation counters (NULL until first use):
+extern _Thread_local unsigned long* InstrLocalCount;  ///extern
+
+/// Allocate this thread's counter shard and return it. (Internal use.)
+unsigned long* InstrRegister(void) ;
+
+/// Array of operation counters (of this thread):
+#define InstrCount (InstrLocalCount != NULL ? InstrLocalCount : InstrRegister())
 
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
@@ -45,10 +61,17 @@ extern double InstrCTU;  ///extern
 /// a reasonably cpu-independent time unit.
 void InstrCalibrate(void) ;
 
-/// Reset counters to zero and store cpu_time.
+/// Reset counters (of all threads) to zero and store cpu_time.
 void InstrReset(void) ;
 
+/// Sum of counter i over all threads.
+unsigned long InstrSum(int i) ;
+
+/// Print times and all named counter values (summed over all threads).
 void InstrPrint(void) ;
 
+/// Like InstrPrint, to stream f.
+void InstrFPrint(FILE* f) ;
+
 #endif
 
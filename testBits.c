@@ -0,0 +1,183 @@
+// testBits - Test the binary (bit-packed) images.
+//
+// Converts pseudo-random images of several sizes (not multiples of 64, to
+// exercise the last word of each row) to binary images, and checks the
+// logical operations, counts, erosion, dilation and locate against the
+// same operations on the thresholded 8-bit images.
+//
+// This program is part of a programming project
+// for the course AED, DETI / UA.PT
+
+#include <assert.h>
+#include <errno.h>
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static int failures = 0;
+
+static void expect(int ok, const char* what, int w, int h) {
+  printf("%s: %s (%dx%d)\n", ok ? "ok" : "FAIL", what, w, h);
+  if (!ok) failures++;
+}
+
+// Does the binary image b have the pixels of the thresholded image img?
+static int same(BitImage b, Image img) {
+  Image c = BitImageToImage(b, PixMax);
+  if (c == NULL) error(2, errno, "BitImageToImage: %s", ImageErrMsg());
+  int ok = ImageWidth(c) == ImageWidth(img) && ImageHeight(c) == ImageHeight(img) &&
+           ImageMatchSubImage(c, 0, 0, img);
+  ImageDestroy(&c);
+  return ok;
+}
+
+// Copy of img, or exit on failure.
+static Image copy(Image img) {
+  Image c = ImageCrop(img, 0, 0, ImageWidth(img), ImageHeight(img));
+  if (c == NULL) error(2, errno, "ImageCrop: %s", ImageErrMsg());
+  return c;
+}
+
+// Binary image of img at threshold thr, or exit on failure.
+static BitImage bits(Image img, uint8 thr) {
+  BitImage b = BitImageFromImage(img, thr);
+  if (b == NULL) error(2, errno, "BitImageFromImage: %s", ImageErrMsg());
+  return b;
+}
+
+// New image with a deterministic pseudo-random pattern, with blobs
+// (levels vary smoothly), so that erosion and dilation leave something.
+static Image pattern(int w, int h, unsigned seed) {
+  Image img = ImageCreate(w, h, PixMax);
+  if (img == NULL) error(2, errno, "ImageCreate: %s", ImageErrMsg());
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      seed = seed * 1103515245u + 12345u;
+      ImageSetPixel(img, x, y, (uint8)(seed >> 16));
+    }
+  }
+  ImageBlur(img, 2, 2);
+  return img;
+}
+
+// Apply op to each pair of pixels of the thresholded images a and b,
+// giving a new image (a is NULL for NOT).
+static Image combine(Image a, Image b, char op) {
+  Image c = copy(b);
+  for (int y = 0; y < ImageHeight(b); y++) {
+    for (int x = 0; x < ImageWidth(b); x++) {
+      int p = (a != NULL) && ImageGetPixel(a, x, y) != 0;
+      int q = ImageGetPixel(b, x, y) != 0;
+      int r = (op == '&') ? p && q : (op == '|') ? p || q : (op == '^') ? p != q : !q;
+      ImageSetPixel(c, x, y, r ? PixMax : 0);
+    }
+  }
+  return c;
+}
+
+// Number of white pixels in a rectangle of the thresholded image img.
+static size_t count(Image img, int x0, int y0, int w, int h) {
+  size_t n = 0;
+  for (int y = y0; y < y0 + h; y++) {
+    for (int x = x0; x < x0 + w; x++) n += ImageGetPixel(img, x, y) != 0;
+  }
+  return n;
+}
+
+static void test(int w, int h, unsigned seed) {
+  Image img = pattern(w, h, seed);
+  Image img2 = pattern(w, h, seed + 1);
+  uint8 thr = 128;
+  Image t = copy(img);
+  ImageThreshold(t, thr);
+  Image t2 = copy(img2);
+  ImageThreshold(t2, thr);
+  BitImage b = bits(img, thr);
+  BitImage b2 = bits(img2, thr);
+  expect(same(b, t), "threshold", w, h);
+
+  // Logical operations
+  const char* ops = "&|^!";
+  const char* names[] = { "and", "or", "xor", "not" };
+  for (int k = 0; k < 4; k++) {
+    BitImage c = bits(img, thr);
+    switch (ops[k]) {
+    case '&': BitImageAnd(c, b2); break;
+    case '|': BitImageOr(c, b2); break;
+    case '^': BitImageXor(c, b2); break;
+    case '!': BitImageNot(c); break;
+    }
+    Image e = (ops[k] == '!') ? combine(NULL, t, '!') : combine(t, t2, ops[k]);
+    expect(same(c, e), names[k], w, h);
+    ImageDestroy(&e);
+    BitImageDestroy(&c);
+  }
+
+  // Counts
+  int ok = BitImageCount(b) == count(t, 0, 0, w, h);
+  for (int r = 0; r < 50 && ok; r++) {
+    int x = rand() % w, y = rand() % h;
+    int rw = rand() % (w - x + 1), rh = rand() % (h - y + 1);
+    ok = BitImageCountRect(b, x, y, rw, rh) == count(t, x, y, rw, rh);
+  }
+  expect(ok, "count, count rect", w, h);
+
+  // Erosion and dilation
+  int radii[][2] = { {0, 0}, {1, 0}, {0, 1}, {2, 3}, {40, 1}, {70, 5} };
+  ok = 1;
+  for (int r = 0; r < 6 && ok; r++) {
+    int dx = radii[r][0], dy = radii[r][1];
+    BitImage c = bits(img, thr);
+    Image e = copy(t);
+    if (!BitImageErode(c, dx, dy) || !ImageErode(e, dx, dy)) error(2, errno, "Erode: %s", ImageErrMsg());
+    ok = same(c, e);
+    BitImageDestroy(&c);
+    ImageDestroy(&e);
+    c = bits(img, thr);
+    e = copy(t);
+    if (!BitImageDilate(c, dx, dy) || !ImageDilate(e, dx, dy)) error(2, errno, "Dilate: %s", ImageErrMsg());
+    ok = ok && same(c, e);
+    BitImageDestroy(&c);
+    ImageDestroy(&e);
+  }
+  expect(ok, "erode, dilate", w, h);
+
+  // Locate: pieces of the image (some of which occur several times, as
+  // small all-black ones), and a piece of another image
+  ok = 1;
+  for (int r = 0; r < 20 && ok; r++) {
+    int sw = 1 + rand() % (w < 20 ? w : 20), sh = 1 + rand() % (h < 12 ? h : 12);
+    int x = rand() % (w - sw + 1), y = rand() % (h - sh + 1);
+    Image s = ImageCrop((r % 4 == 3) ? t2 : t, x, y, sw, sh);
+    if (s == NULL) error(2, errno, "ImageCrop: %s", ImageErrMsg());
+    BitImage bs = bits(s, thr);
+    int x1 = -1, y1 = -1, x2 = -1, y2 = -1;
+    int found1 = ImageLocateSubImage(t, &x1, &y1, s);
+    int found2 = BitImageLocate(b, &x2, &y2, bs);
+    ok = found1 == found2 && x1 == x2 && y1 == y2;
+    BitImageDestroy(&bs);
+    ImageDestroy(&s);
+  }
+  expect(ok, "locate", w, h);
+
+  BitImageDestroy(&b2);
+  BitImageDestroy(&b);
+  ImageDestroy(&t2);
+  ImageDestroy(&t);
+  ImageDestroy(&img2);
+  ImageDestroy(&img);
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  ImageInit();
+  srand(1);
+  int sizes[][2] = { {1, 1}, {63, 5}, {64, 7}, {65, 9}, {130, 70}, {317, 241} };
+  for (int k = 0; k < 6; k++) {
+    test(sizes[k][0], sizes[k][1], 11u * k);
+  }
+  printf("# %s\n", failures ? "FAILED" : "PASSED");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,150 @@
+// testConvolve - Test the separable convolution engine.
+//
+// Checks ImageConvolveSeparable with non-uniform kernels: on a small image
+// against values worked out by hand, and on pseudo-random images against a
+// direct (unseparated) computation, for all border modes and for kernels
+// taking the fixed-point SIMD path and the exact scalar path.
+//
+// This program is part of a programming project
+// for the course AED, DETI / UA.PT
+
+#include <assert.h>
+#include <errno.h>
+#include "error.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static int failures = 0;
+
+static void expect(int ok, const char* what) {
+  printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+  if (!ok) failures++;
+}
+
+// Convolve, or exit on failure.
+static void convolve(Image img, ImageKernel kx, ImageKernel ky, ImageBorder border) {
+  if (!ImageConvolveSeparable(img, kx, ky, border)) {
+    error(2, errno, "ImageConvolveSeparable: %s", ImageErrMsg());
+  }
+}
+
+// Does img have the w x h levels in p (row by row)?
+static int has(Image img, const uint8* p) {
+  for (int y = 0; y < ImageHeight(img); y++) {
+    for (int x = 0; x < ImageWidth(img); x++) {
+      if (ImageGetPixel(img, x, y) != *p++) return 0;
+    }
+  }
+  return 1;
+}
+
+// Index of the pixel at i (maybe outside [0, n)) that stands for it with
+// border, or -1 if it is left out.
+static int borderIndex(int i, int n, ImageBorder border) {
+  if (i >= 0 && i < n) return i;
+  if (border == IMAGE_BORDER_SHRINK) return -1;
+  if (border == IMAGE_BORDER_CLAMP) return (i < 0) ? 0 : n - 1;
+  while (i < 0 || i >= n) i = (i < 0) ? -i - 1 : 2*n - i - 1;   // cba|abcd|dcb
+  return i;
+}
+
+// Level of pixel (x,y) of img convolved with kx and ky, computed directly
+// (as documented in image8bit.h).
+static int direct(Image img, int x, int y, ImageKernel kx, ImageKernel ky, ImageBorder border) {
+  long sum = 0, sumx = 0, sumy = 0;   // (weights of the pixels used)
+  for (int i = -kx.radius; i <= kx.radius; i++) {
+    if (borderIndex(x + i, ImageWidth(img), border) >= 0) sumx += kx.weight[i + kx.radius];
+  }
+  for (int j = -ky.radius; j <= ky.radius; j++) {
+    int v = borderIndex(y + j, ImageHeight(img), border);
+    if (v >= 0) sumy += ky.weight[j + ky.radius];
+    for (int i = -kx.radius; i <= kx.radius; i++) {
+      int u = borderIndex(x + i, ImageWidth(img), border);
+      if (u < 0 || v < 0) continue;
+      sum += (long)kx.weight[i + kx.radius] * ky.weight[j + ky.radius] * ImageGetPixel(img, u, v);
+    }
+  }
+  long div = (sumx > 0 ? sumx : 1) * (sumy > 0 ? sumy : 1);
+  long level = lround((double)sum / div);
+  return (level < 0) ? 0 : (level > ImageMaxval(img)) ? ImageMaxval(img) : (int)level;
+}
+
+// Does convolving img with kx and ky give the direct computation?
+static int same(Image img, ImageKernel kx, ImageKernel ky, ImageBorder border) {
+  Image c = ImageCrop(img, 0, 0, ImageWidth(img), ImageHeight(img));
+  if (c == NULL) error(2, errno, "ImageCrop: %s", ImageErrMsg());
+  convolve(c, kx, ky, border);
+  int ok = 1;
+  for (int y = 0; y < ImageHeight(img) && ok; y++) {
+    for (int x = 0; x < ImageWidth(img) && ok; x++) {
+      ok = ImageGetPixel(c, x, y) == direct(img, x, y, kx, ky, border);
+    }
+  }
+  ImageDestroy(&c);
+  return ok;
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  ImageInit();
+
+  // A bright pixel in the middle of a 3x3 image, with a 1,2,1 kernel
+  static const int binomial[] = { 1, 2, 1 };
+  ImageKernel k121 = { 1, binomial };
+  static const uint8 shrunk[] = { 27, 40, 27,  40, 60, 40,  27, 40, 27 };
+  static const uint8 clamped[] = { 15, 30, 15,  30, 60, 30,  15, 30, 15 };
+  for (int b = 0; b < 3; b++) {
+    Image img = ImageCreate(3, 3, PixMax);
+    if (img == NULL) error(2, errno, "ImageCreate: %s", ImageErrMsg());
+    ImageSetPixel(img, 1, 1, 240);
+    convolve(img, k121, k121, (ImageBorder)b);
+    expect(has(img, b == IMAGE_BORDER_SHRINK ? shrunk : clamped),
+           b == IMAGE_BORDER_SHRINK ? "1,2,1 (shrink)" : b == IMAGE_BORDER_CLAMP ? "1,2,1 (clamp)" : "1,2,1 (reflect)");
+    ImageDestroy(&img);
+  }
+  // With radius 2, reflect differs from clamp: 240 0 | 0 240 0 | 0 240
+  static const int binomial4[] = { 1, 4, 6, 4, 1 };
+  static const int one[] = { 1 };
+  ImageKernel k14641 = { 2, binomial4 };
+  ImageKernel k1 = { 0, one };
+  Image img = ImageCreate(3, 1, PixMax);
+  if (img == NULL) error(2, errno, "ImageCreate: %s", ImageErrMsg());
+  ImageSetPixel(img, 1, 0, 240);
+  convolve(img, k14641, k1, IMAGE_BORDER_REFLECT);
+  expect(has(img, (const uint8[]){ 75, 90, 75 }), "1,4,6,4,1 (reflect)");
+  ImageDestroy(&img);
+
+  // Pseudo-random images against the direct computation
+  static const int sharpen[] = { -1, -2, 10, -2, -1 };   // negative weights, saturation
+  static const int ramp[] = { 1, 2, 3, 4, 5, 6, 7 };
+  static const int heavy[] = { 3, 250, 3 };              // sum over 128: scalar path
+  static const int zero[] = { -1, 2, -1 };               // sum 0 (counts as 1)
+  ImageKernel kernels[] = { { 2, sharpen }, { 3, ramp }, { 1, heavy }, { 1, zero }, k121 };
+  const char* names[] = { "sharpen", "ramp", "heavy", "zero sum", "1,2,1" };
+  int nk = sizeof(kernels) / sizeof(kernels[0]);
+  img = ImageCreate(71, 37, PixMax);
+  if (img == NULL) error(2, errno, "ImageCreate: %s", ImageErrMsg());
+  unsigned seed = 1;
+  for (int y = 0; y < ImageHeight(img); y++) {
+    for (int x = 0; x < ImageWidth(img); x++) {
+      seed = seed * 1103515245u + 12345u;
+      ImageSetPixel(img, x, y, (uint8)(seed >> 16));
+    }
+  }
+  char what[64];
+  for (int i = 0; i < nk; i++) {
+    for (int b = 0; b < 3; b++) {
+      snprintf(what, sizeof(what), "%s x ramp, border %d", names[i], b);
+      expect(same(img, kernels[i], kernels[1], (ImageBorder)b), what);
+      snprintf(what, sizeof(what), "1,2,1 x %s, border %d", names[i], b);
+      expect(same(img, k121, kernels[i], (ImageBorder)b), what);
+    }
+  }
+  ImageDestroy(&img);
+
+  printf("# %s\n", failures ? "FAILED" : "PASSED");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,153 @@
+// testDirty - Test the incremental update of cached blurs.
+//
+// Modifies small rectangles of an image (pixels, pastes, blends, point
+// operations and blurs on rectangles), and checks that ImageBlurCached,
+// which only blurs again the pixels near them, gives the same result as
+// ImageBlur on a copy of the whole image.
+// Also times the update after pasting a 64x64 patch into a large image
+// (10000x10000, unless other dimensions are given), against a full blur.
+//
+// This program is part of a programming project
+// for the course AED, DETI / UA.PT
+
+#include <assert.h>
+#include <errno.h>
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+#define PATCH 64
+#define ROUNDS 200
+
+static int failures = 0;
+
+static void expect(int ok, const char* what) {
+  printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+  if (!ok) failures++;
+}
+
+// Do a and b have the same size and pixels?
+static int same(Image a, Image b) {
+  if (ImageWidth(a) != ImageWidth(b) || ImageHeight(a) != ImageHeight(b)) return 0;
+  return ImageMatchSubImage(a, 0, 0, b);
+}
+
+// Crop, or exit on failure.
+static Image crop(Image img, int x, int y, int w, int h) {
+  Image c = ImageCrop(img, x, y, w, h);
+  if (c == NULL) error(2, errno, "ImageCrop: %s", ImageErrMsg());
+  return c;
+}
+
+// Cached blur, or exit on failure.
+static Image blurCached(Image img, int dx, int dy) {
+  Image b = ImageBlurCached(img, dx, dy);
+  if (b == NULL) error(2, errno, "ImageBlurCached: %s", ImageErrMsg());
+  return b;
+}
+
+// Does the cached blur of img equal ImageBlur of a copy of img?
+static int blurOk(Image img, int dx, int dy) {
+  Image b = crop(img, 0, 0, ImageWidth(img), ImageHeight(img));
+  ImageBlur(b, dx, dy);
+  int ok = same(blurCached(img, dx, dy), b);
+  ImageDestroy(&b);
+  return ok;
+}
+
+// Fill img with a deterministic pseudo-random pattern.
+static void fill(Image img, unsigned seed) {
+  for (int y = 0; y < ImageHeight(img); y++) {
+    for (int x = 0; x < ImageWidth(img); x++) {
+      seed = seed * 1103515245u + 12345u;
+      ImageSetPixel(img, x, y, (uint8)(seed >> 16));
+    }
+  }
+}
+
+// Random modifications of small rectangles of img, with a check of the
+// cached blur after each group of them.
+static void modify(Image img, ImageLayout layout) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  int dx = 3, dy = 5;
+  Image patch = ImageCreate(PATCH, PATCH, PixMax);
+  if (patch == NULL) error(2, errno, "ImageCreate: %s", ImageErrMsg());
+  fill(patch, 7);
+  if (!ImageSetLayout(img, layout)) error(2, errno, "ImageSetLayout: %s", ImageErrMsg());
+  blurCached(img, dx, dy);
+  int ok = 1;
+  for (int r = 0; r < ROUNDS && ok; r++) {
+    int n = 1 + rand() % 25;   // more than fit in the list of dirty rectangles, sometimes
+    for (int k = 0; k < n; k++) {
+      int x = rand() % (w - PATCH + 1), y = rand() % (h - PATCH + 1);
+      int rw = rand() % (PATCH + 1), rh = rand() % (PATCH + 1);
+      switch (rand() % 7) {
+      case 0: ImageSetPixel(img, x, y, (uint8)rand()); break;
+      case 1: ImagePaste(img, x, y, patch); break;
+      case 2: ImageBlend(img, x, y, patch, 0.3); break;
+      case 3: ImageNegativeRect(img, x, y, rw, rh); break;
+      case 4: ImageThresholdRect(img, x, y, rw, rh, 100); break;
+      case 5: ImageBrightenRect(img, x, y, rw, rh, 1.2); break;
+      case 6: if (!ImageBlurRect(img, x, y, rw, rh, 2, 1)) error(2, errno, "ImageBlurRect: %s", ImageErrMsg()); break;
+      }
+    }
+    if (r % 50 == 49) ImageNegative(img);   // dirty all over
+    ok = blurOk(img, dx, dy);
+  }
+  ok = ok && blurOk(img, 0, 2);   // another filter size
+  ImageSetPixel(img, w - 1, h - 1, 1);
+  ok = ok && blurOk(img, 0, 2);
+  expect(ok, layout == IMAGE_RASTER ? "modify, blur (raster)" : "modify, blur (tiled)");
+  ImageDestroy(&patch);
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  ImageInit();
+  srand(1);
+  int w = 10000, h = 10000;
+  if (argc == 3) {
+    w = atoi(argv[1]);
+    h = atoi(argv[2]);
+  }
+  if (w < 4*PATCH || h < 4*PATCH) error(1, 0, "Dimensions must be at least %d", 4*PATCH);
+
+  for (int l = 0; l < 2; l++) {
+    Image img = ImageCreate(1000, 700, PixMax);
+    if (img == NULL) error(2, errno, "ImageCreate: %s", ImageErrMsg());
+    fill(img, 3);
+    modify(img, (ImageLayout)l);
+    ImageDestroy(&img);
+  }
+
+  // One 64x64 paste into a large image
+  Image big = ImageCreate(w, h, PixMax);
+  if (big == NULL) error(2, errno, "ImageCreate: %s", ImageErrMsg());
+  Image patch = ImageCreate(PATCH, PATCH, PixMax);
+  if (patch == NULL) error(2, errno, "ImageCreate: %s", ImageErrMsg());
+  fill(patch, 5);
+  int dx = 5, dy = 5;
+  double t0 = cpu_time();
+  blurCached(big, dx, dy);
+  double t1 = cpu_time();
+  ImagePaste(big, w / 2, h / 3, patch);
+  Image b = blurCached(big, dx, dy);
+  double t2 = cpu_time();
+  Image c = crop(big, w / 2 - 4*dx, h / 3 - 4*dy, PATCH + 8*dx, PATCH + 8*dy);
+  ImageBlur(c, dx, dy);
+  Image c2 = crop(b, w / 2 - 2*dx, h / 3 - 2*dy, PATCH + 4*dx, PATCH + 4*dy);
+  Image c3 = crop(c, 2*dx, 2*dy, PATCH + 4*dx, PATCH + 4*dy);
+  expect(same(c2, c3), "paste, blur (large image)");
+  printf("# %dx%d image, %dx%d mean filter: full blur %.6f s, after a %dx%d paste %.6f s\n",
+         w, h, 2*dx + 1, 2*dy + 1, t1 - t0, PATCH, PATCH, t2 - t1);
+  ImageDestroy(&c3);
+  ImageDestroy(&c2);
+  ImageDestroy(&c);
+  ImageDestroy(&patch);
+  ImageDestroy(&big);
+
+  printf("# %s\n", failures ? "FAILED" : "PASSED");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,228 @@
+// testLarge - Test the image8bit module on images of more than 4 gigapixels.
+//
+// Pixel offsets of such images do not fit in 32 bits.  Creates a
+// 70000x61400 image (about 4.3 gigapixels, unless other dimensions are
+// given), sets a patch of pixels near its end, and checks crop, paste,
+// blur, save and load there against the same operations on small images.
+// New images are black pages that the kernel supplies on first use, so
+// the image only takes memory as it is written: only a band of its last
+// rows is blurred.  Files are not written to disk: the saved image goes
+// through a pipe, where a thread keeps only the pixels near the patches,
+// and the image read back is a stream of black pixels, skipped to reach
+// a small image after it.  So the test needs little memory and no disk.
+//
+// This program is part of a programming project
+// for the course AED, DETI / UA.PT
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include "error.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+#define PATCH 64
+#define CHUNK (1 << 20)   // bytes read or written at a time in pipes
+
+static int failures = 0;
+
+static void expect(int ok, const char* what) {
+  printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+  if (!ok) failures++;
+}
+
+// Do a and b have the same size and pixels?
+static int same(Image a, Image b) {
+  if (ImageWidth(a) != ImageWidth(b) || ImageHeight(a) != ImageHeight(b)) return 0;
+  return ImageMatchSubImage(a, 0, 0, b);
+}
+
+// Crop, or exit on failure.
+static Image crop(Image img, int x, int y, int w, int h) {
+  Image c = ImageCrop(img, x, y, w, h);
+  if (c == NULL) error(2, errno, "ImageCrop: %s", ImageErrMsg());
+  return c;
+}
+
+// A rectangle of the pixels of a PGM stream, and the stream size
+struct region {
+  FILE* f;              // stream (read end of a pipe)
+  int x, y, w, h;       // rectangle
+  uint8* pixels;        // its pixels, row by row
+  int width, height;    // of the image in the stream
+  size_t bytes;         // number of pixel bytes in the stream
+  int ok;               // was the header valid and the rectangle read?
+};
+
+// Read and discard n bytes of f.  Returns the number of bytes read.
+static size_t discard(FILE* f, size_t n, uint8* buf) {
+  size_t total = 0;
+  while (total < n) {
+    size_t k = fread(buf, 1, (n - total < CHUNK) ? n - total : CHUNK, f);
+    if (k == 0) break;
+    total += k;
+  }
+  return total;
+}
+
+// Read the stream of region arg to its end, keeping the rectangle.
+static void* readRegion(void* arg) {
+  struct region* r = (struct region*)arg;
+  uint8* buf = malloc(CHUNK);
+  int maxval = 0;
+  r->ok = buf != NULL && fscanf(r->f, "P5 %d %d %d", &r->width, &r->height, &maxval) == 3 &&
+          isspace(fgetc(r->f));
+  size_t pos = 0;   // offset of the next pixel
+  for (int j = 0; r->ok && j < r->h; j++) {
+    size_t off = (size_t)(r->y + j) * r->width + r->x;
+    pos += discard(r->f, off - pos, buf);
+    r->ok = pos == off && fread(r->pixels + (size_t)j * r->w, 1, r->w, r->f) == (size_t)r->w;
+    pos += r->w;
+  }
+  if (buf != NULL) pos += discard(r->f, (size_t)-1, buf);
+  r->bytes = pos;
+  free(buf);
+  return NULL;
+}
+
+// A PGM stream with a black image of width x height pixels, followed by
+// the image after.
+struct blackStream {
+  FILE* f;              // stream (write end of a pipe)
+  int width, height;
+  Image after;
+};
+
+static void* writeBlack(void* arg) {
+  struct blackStream* s = (struct blackStream*)arg;
+  uint8* buf = calloc(CHUNK, 1);
+  size_t n = (size_t)s->width * s->height;
+  int ok = buf != NULL && fprintf(s->f, "P5\n%d %d\n255\n", s->width, s->height) > 0;
+  for (size_t i = 0; ok && i < n; i += CHUNK) {
+    size_t k = (n - i < CHUNK) ? n - i : CHUNK;
+    ok = fwrite(buf, 1, k, s->f) == k;
+  }
+  int w = ImageWidth(s->after), h = ImageHeight(s->after);
+  ok = ok && fprintf(s->f, "P5\n%d %d\n255\n", w, h) > 0;
+  for (int y = 0; ok && y < h; y++) {
+    for (int x = 0; ok && x < w; x++) ok = fputc(ImageGetPixel(s->after, x, y), s->f) != EOF;
+  }
+  fclose(s->f);   // (end of stream; a reader that stopped early gives EPIPE)
+  free(buf);
+  return NULL;
+}
+
+// Name of descriptor fd, for functions that take a file name.
+static const char* fdName(int fd, char name[32]) {
+  snprintf(name, 32, "/dev/fd/%d", fd);
+  return name;
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  ImageInit();
+  signal(SIGPIPE, SIG_IGN);   // (pipe errors are reported by write)
+  int w = 70000, h = 61400;
+  if (argc == 3) {
+    w = atoi(argv[1]);
+    h = atoi(argv[2]);
+  }
+  if (w < 8*PATCH || h < 8*PATCH) error(1, 0, "Dimensions must be at least %d", 8*PATCH);
+  printf("# %dx%d image, %.2f gigapixels\n", w, h, (double)w * h / 1e9);
+
+  Image img = ImageCreate(w, h, PixMax);
+  if (img == NULL) error(2, errno, "ImageCreate: %s", ImageErrMsg());
+  expect(ImageGetPixel(img, w - 1, h - 1) == 0, "create (last pixel is black)");
+
+  // A patch near the end, set pixel by pixel
+  int px = w - 4*PATCH, py = h - 4*PATCH;
+  Image patch = ImageCreate(PATCH, PATCH, PixMax);
+  if (patch == NULL) error(2, errno, "ImageCreate: %s", ImageErrMsg());
+  for (int y = 0; y < PATCH; y++) {
+    for (int x = 0; x < PATCH; x++) {
+      uint8 v = (uint8)(x*x + 3*y + 1);
+      ImageSetPixel(patch, x, y, v);
+      ImageSetPixel(img, px + x, py + y, v);
+    }
+  }
+  Image c = crop(img, px, py, PATCH, PATCH);
+  expect(same(c, patch), "set pixels, crop");
+  ImageDestroy(&c);
+
+  // Paste it further up and left, and also in the last rows
+  ImagePaste(img, px - 3*PATCH/2, py - PATCH, patch);
+  ImagePaste(img, 0, h - PATCH, patch);
+  c = crop(img, px - 3*PATCH/2, py - PATCH, PATCH, PATCH);
+  Image c2 = crop(img, 0, h - PATCH, PATCH, PATCH);
+  expect(same(c, patch) && same(c2, patch), "paste");
+  int fx = -1, fy = -1;
+  expect(ImageMatchSubImage(img, px, py, patch) && ImageLocateSubImage(c, &fx, &fy, patch) &&
+         fx == 0 && fy == 0, "match");
+  ImageDestroy(&c);
+  ImageDestroy(&c2);
+
+  // Blur the band of the last rows, from the top of a crop with margins
+  // around the patches: the pixels near the patches, blurred in the crop,
+  // must be the same (pixels far from the crop borders)
+  int m = 2*PATCH;
+  int by = py - PATCH - m;
+  Image around = crop(img, px - 3*PATCH/2 - m, by, 3*PATCH + 2*m, 2*PATCH + 2*m);
+  // (ImageBlur leaves the image unchanged if it runs out of memory)
+  ImageBlur(around, 5, 7);
+  if (!ImageBlurRect(img, 0, by, w, h - by, 5, 7)) error(2, errno, "ImageBlurRect: %s", ImageErrMsg());
+  c = crop(img, px - 3*PATCH/2 - m/2, py - PATCH - m/2, 3*PATCH + m, 2*PATCH + m);
+  c2 = crop(around, m/2, m/2, 3*PATCH + m, 2*PATCH + m);
+  expect(same(c, c2), "blur");
+  ImageDestroy(&c2);
+  ImageDestroy(&around);
+
+  // Save to a pipe, and compare the same region of the stream
+  int fd[2];
+  char name[32];
+  pthread_t tid;
+  if (pipe(fd) != 0) error(2, errno, "pipe");
+  struct region r = { .x = px - 3*PATCH/2 - m/2, .y = py - PATCH - m/2, .w = 3*PATCH + m, .h = 2*PATCH + m };
+  if ((r.pixels = malloc((size_t)r.w * r.h)) == NULL || (r.f = fdopen(fd[0], "rb")) == NULL ||
+      pthread_create(&tid, NULL, readRegion, &r) != 0) {
+    error(2, errno, "Reading the pipe");
+  }
+  int saved = ImageSave(img, fdName(fd[1], name));
+  close(fd[1]);
+  pthread_join(tid, NULL);
+  fclose(r.f);
+  c2 = ImageCreate(r.w, r.h, PixMax);
+  if (c2 == NULL) error(2, errno, "ImageCreate: %s", ImageErrMsg());
+  for (int y = 0; y < r.h; y++) {
+    for (int x = 0; x < r.w; x++) ImageSetPixel(c2, x, y, r.pixels[(size_t)y * r.w + x]);
+  }
+  expect(saved && r.ok && r.width == w && r.height == h && r.bytes == (size_t)w * h && same(c, c2), "save");
+  free(r.pixels);
+  ImageDestroy(&c2);
+  ImageDestroy(&c);
+
+  // Skip a black image read from a pipe, and load the patch after it
+  if (pipe(fd) != 0) error(2, errno, "pipe");
+  struct blackStream s = { .width = w, .height = h, .after = patch };
+  if ((s.f = fdopen(fd[1], "wb")) == NULL || pthread_create(&tid, NULL, writeBlack, &s) != 0) {
+    error(2, errno, "Writing the pipe");
+  }
+  ImageReader reader = ImageReaderOpen(fdName(fd[0], name));
+  close(fd[0]);
+  c = NULL;
+  int skipped = reader != NULL && ImageReaderSkip(reader) && (c = ImageReaderNext(reader)) != NULL;
+  ImageReaderClose(&reader);
+  pthread_join(tid, NULL);
+  expect(skipped && same(c, patch), "skip, load");
+  ImageDestroy(&c);
+
+  ImageDestroy(&img);
+  ImageDestroy(&patch);
+  printf("# %s\n", failures ? "FAILED" : "PASSED");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,142 @@
+// testStats - Test the statistics and histogram of images.
+//
+// Counts the levels of pseudo-random images, in raster and tiled layouts,
+// and checks ImageHistogram against a direct count.  Images have more
+// pixels than a single band, and widths that are not multiples of 4 nor
+// of the tile size, so run with IMAGE8BIT_THREADS > 1 to merge the
+// histograms of several bands.
+// Also checks ImageStatsEx against a direct computation, after each of
+// several modifications of the image, which must invalidate the
+// statistics cached in it.
+//
+// This program is part of a programming project
+// for the course AED, DETI / UA.PT
+
+#include <assert.h>
+#include <errno.h>
+#include "error.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static int failures = 0;
+
+static void expect(int ok, const char* what) {
+  printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+  if (!ok) failures++;
+}
+
+// New image with a deterministic pseudo-random pattern, with long runs of
+// the same level (as in scans), and all levels.
+static Image pattern(int w, int h, ImageLayout layout, unsigned seed) {
+  Image img = ImageCreateLayout(w, h, PixMax, layout);
+  if (img == NULL) error(2, errno, "ImageCreate: %s", ImageErrMsg());
+  uint8 level = 0;
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      seed = seed * 1103515245u + 12345u;
+      if ((seed >> 16) % 8 == 0) level = (uint8)(seed >> 20);
+      ImageSetPixel(img, x, y, level);
+    }
+  }
+  return img;
+}
+
+// Does hist have the number of pixels of each level of img?
+static int sameHistogram(Image img, const uint64_t hist[256]) {
+  uint64_t count[256] = {0};
+  for (int y = 0; y < ImageHeight(img); y++) {
+    for (int x = 0; x < ImageWidth(img); x++) count[ImageGetPixel(img, x, y)]++;
+  }
+  uint64_t total = 0;
+  for (int v = 0; v < 256; v++) {
+    if (hist[v] != count[v]) return 0;
+    total += hist[v];
+  }
+  return total == (uint64_t)ImageWidth(img) * ImageHeight(img);
+}
+
+// Are stats the statistics of img (computed directly)?
+static int sameStats(Image img, const ImageStatistics* stats) {
+  uint64_t sum = 0, sum2 = 0;
+  int min = 255, max = 0;
+  for (int y = 0; y < ImageHeight(img); y++) {
+    for (int x = 0; x < ImageWidth(img); x++) {
+      int v = ImageGetPixel(img, x, y);
+      sum += v;
+      sum2 += (uint64_t)v * v;
+      if (v < min) min = v;
+      if (v > max) max = v;
+    }
+  }
+  double n = (double)ImageWidth(img) * ImageHeight(img);
+  double mean = sum / n;
+  double variance = sum2 / n - mean * mean;
+  return stats->min == min && stats->max == max && stats->sum == sum &&
+         fabs(stats->mean - mean) < 1e-9 * (1 + mean) &&
+         fabs(stats->variance - variance) < 1e-6 * (1 + variance) &&
+         sameHistogram(img, stats->hist);
+}
+
+// Compute the statistics of img (cached after the first call) and check them.
+static void checkStats(Image img, const char* what) {
+  ImageStatistics stats;
+  ImageStatsEx(img, &stats);
+  expect(sameStats(img, &stats), what);
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  ImageInit();
+
+  char what[64];
+  int sizes[][2] = { {1, 1}, {3, 2}, {701, 503}, {130, 1999} };
+  for (int k = 0; k < 4; k++) {
+    for (int l = 0; l < 2; l++) {
+      ImageLayout layout = l ? IMAGE_TILED : IMAGE_RASTER;
+      Image img = pattern(sizes[k][0], sizes[k][1], layout, 7u * k);
+      uint64_t hist[256];
+      ImageHistogram(img, hist);
+      snprintf(what, sizeof(what), "histogram (%dx%d%s)", sizes[k][0], sizes[k][1], l ? ", tiled" : "");
+      expect(sameHistogram(img, hist), what);
+      ImageDestroy(&img);
+    }
+  }
+
+  // Statistics, recomputed after each modification
+  for (int l = 0; l < 2; l++) {
+    ImageLayout layout = l ? IMAGE_TILED : IMAGE_RASTER;
+    const char* tiled = l ? " (tiled)" : "";
+    Image img = pattern(301, 211, layout, 5);
+    Image patch = pattern(40, 30, IMAGE_RASTER, 9);
+    snprintf(what, sizeof(what), "stats%s", tiled);
+    checkStats(img, what);
+    checkStats(img, what);   // (cached)
+    ImageSetPixel(img, 300, 210, 255);
+    ImageSetPixel(img, 0, 0, 0);
+    snprintf(what, sizeof(what), "stats after set pixel%s", tiled);
+    checkStats(img, what);
+    ImagePaste(img, 100, 70, patch);
+    snprintf(what, sizeof(what), "stats after paste%s", tiled);
+    checkStats(img, what);
+    ImageNegativeRect(img, 10, 20, 90, 50);
+    snprintf(what, sizeof(what), "stats after negative rect%s", tiled);
+    checkStats(img, what);
+    ImageThresholdRect(img, 200, 100, 101, 111, 128);
+    snprintf(what, sizeof(what), "stats after threshold rect%s", tiled);
+    checkStats(img, what);
+    uint8 lut[256];
+    for (int v = 0; v < 256; v++) lut[v] = (uint8)(v / 3 + 40);
+    ImageApplyLUT(img, lut);
+    snprintf(what, sizeof(what), "stats after apply LUT%s", tiled);
+    checkStats(img, what);
+    ImageDestroy(&patch);
+    ImageDestroy(&img);
+  }
+
+  printf("# %s\n", failures ? "FAILED" : "PASSED");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,163 @@
+// testThreads - Test concurrent use of the image8bit module.
+//
+// Several threads run the same sequence of operations, each on its own
+// images (and all on a shared read-only image), and the results are
+// compared with a single-threaded run.
+// Also checks that error causes are kept per thread and that
+// instrumentation counters are exactly summed over all threads.
+//
+// This program is part of a programming project
+// for the course AED, DETI / UA.PT
+
+#include <assert.h>
+#include <errno.h>
+#include "error.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+#define NTHREADS 8
+#define ROUNDS 20
+
+// Shared image, only read by the threads
+static Image shared;
+
+// Name of a file with an invalid header
+static char badFile[] = "testThreads.tmp.pgm";
+
+static pthread_barrier_t barrier;
+
+struct result {
+  int id;
+  unsigned long checksum;
+  int errorsOk;
+};
+
+// Checksum of all pixels in img (through the public API).
+static unsigned long checksum(Image img) {
+  unsigned long sum = 0;
+  for (int y = 0; y < ImageHeight(img); y++)
+    for (int x = 0; x < ImageWidth(img); x++)
+      sum = sum * 31 + ImageGetPixel(img, x, y);
+  return sum;
+}
+
+// Run a pipeline of operations; returns a checksum of the results.
+static unsigned long work(void) {
+  unsigned long sum = 0;
+  for (int r = 0; r < ROUNDS; r++) {
+    Image img = ImageCreate(211, 163, PixMax);
+    if (img == NULL) error(2, errno, "ImageCreate: %s", ImageErrMsg());
+    for (int y = 0; y < 163; y++)
+      for (int x = 0; x < 211; x++)
+        ImageSetPixel(img, x, y, (uint8)(x*x + 7*y + r));
+    ImageNegative(img);
+    ImageBlur(img, 2, 3);
+    ImageMedian(img, 3, 1);
+    Image crop = ImageCrop(shared, r, 2*r, 100, 80);
+    if (crop == NULL) error(2, errno, "ImageCrop: %s", ImageErrMsg());
+    ImagePaste(img, 50, 40, crop);
+    int fx, fy;
+    ImageFindSubImage(shared, &fx, &fy, crop, IMAGE_NCC);
+    sum = sum * 7 + (unsigned long)(fx * 1000 + fy);
+    ImageEqualize(img);
+    ImageStatistics st;
+    ImageStatsEx(img, &st);
+    ImageStatsEx(shared, &st);
+    sum = sum * 7 + checksum(img) + st.sum;
+    ImageDestroy(&crop);
+    ImageDestroy(&img);
+  }
+  return sum;
+}
+
+static void* worker(void* arg) {
+  struct result* res = (struct result*)arg;
+  res->checksum = work();
+  return NULL;
+}
+
+// Fail in a thread-dependent way, wait for all threads to fail,
+// then check that this thread still sees its own error cause.
+static void* errorWorker(void* arg) {
+  struct result* res = (struct result*)arg;
+  int odd = res->id % 2;
+  const char* name = odd ? badFile : "/nonexistent/dir/file.pgm";
+  const char* expect = odd ? "Invalid file format" : "Open failed";
+  Image img = ImageLoad(name);
+  pthread_barrier_wait(&barrier);
+  res->errorsOk = img == NULL && strcmp(ImageErrMsg(), expect) == 0;
+  ImageDestroy(&img);
+  return NULL;
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  ImageInit();
+  int failures = 0;
+
+  shared = ImageCreate(300, 300, PixMax);
+  if (shared == NULL) error(2, errno, "ImageCreate: %s", ImageErrMsg());
+  for (int y = 0; y < 300; y++)
+    for (int x = 0; x < 300; x++)
+      ImageSetPixel(shared, x, y, (uint8)(x ^ y));
+  ImageStatistics st;
+  ImageStatsEx(shared, &st);  // fill the caches, so all runs count the same
+  for (int k = 0; k < ImagePyramidDepth(shared); k++) ImagePyramidLevel(shared, k);
+
+  // Single-threaded reference
+  InstrReset();
+  unsigned long expected = work();
+  unsigned long counts[NUMCOUNTERS];
+  for (int i = 0; i < NUMCOUNTERS; i++) counts[i] = InstrSum(i);
+
+  // Same work in NTHREADS concurrent threads
+  InstrReset();
+  pthread_t tid[NTHREADS];
+  struct result res[NTHREADS];
+  for (int t = 0; t < NTHREADS; t++) {
+    res[t].id = t;
+    if (pthread_create(&tid[t], NULL, worker, &res[t]) != 0)
+      error(2, errno, "pthread_create");
+  }
+  for (int t = 0; t < NTHREADS; t++) {
+    pthread_join(tid[t], NULL);
+    if (res[t].checksum != expected) {
+      printf("FAIL: thread %d results differ\n", t);
+      failures++;
+    }
+  }
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    if (InstrSum(i) != NTHREADS * counts[i]) {
+      printf("FAIL: counter %d is %lu, expected %lu\n", i, InstrSum(i), NTHREADS * counts[i]);
+      failures++;
+    }
+  }
+
+  // Per-thread error causes
+  FILE* f = fopen(badFile, "w");
+  if (f == NULL) error(2, errno, "%s", badFile);
+  fprintf(f, "P7\n1 1\n255\n0\n");
+  fclose(f);
+  pthread_barrier_init(&barrier, NULL, NTHREADS);
+  for (int t = 0; t < NTHREADS; t++) {
+    if (pthread_create(&tid[t], NULL, errorWorker, &res[t]) != 0)
+      error(2, errno, "pthread_create");
+  }
+  for (int t = 0; t < NTHREADS; t++) {
+    pthread_join(tid[t], NULL);
+    if (!res[t].errorsOk) {
+      printf("FAIL: thread %d has wrong error cause\n", t);
+      failures++;
+    }
+  }
+  pthread_barrier_destroy(&barrier);
+  remove(badFile);
+
+  ImageDestroy(&shared);
+  printf("# %s: %d threads\n", failures ? "FAILED" : "PASSED", NTHREADS);
+  return failures ? 1 : 0;
+}